@@ -0,0 +1,83 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Credential compiler
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Turns a "username password" text file into the salted, hashed
+// store the server maps with -a.
+// Usage: authc [-i iterations] Authentication.txt credentials.db
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "credentials.h"
+
+#define ERROR -1
+
+int main(int argc, char *argv[]){
+	struct Credentials store;
+	unsigned int iterations = CRED_DEFAULT_ITERATIONS;
+	unsigned char *image;
+	char tmpPath[4096];
+	size_t size;
+	FILE *fp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:")) != -1){
+		if (opt == 'i'){
+			iterations = strtoul(optarg, NULL, 10);
+		} else {
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (argc - optind != 2){
+		fprintf(stderr, "usage: authc [-i iterations] input.txt output.db\n");
+		return 1;
+	}
+
+	if ((fp = fopen(argv[optind], "r")) == NULL){
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (credentialsCompile(fp, iterations, &image, &size) == ERROR){
+		fprintf(stderr, "%s: no usable accounts\n", argv[optind]);
+		return 1;
+	}
+
+	fclose(fp);
+
+	// Write next to the target and rename, so a server never
+	// maps a half written store
+	snprintf(tmpPath, sizeof tmpPath, "%s.tmp", argv[optind + 1]);
+
+	if ((fp = fopen(tmpPath, "wb")) == NULL || fwrite(image, 1, size, fp) != size || fclose(fp) != 0){
+		perror(tmpPath);
+		return 1;
+	}
+
+	if (rename(tmpPath, argv[optind + 1]) == -1){
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	free(image);
+
+	if (credentialsMap(&store, argv[optind + 1]) == ERROR){
+		fprintf(stderr, "%s: failed to read back\n", argv[optind + 1]);
+		return 1;
+	}
+
+	printf("Compiled %zu accounts (%u slots, %u iterations, %zu bytes) to %s\n",
+		store.userCount, store.header->slotCount, store.header->iterations, size, argv[optind + 1]);
+
+	credentialsFree(&store);
+
+	return 0;
+}
@@ -0,0 +1,760 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Server internals benchmark suite
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Runs the modules the server is built from on their own, each
+// at every requested thread count and table size, and prints one
+// comma separated line per run so results can be kept and
+// compared from one commit to the next:
+//
+//	commit,benchmark,threads,size,operations,seconds,ops_per_sec
+//
+// Benchmarks:
+//	queue		push and pop through the request ring, half the
+//			threads producing and half consuming
+//	pool-shared	feed the worker pool through one shared queue,
+//			ops are requests served
+//	pool-sharded	the same with a queue shard per worker and
+//			work stealing
+//	slab		allocate and free session sized objects
+//	malloc		the same through malloc
+//	results		record wins and losses for random users
+//	ranks		read a random page of the rankings
+//	guess		play games with the engine, ops are guesses
+//	guess-legacy	the same games through the original strchr loop
+//	select		pick phrases from the alias tables
+//	dict-load	compile a text dictionary, ops are phrases
+//	cred-load	hash an account file, ops are accounts
+//	auth		check logins against the credential store
+//
+// Threaded benchmarks run for a fixed time; the loaders run on
+// one thread until the same time has passed. The pool benchmarks
+// run at each worker count instead, fed by one thread the way the
+// acceptor feeds the server, with a little work per request. Dictionaries and
+// account files are generated with the requested number of
+// entries, unless -d names a real dictionary.
+//
+// Usage: ./bench [-b benchmark,...] [-t threads,...] [-w workers,...]
+//		[-n phrases,...] [-u users,...] [-d dictionary] [-s seconds]
+//		[-c commit] [-o file]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "pool.h"
+#include "leaderboard.h"
+#include "dictionary.h"
+#include "game.h"
+#include "selection.h"
+#include "credentials.h"
+#include "slab.h"
+
+#define ERROR -1
+
+// Operations between checks of the stop flag
+#define BENCH_BATCH 64
+
+#define BENCH_MAX_LIST 16
+#define BENCH_QUEUE_SIZE 1024
+
+// Random number rounds each pool benchmark request takes
+#define BENCH_POOL_WORK 256
+
+// Roughly a session record
+#define BENCH_OBJECT_SIZE 768
+
+// Key derivation iterations for the generated credential stores.
+// A login costs one derivation, so at the server's default the
+// cred-load and auth figures scale down by the ratio; a small
+// count keeps the table work visible and setup quick.
+#define BENCH_CRED_ITERATIONS 16
+
+#define DEFAULT_BENCHMARKS "queue,pool-shared,pool-sharded,slab,malloc,results,ranks,guess,guess-legacy,select,dict-load,cred-load,auth"
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_WORKERS "4,16,64"
+#define DEFAULT_PHRASES "1000,100000"
+#define DEFAULT_USERS "1000,10000"
+
+static const char frequencyOrder[] = "etaoinshrdlcumwfgypbvkjxqz";
+
+struct BenchThread {
+	pthread_t thread;
+	int id;
+	int threads;
+	unsigned long long seed;
+	unsigned long ops;
+} __attribute__((aligned(CACHE_LINE)));	// threads never share a line
+
+typedef void (*BenchBody)(struct BenchThread *thread);
+
+static volatile int stopping = 0;
+static double runSeconds = 0.5;
+static const char *commit = "unknown";
+static FILE *out;
+
+// What the running benchmark works on
+static struct RequestQueue queue;
+static struct Slab slab;
+static volatile unsigned long poolSink;
+static struct Dictionary dictionary;
+static struct Credentials credentials;
+static char (*userNames)[32];
+static unsigned long userTotal;
+static char *dictionaryText, *accountText;
+static size_t dictionaryTextSize, accountTextSize;
+
+// Seconds since some fixed point
+static double now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, one state per thread
+static unsigned long long nextRandom(unsigned long long *state){
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Find the smaller of two numbers
+static int min(int a, int b){
+	return (a < b ? a : b);
+}
+
+/* ---------------------------------------------------------------- */
+// The original guess loop, kept for comparison
+/* ---------------------------------------------------------------- */
+
+struct LegacyGame {
+	struct Entry pair;
+	int guesses;
+	int lettersLeft;
+	char *words;
+	char guessedLetters[27];
+};
+
+// Set up the ____ _____ string the original way
+static void legacyStart(struct LegacyGame *game, const struct Dictionary *dictionary, size_t i){
+	struct Entry *pair = &game->pair;
+	int typeLength = dictionary->entries[i].typeLength;
+	int objectLength = dictionary->entries[i].objectLength;
+
+	pair->object = dictObject(dictionary, i);
+	pair->objectType = dictObjectType(dictionary, i);
+	pair->objectLength = objectLength;
+	pair->typeLength = typeLength;
+
+	game->guesses = min(objectLength + typeLength + 10, 26);
+	game->lettersLeft = objectLength + typeLength;
+	game->words = malloc(typeLength + objectLength + 2);
+	game->guessedLetters[0] = '\0';
+
+	memset(game->words, '_', typeLength);
+	memset(game->words + typeLength, ' ', 1);
+	memset(game->words + typeLength + 1, '_', objectLength);
+	memset(game->words + typeLength + 1 + objectLength, '\0', 1);
+}
+
+// The original guess loop
+static int legacyGuess(struct LegacyGame *game, char letter){
+	struct Entry *pair = &game->pair;
+	char guess[2] = { letter, '\0' };
+
+	if (letter != '\0' && !strchr(game->guessedLetters, letter)){
+
+		strcat(game->guessedLetters, guess);
+
+		for (int i = 0; i < pair->typeLength; i++){
+			if (letter == pair->objectType[i]){
+				memset(game->words + i, letter, 1);
+				game->lettersLeft--;
+			}
+		}
+
+		for (int i = 0; i < pair->objectLength; i++) {
+			if (letter == pair->object[i]){
+				memset(game->words + i + 1 + pair->typeLength, letter, 1);
+				game->lettersLeft--;
+			}
+		}
+	}
+
+	game->guesses--;
+
+	if (game->lettersLeft <= 0) return GAME_WIN;
+	if (game->guesses <= 0) return GAME_LOSS;
+	return GAME_CONTINUE;
+}
+
+/* ---------------------------------------------------------------- */
+// Benchmark bodies
+/* ---------------------------------------------------------------- */
+
+// With one thread, push and pop in turn. Otherwise even threads
+// produce and odd threads consume, and only pops are counted.
+static void queueBody(struct BenchThread *thread){
+	struct Request request = { 0, 0, 0 };
+	unsigned long ops = 0;
+
+	while (!stopping){
+		for (int i = 0; i < BENCH_BATCH; i++){
+			if (thread->threads == 1){
+				queueTryPush(&queue, &request);
+				queueTryPop(&queue, &request);
+				ops++;
+			} else if (thread->id % 2 == 0){
+				queueTryPush(&queue, &request);
+			} else if (queueTryPop(&queue, &request) == 1){
+				ops++;
+			}
+		}
+	}
+
+	thread->ops = ops;
+}
+
+// Stand in for serving a session
+static void poolRequest(struct Request *request, int worker){
+	unsigned long long state = request->number | 1;
+
+	for (int i = 0; i < BENCH_POOL_WORK; i++) nextRandom(&state);
+
+	if (state == 0) poolSink++;
+}
+
+// Allocate a batch of session sized objects and free them all,
+// from the slab or from malloc
+static void slabBody(struct BenchThread *thread){
+	void *objects[BENCH_BATCH];
+	unsigned long ops = 0;
+
+	while (!stopping){
+		for (int i = 0; i < BENCH_BATCH; i++) objects[i] = slabAlloc(&slab);
+		for (int i = 0; i < BENCH_BATCH; i++) slabFree(&slab, objects[i]);
+		ops += BENCH_BATCH;
+	}
+
+	thread->ops = ops;
+}
+
+static void mallocBody(struct BenchThread *thread){
+	void *objects[BENCH_BATCH];
+	unsigned long ops = 0;
+
+	while (!stopping){
+		for (int i = 0; i < BENCH_BATCH; i++) objects[i] = malloc(BENCH_OBJECT_SIZE);
+		for (int i = 0; i < BENCH_BATCH; i++) free(objects[i]);
+		ops += BENCH_BATCH;
+	}
+
+	thread->ops = ops;
+}
+
+static void resultsBody(struct BenchThread *thread){
+	unsigned long ops = 0;
+
+	while (!stopping){
+		for (int i = 0; i < BENCH_BATCH; i++){
+			unsigned long long r = nextRandom(&thread->seed);
+			char *name = userNames[r % userTotal];
+
+			if (r >> 63) addWinFor(name);
+			else addLossFor(name);
+		}
+
+		ops += BENCH_BATCH;
+	}
+
+	thread->ops = ops;
+}
+
+static void ranksBody(struct BenchThread *thread){
+	struct RankedRow rows[10];
+	unsigned long total, ops = 0;
+
+	while (!stopping){
+		for (int i = 0; i < BENCH_BATCH; i++){
+			rankedRange(nextRandom(&thread->seed) % userTotal, 10, rows, &total);
+		}
+
+		ops += BENCH_BATCH;
+	}
+
+	thread->ops = ops;
+}
+
+static void guessBody(struct BenchThread *thread){
+	unsigned long ops = 0;
+
+	while (!stopping){
+		struct Game game;
+		int result = GAME_CONTINUE;
+
+		if (startGame(&game, &dictionary, nextRandom(&thread->seed) % dictionary.entryCount) == ERROR){
+			fprintf(stderr, "guess: out of memory for games\n");
+			break;
+		}
+
+		for (int c = 0; result == GAME_CONTINUE; c++){
+			result = guessLetter(&game, frequencyOrder[c % 26]);
+			ops++;
+		}
+
+		endGame(&game);
+	}
+
+	thread->ops = ops;
+}
+
+static void legacyBody(struct BenchThread *thread){
+	unsigned long ops = 0;
+
+	while (!stopping){
+		struct LegacyGame game;
+		int result = GAME_CONTINUE;
+
+		legacyStart(&game, &dictionary, nextRandom(&thread->seed) % dictionary.entryCount);
+
+		for (int c = 0; result == GAME_CONTINUE; c++){
+			result = legacyGuess(&game, frequencyOrder[c % 26]);
+			ops++;
+		}
+
+		free(game.words);
+	}
+
+	thread->ops = ops;
+}
+
+static void selectBody(struct BenchThread *thread){
+	unsigned long ops = 0;
+
+	while (!stopping){
+		for (int i = 0; i < BENCH_BATCH; i++){
+			selectEntry(&dictionary, i % (DICT_BUCKETS + 1), NULL);
+		}
+
+		ops += BENCH_BATCH;
+	}
+
+	thread->ops = ops;
+}
+
+static void authBody(struct BenchThread *thread){
+	unsigned long ops = 0;
+	char name[32], password[32];
+
+	while (!stopping){
+		unsigned long user = nextRandom(&thread->seed) % userTotal;
+
+		snprintf(name, sizeof name, "user%lu", user);
+		snprintf(password, sizeof password, "pass%lu", user);
+
+		if (credentialsCheck(&credentials, name, password) < 0) fprintf(stderr, "auth: %s rejected\n", name);
+
+		ops++;
+	}
+
+	thread->ops = ops;
+}
+
+/* ---------------------------------------------------------------- */
+// Harness
+/* ---------------------------------------------------------------- */
+
+static BenchBody runningBody;
+
+static void *benchThread(void *data){
+	struct BenchThread *thread = data;
+
+	runningBody(thread);
+	return NULL;
+}
+
+// Run a body on some threads for runSeconds and print the result
+static void runThreaded(const char *name, BenchBody body, int threads, unsigned long size){
+	struct BenchThread *pool;
+	struct timespec runTime;
+	unsigned long ops = 0;
+	double start, elapsed;
+
+	if (posix_memalign((void **) &pool, CACHE_LINE, threads * sizeof *pool) != 0) return;
+	memset(pool, 0, threads * sizeof *pool);
+
+	runningBody = body;
+	stopping = 0;
+	start = now();
+
+	for (int i = 0; i < threads; i++){
+		pool[i].id = i;
+		pool[i].threads = threads;
+		pool[i].seed = (0x9E3779B97F4A7C15ULL * (i + 1)) | 1;
+		pthread_create(&pool[i].thread, NULL, benchThread, &pool[i]);
+	}
+
+	runTime.tv_sec = runSeconds;
+	runTime.tv_nsec = (runSeconds - runTime.tv_sec) * 1e9;
+	nanosleep(&runTime, NULL);
+	stopping = 1;
+
+	for (int i = 0; i < threads; i++){
+		pthread_join(pool[i].thread, NULL);
+		ops += pool[i].ops;
+	}
+
+	elapsed = now() - start;
+
+	fprintf(out, "%s,%s,%d,%lu,%lu,%.4f,%.0f\n", commit, name, threads, size, ops, elapsed, ops / elapsed);
+	fflush(out);
+
+	free(pool);
+}
+
+// Run a pool of workers with the given number of shards for
+// runSeconds, submitting from this thread, and print the result
+static void poolBench(const char *name, int workers, int shards){
+	struct WorkerPool pool;
+	struct Request request;
+	double start, elapsed;
+
+	if (poolStart(&pool, BENCH_QUEUE_SIZE, shards, 0, workers, workers, poolRequest) == ERROR){
+		perror("poolStart");
+		return;
+	}
+
+	memset(&request, 0, sizeof request);
+	start = now();
+
+	while (now() - start < runSeconds){
+		request.enqueued = poolNow();
+
+		for (int i = 0; i < BENCH_BATCH; i++){
+			request.number++;
+			while (poolSubmit(&pool, &request, -1) == ERROR) sched_yield();
+		}
+	}
+
+	poolJoin(&pool);
+	elapsed = now() - start;
+
+	fprintf(out, "%s,%s,%d,%d,%lu,%.4f,%.0f\n", commit, name, workers, shards, pool.stats.served, elapsed, pool.stats.served / elapsed);
+	fflush(out);
+
+	poolStop(&pool);
+}
+
+// Print the result of a single threaded loader run
+static void report(const char *name, unsigned long size, unsigned long ops, double elapsed){
+	fprintf(out, "%s,%s,1,%lu,%lu,%.4f,%.0f\n", commit, name, size, ops, elapsed, ops / elapsed);
+	fflush(out);
+}
+
+/* ---------------------------------------------------------------- */
+// Inputs
+/* ---------------------------------------------------------------- */
+
+// Generate "object,type" lines of random letters in 20 types
+static void makeDictionaryText(unsigned long phrases){
+	unsigned long long seed = 0x2545F4914F6CDD1DULL;
+	size_t cap = phrases * 32 + 1, len = 0;
+
+	free(dictionaryText);
+	dictionaryText = malloc(cap);
+
+	for (unsigned long i = 0; i < phrases; i++){
+		int length = 3 + nextRandom(&seed) % 10;
+
+		for (int c = 0; c < length; c++){
+			dictionaryText[len++] = 'a' + nextRandom(&seed) % 26;
+		}
+
+		len += sprintf(dictionaryText + len, ",type%c\n", (char) ('a' + i % 20));
+	}
+
+	dictionaryTextSize = len;
+}
+
+// Generate "userN passN" lines after a header line
+static void makeAccountText(unsigned long users){
+	size_t cap = users * 32 + 64, len = 0;
+
+	free(accountText);
+	accountText = malloc(cap);
+	len += sprintf(accountText, "Username\tPassword\n");
+
+	for (unsigned long i = 0; i < users; i++){
+		len += sprintf(accountText + len, "user%lu pass%lu\n", i, i);
+	}
+
+	accountTextSize = len;
+}
+
+// Compile the generated dictionary text into the dictionary
+static int compileDictionary(){
+	FILE *fp = fmemopen(dictionaryText, dictionaryTextSize, "r");
+	char path[] = "/tmp/benchdictXXXXXX";
+	unsigned char *image;
+	size_t size;
+	int fd, status;
+
+	if (fp == NULL || dictionaryCompile(fp, &image, &size) == ERROR) return ERROR;
+	fclose(fp);
+
+	// Go through a file so the image is attached the same way
+	// the server's is
+	if ((fd = mkstemp(path)) == -1) return ERROR;
+	status = write(fd, image, size) == (ssize_t) size ? dictionaryMap(&dictionary, path) : ERROR;
+	close(fd);
+	unlink(path);
+	free(image);
+
+	return status;
+}
+
+// Build the leaderboard and credential store for a user count
+static int loadUsers(unsigned long users){
+	char path[] = "/tmp/benchauthXXXXXX";
+	unsigned char *image;
+	size_t size;
+	FILE *fp;
+	int fd, status;
+
+	leaderboardFree();
+	if (leaderboardInit(users) == ERROR) return ERROR;
+
+	free(userNames);
+	userNames = malloc(users * sizeof *userNames);
+	userTotal = users;
+
+	for (unsigned long i = 0; i < users; i++){
+		snprintf(userNames[i], sizeof userNames[i], "user%lu", i);
+		if (addLeaderboardEntry(userNames[i]) == ERROR) return ERROR;
+	}
+
+	makeAccountText(users);
+	credentialsFree(&credentials);
+
+	if ((fp = fmemopen(accountText, accountTextSize, "r")) == NULL) return ERROR;
+	status = credentialsCompile(fp, BENCH_CRED_ITERATIONS, &image, &size);
+	fclose(fp);
+
+	if (status == ERROR) return ERROR;
+
+	if ((fd = mkstemp(path)) == -1) return ERROR;
+	status = write(fd, image, size) == (ssize_t) size ? credentialsMap(&credentials, path) : ERROR;
+	close(fd);
+	unlink(path);
+	free(image);
+
+	return status;
+}
+
+/* ---------------------------------------------------------------- */
+// Loader benchmarks
+/* ---------------------------------------------------------------- */
+
+static void dictLoadBench(unsigned long phrases){
+	unsigned long ops = 0;
+	double start = now(), elapsed;
+
+	do {
+		FILE *fp = fmemopen(dictionaryText, dictionaryTextSize, "r");
+		unsigned char *image;
+		size_t size;
+
+		if (dictionaryCompile(fp, &image, &size) != ERROR) free(image);
+		fclose(fp);
+
+		ops += phrases;
+	} while ((elapsed = now() - start) < runSeconds);
+
+	report("dict-load", phrases, ops, elapsed);
+}
+
+static void credLoadBench(unsigned long users){
+	unsigned long ops = 0;
+	double start = now(), elapsed;
+
+	do {
+		FILE *fp = fmemopen(accountText, accountTextSize, "r");
+		unsigned char *image;
+		size_t size;
+
+		if (credentialsCompile(fp, BENCH_CRED_ITERATIONS, &image, &size) != ERROR) free(image);
+		fclose(fp);
+
+		ops += users;
+	} while ((elapsed = now() - start) < runSeconds);
+
+	report("cred-load", users, ops, elapsed);
+}
+
+/* ---------------------------------------------------------------- */
+// Main
+/* ---------------------------------------------------------------- */
+
+// Parse "1,2,4" into a list, returning its length
+static int parseList(const char *text, unsigned long *list){
+	int count = 0;
+	char *end;
+
+	while (*text && count < BENCH_MAX_LIST){
+		unsigned long value = strtoul(text, &end, 10);
+
+		if (end == text) break;
+
+		list[count++] = value;
+		text = *end == ',' ? end + 1 : end;
+	}
+
+	return count;
+}
+
+// Whether name is in the comma separated list
+static int selected(const char *list, const char *name){
+	size_t len = strlen(name);
+
+	for (const char *p = list; (p = strstr(p, name)); p += len){
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	const char *benchmarks = DEFAULT_BENCHMARKS, *dictionaryPath = NULL;
+	unsigned long threads[BENCH_MAX_LIST], workers[BENCH_MAX_LIST], phrases[BENCH_MAX_LIST], users[BENCH_MAX_LIST];
+	int threadCount = parseList(DEFAULT_THREADS, threads);
+	int workerCount = parseList(DEFAULT_WORKERS, workers);
+	int phraseCount = parseList(DEFAULT_PHRASES, phrases);
+	int userCount = parseList(DEFAULT_USERS, users);
+	int opt;
+
+	out = stdout;
+	memset(&credentials, 0, sizeof credentials);
+
+	while ((opt = getopt(argc, argv, "b:t:w:n:u:d:s:c:o:")) != -1){
+		switch (opt){
+			case 'b': benchmarks = optarg; break;
+			case 't': threadCount = parseList(optarg, threads); break;
+			case 'w': workerCount = parseList(optarg, workers); break;
+			case 'n': phraseCount = parseList(optarg, phrases); break;
+			case 'u': userCount = parseList(optarg, users); break;
+			case 'd': dictionaryPath = optarg; phraseCount = 1; break;
+			case 's': runSeconds = atof(optarg); break;
+			case 'c': commit = optarg; break;
+			case 'o':
+				if ((out = fopen(optarg, "a")) == NULL){
+					perror(optarg);
+					return 1;
+				}
+			break;
+			default:
+				fprintf(stderr, "usage: bench [-b benchmark,...] [-t threads,...] [-w workers,...] [-n phrases,...]\n"
+					"             [-u users,...] [-d dictionary] [-s seconds] [-c commit] [-o file]\n");
+				return 1;
+		}
+	}
+
+	// Only write the column names at the top of a new file
+	if (ftell(out) <= 0) fprintf(out, "commit,benchmark,threads,size,operations,seconds,ops_per_sec\n");
+
+	selectionSeed(1);
+
+	if (gameInit() == ERROR || slabInit(&slab, "bench", BENCH_OBJECT_SIZE) == ERROR){
+		perror("slabInit");
+		return 1;
+	}
+
+	if (selected(benchmarks, "queue")){
+		queueInit(&queue, BENCH_QUEUE_SIZE);
+
+		for (int t = 0; t < threadCount; t++){
+			runThreaded("queue", queueBody, threads[t], BENCH_QUEUE_SIZE);
+		}
+
+		queueFree(&queue);
+	}
+
+	for (int w = 0; w < workerCount; w++){
+		if (selected(benchmarks, "pool-shared")) poolBench("pool-shared", workers[w], 1);
+		if (selected(benchmarks, "pool-sharded")) poolBench("pool-sharded", workers[w], workers[w]);
+	}
+
+	for (int t = 0; t < threadCount; t++){
+		if (selected(benchmarks, "slab")) runThreaded("slab", slabBody, threads[t], BENCH_OBJECT_SIZE);
+		if (selected(benchmarks, "malloc")) runThreaded("malloc", mallocBody, threads[t], BENCH_OBJECT_SIZE);
+	}
+
+	for (int n = 0; n < phraseCount; n++){
+		unsigned long size;
+
+		if (!selected(benchmarks, "guess") && !selected(benchmarks, "guess-legacy") &&
+			!selected(benchmarks, "select") && !selected(benchmarks, "dict-load")) break;
+
+		if (dictionaryPath){
+			if (dictionaryMap(&dictionary, dictionaryPath) == ERROR && dictionaryLoadText(&dictionary, dictionaryPath) == ERROR){
+				fprintf(stderr, "Could not load dictionary %s\n", dictionaryPath);
+				return 1;
+			}
+		} else {
+			makeDictionaryText(phrases[n]);
+
+			if (compileDictionary() == ERROR){
+				fprintf(stderr, "Could not compile %lu phrases\n", phrases[n]);
+				return 1;
+			}
+		}
+
+		size = dictionary.entryCount;
+
+		for (int t = 0; t < threadCount; t++){
+			if (selected(benchmarks, "guess")) runThreaded("guess", guessBody, threads[t], size);
+			if (selected(benchmarks, "guess-legacy")) runThreaded("guess-legacy", legacyBody, threads[t], size);
+			if (selected(benchmarks, "select")) runThreaded("select", selectBody, threads[t], size);
+		}
+
+		if (selected(benchmarks, "dict-load") && dictionaryText) dictLoadBench(size);
+
+		dictionaryFree(&dictionary);
+	}
+
+	for (int u = 0; u < userCount; u++){
+		if (!selected(benchmarks, "results") && !selected(benchmarks, "ranks") &&
+			!selected(benchmarks, "cred-load") && !selected(benchmarks, "auth")) break;
+
+		if (loadUsers(users[u]) == ERROR){
+			fprintf(stderr, "Could not set up %lu users\n", users[u]);
+			return 1;
+		}
+
+		for (int t = 0; t < threadCount; t++){
+			if (selected(benchmarks, "results")) runThreaded("results", resultsBody, threads[t], users[u]);
+			if (selected(benchmarks, "ranks")) runThreaded("ranks", ranksBody, threads[t], users[u]);
+			if (selected(benchmarks, "auth")) runThreaded("auth", authBody, threads[t], users[u]);
+		}
+
+		if (selected(benchmarks, "cred-load")) credLoadBench(users[u]);
+	}
+
+	leaderboardFree();
+	credentialsFree(&credentials);
+	slabDestroy(&slab);
+	gameFree();
+
+	if (out != stdout) fclose(out);
+
+	return 0;
+}
@@ -4,6 +4,7 @@
 //	Work of Bennett Hardwick and Caleb Plum
 /* ---------------------------------------------------------------- */
 
+#define _GNU_SOURCE
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <string.h> 
@@ -11,39 +12,105 @@
 #include <netdb.h> 
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <ctype.h>
+#include <poll.h>
+
+#include "protocol.h"
+#include "loadgen.h"
 
 #define MAX_USERNAME_LENGTH 16
 #define MAX_PASSWORD_LENGTH 16
+#define ERROR -1
+
 #define MAXDATASIZE 512
+#define RANK_PAGE_SIZE 10
+#define RANK_RADIUS 4
+#define RESUME_ATTEMPTS 5
+#define RESUME_RETRY_MS 100
 
 #define h_addr h_addr_list[0] // C99 compatability
 
+// A game the server has dealt that the user hasn't started on
+#define GAME_NONE 0
+#define GAME_PREFETCHED 1	// asked for, its state not yet read
+#define GAME_RESUMED 2		// its state is in frame, after a resume
+
+// A leaderboard row, its name kept in the board's names buffer
+struct BoardRow {
+	unsigned long played, won;
+	size_t name;
+	size_t nameLength;
+};
+
+// The last leaderboard the server sent, and its version. Rows
+// and names grow as needed and are reused by the next fetch.
+struct Board {
+	int valid;
+	unsigned long version;
+	struct BoardRow *rows;
+	size_t count, cap;
+	char *names;
+	size_t namesLength, namesCap;
+};
+
 char authenticateUser();
 void authFailed();
 void welcomeMessage();
 void connectToServer();
+int openConnection();
+int resumeSession();
+int waitForThread();
 
 int createLeaderboard();
 int addLeaderboardEntry(char *name);
 
-void menu();
-void showMenu(int a);
+void runSession();
+int menu();
 void hangman();
+int takeResumedGame();
 void quit();
+int sendRequest(int opcode, const void *payload, size_t len);
+void readWord(char *word, size_t size);
+void waitForInput();
 void leaderboard();
+int fetchLeaderboard();
+int addBoardRow(unsigned long played, unsigned long won, const unsigned char *name, size_t nameLength);
+void rankings();
 
 void handleInterrupt();
 
 void hangmanMessage();
+int recvFrame();
+void malformedFrame();
 
 char username[MAX_USERNAME_LENGTH];
 char password[MAX_PASSWORD_LENGTH];
 
 int sockfd, numbytes;  
 char buf[MAXDATASIZE];
+unsigned char in[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+struct FrameReader reader;
+struct Frame frame;
 struct hostent *he;
 struct sockaddr_in their_addr;
 
+// Ticket from the last login, for getting back in after a drop
+unsigned char ticket[RESUME_TICKET_SIZE];
+int hasTicket = 0;
+int resuming = 0;
+
+int pendingGame = GAME_NONE;
+
+// What the user has typed and not yet been read, and whether the
+// server has closed the connection while it was being typed
+char typed[MAXDATASIZE];
+size_t typedStart = 0, typedLength = 0;
+int typedEnd = 0;
+int serverClosed = 0;
+
+struct Board board;
+
 
 /* ---------------------------------------------------------------- */
 // Main
@@ -51,6 +118,9 @@ struct sockaddr_in their_addr;
 
 int main(int argc, char *argv[]) {
 
+	// Headless load generator
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) return loadgenMain(argc - 1, argv + 1);
+
 	signal(SIGINT, handleInterrupt);
 
 	connectToServer(&argc, argv);
@@ -58,7 +128,7 @@ int main(int argc, char *argv[]) {
 	if(authenticateUser()){
 
 		welcomeMessage();
-		showMenu(0);
+		runSession();
 
 	} else {
 		authFailed();
@@ -70,20 +140,44 @@ int main(int argc, char *argv[]) {
 	return 1;
 }
 
-void menu(){
+// Show the menu and carry out the user's choices until they
+// quit. Every screen returns here, so however long the session
+// runs the stack stays the same.
+void runSession(){
+
+	while (1) {
+		// A game the server resumed carries on at once
+		switch (pendingGame == GAME_RESUMED ? 1 : menu()) {
+			case 1:
+				hangman();
+			break;
+			case 2:
+				leaderboard();
+			break;
+			case 3:
+				rankings();
+			break;
+			case 4:
+				quit();
+			break;
+		}
+	}
+}
+
+int menu(){
 
 	char input[64];
 
 	puts("Please enter a selection:\n");
 	puts("<1> Play Hangman");
 	puts("<2> Show Leaderboard");
-	puts("<3> Quit\n");
-	printf("Enter an option (1-3): ");
-	scanf("%s", input);
+	puts("<3> Browse Rankings");
+	puts("<4> Quit\n");
+	printf("Enter an option (1-4): ");
+	readWord(input, sizeof input);
 	input[1] = '\0';
 
-	showMenu(atoi(input));
-
+	return atoi(input);
 }
 
 void quit(){
@@ -93,13 +187,14 @@ void quit(){
 	puts("                                       Good-bye!");
 	puts("\n");
 	puts("=====================================================================================");
+	frameSend(sockfd, OP_QUIT, NULL, 0);
 	close(sockfd);
 	exit(1);
 }
 
 void connectToServer(int *argc, char *argv[]) {
 	if (*argc != 3) {
-		fprintf(stderr,"usage: client hostname port\n");
+		fprintf(stderr,"usage: client hostname port\n       client --bench [options] hostname port\n");
 		exit(1);
 	}
 
@@ -108,23 +203,115 @@ void connectToServer(int *argc, char *argv[]) {
 		exit(1);
 	}
 
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		perror("socket");
-		exit(1);
-	}
-
 	their_addr.sin_family = AF_INET;      /* host byte order */
 	their_addr.sin_port = htons(atoi(argv[2]));    /* short, network byte order */
 	their_addr.sin_addr = *((struct in_addr *)he->h_addr);
 	bzero(&(their_addr.sin_zero), 8);     /* zero the rest of the struct */
 
-	if (connect(sockfd, (struct sockaddr *)&their_addr, \
-	sizeof(struct sockaddr)) == -1) {
+	if (openConnection() == -1) {
 		perror("connect");
 		exit(1);
 	}
 }
 
+// Connect to the server found by connectToServer
+int openConnection(){
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+
+	if (connect(sockfd, (struct sockaddr *)&their_addr, sizeof(struct sockaddr)) == -1) {
+		close(sockfd);
+		return -1;
+	}
+
+	frameReaderInit(&reader, in, sizeof in);
+	serverClosed = 0;
+	return 0;
+}
+
+// Wait for the next frame from the server. If the connection
+// has gone away, try to resume the session on a new one before
+// giving up. Returns 1 with the frame, or 0 if the session was
+// resumed and the reply lost; a resumed game is then in frame.
+int recvFrame(){
+	if (frameRecv(sockfd, &reader, &frame) > 0) return 1;
+
+	close(sockfd);
+
+	if (hasTicket && !resuming && resumeSession()) return 0;
+
+	puts("\nLost connection to the server.");
+	exit(1);
+}
+
+// Give up on a server that sent a frame too short for its opcode,
+// or too long for the buffer it is read into
+void malformedFrame(){
+	close(sockfd);
+
+	puts("\nThe server sent a malformed reply.");
+	exit(1);
+}
+
+// Reconnect and present the ticket from the last login. The
+// server may not have noticed the old connection close yet, so
+// a refused ticket is tried again a few times. If a game was in
+// progress its state is left in frame for the game to carry on
+// with; otherwise the menu is shown again. A game dealt ahead of
+// time comes back too, but the user hadn't started it, so it is
+// left for the next request to give up.
+int resumeSession(){
+	unsigned char payload[RESUME_TICKET_SIZE + MAX_USERNAME_LENGTH];
+	size_t nameLength = strlen(username);
+	int prefetched = pendingGame == GAME_PREFETCHED;
+	struct timespec retry = { 0, RESUME_RETRY_MS * 1000000L };
+
+	puts("\nLost connection to the server. Reconnecting...");
+
+	if (openConnection() == -1) return 0;
+
+	resuming = 1;
+	pendingGame = GAME_NONE;
+
+	if (!waitForThread()) {
+		resuming = 0;
+		close(sockfd);
+		return 0;
+	}
+
+	memcpy(payload, ticket, RESUME_TICKET_SIZE);
+	memcpy(payload + RESUME_TICKET_SIZE, username, nameLength);
+
+	for (int attempt = 0; attempt < RESUME_ATTEMPTS; attempt++) {
+		frameSend(sockfd, OP_RESUME, payload, RESUME_TICKET_SIZE + nameLength);
+		recvFrame();
+
+		if (frame.opcode == OP_AUTH_OK) break;
+		nanosleep(&retry, NULL);
+	}
+
+	resuming = 0;
+
+	if (frame.opcode != OP_AUTH_OK || frame.length < RESUME_TICKET_SIZE) {
+		hasTicket = 0;
+		close(sockfd);
+		return 0;
+	}
+
+	memcpy(ticket, frame.payload, RESUME_TICKET_SIZE);
+	puts("Reconnected.\n");
+
+	// The new connection may have reached another server, whose
+	// versions mean nothing to this one
+	board.valid = 0;
+
+	if (frame.length > RESUME_TICKET_SIZE && frame.payload[RESUME_TICKET_SIZE]) {
+		recvFrame();
+		if (!prefetched) pendingGame = GAME_RESUMED;
+	}
+
+	return 1;
+}
+
 void welcomeMessage() {
 	puts("");
 	puts("=====================================================================================");
@@ -155,7 +342,7 @@ void loginMessage() {
 	puts("");
 
 	printf("Enter your username: ");
-	scanf("%s", username);
+	readWord(username, sizeof username);
 	printf("Enter your password: ");
 }
 
@@ -169,64 +356,111 @@ void hangmanMessage(){
 	puts("|__|__|__|__|__|__|___,_|___|___|__|__|__|__|     \\___/|__|__|_____|____|__|__|_____|\n");
 }
 
-void showMenu(int a) {
-	switch(a){
-		case 1:
-			hangman();
-		break;
-		case 2:
-			leaderboard();
-		break;
-		case 3:
-			quit();
-		break;
-		default:
-			menu();
-		break;
-	}
-}
-
+// Play a game, starting on the one dealt ahead of time if there
+// is one. While the result is shown the next game is asked for,
+// so it is ready by the time the user wants it.
 void hangman(){
 	
-	send(sockfd, "hm-start", sizeof("hm-start"), 0);
+	if (pendingGame == GAME_NONE) frameSend(sockfd, OP_GAME_START, NULL, 0);
 
 	puts("=====================================================================================");
 	puts("                                  Let's play!\n");
 	hangmanMessage();
 
-	recv(sockfd, buf, MAXDATASIZE, 0);
+	if (!takeResumedGame()) {
+		pendingGame = GAME_NONE;
+		if (!recvFrame() && !takeResumedGame()) return;
+	}
 
-	char guessedLetters[26] = "\0";
+	// The server had no room for the game
+	if (frame.opcode == OP_BUSY) {
+		printf("The server is too busy to start a game. Try again in %lu seconds.\n\n",
+			frame.length >= 4 ? (get32(frame.payload) + 999) / 1000 : 1);
+		return;
+	}
 
-	do {
+	char guessedLetters[27] = "\0";
+	char batch[GUESS_BATCH_MAX];
 
-		int guesses = atoi(strtok(buf, "&"));
-		char *word = strtok(NULL, "&");
+	while (frame.opcode == OP_GAME_STATE || frame.opcode == OP_GUESS_RESULTS) {
+
+		int guesses;
+		size_t offset = 1;
 		char input[512];
+		int count = 0;
+
+		if (frame.length < 1) malformedFrame();
+		guesses = frame.payload[0];
+
+		// A batch reports each guess, then the state it left
+		if (frame.opcode == OP_GUESS_RESULTS) {
+			static const char *outcomes[] = { "miss", "hit", "already guessed" };
+
+			if (frame.length < 3 || frame.payload[2] > GUESS_BATCH_MAX || frame.length < 3 + (size_t) frame.payload[2]) malformedFrame();
+
+			guesses = frame.payload[1];
+			offset = 3 + frame.payload[2];
+
+			puts("");
+			for (int i = 0; i < frame.payload[2]; i++) {
+				printf("%c: %s\n", batch[i], outcomes[frame.payload[3 + i] % 3]);
+			}
+
+			// The win or loss follows
+			if (frame.payload[0] != BATCH_PLAYING) {
+				if (!recvFrame() && !takeResumedGame()) return;
+				continue;
+			}
+		}
+
+		if (frame.length - offset >= sizeof buf) malformedFrame();
+
+		memcpy(buf, frame.payload + offset, frame.length - offset);
+		buf[frame.length - offset] = '\0';
 
 		puts("-------------------------------------------------------------------------------------");
-		printf("Guesses: %s\n\nNumber of guesses left: %d\n\nWord: %s\n\n", guessedLetters, guesses, word);
-		printf("Please enter a guess (a-z): ");
-		scanf("%s", input);
-		input[1] = '\0';
+		printf("Guesses: %s\n\nNumber of guesses left: %d\n\nWord: %s\n\n", guessedLetters, guesses, buf);
+		printf("Please enter a guess, or several letters to guess in turn (a-z): ");
+		readWord(input, sizeof input);
 
-		if (!strchr(guessedLetters, input[0])) strcat(guessedLetters, &input[0]);
+		for (int i = 0; input[i] && count < GUESS_BATCH_MAX; i++) {
+			char letter[2] = { input[i], '\0' };
 
-		send(sockfd, input, sizeof(input), 0);
-		recv(sockfd, buf, MAXDATASIZE, 0);
+			if (input[i] < 'a' || input[i] > 'z') continue;
 
-	} while (strcmp(buf, "hm-win") != 0 && strcmp(buf, "hm-loss") != 0);
+			batch[count++] = input[i];
+			if (!strchr(guessedLetters, input[i])) strcat(guessedLetters, letter);
+		}
+
+		if (count > 1) {
+			frameSend(sockfd, OP_GUESS_BATCH, batch, count);
+		} else {
+			frameSend(sockfd, OP_GUESS, count ? batch : input, 1);
+		}
+
+		if (!recvFrame() && !takeResumedGame()) return;
+
+	}
 
 	puts("-------------------------------------------------------------------------------------\n");
 	
 	char input[64];
 
-	if (strcmp(buf, "hm-win") == 0){
-		send(sockfd, "phrase", sizeof("phrase"), 0);
-		recv(sockfd, buf, MAXDATASIZE, 0);
+	if (frame.opcode == OP_GAME_WIN){
+		if (frame.length >= sizeof buf) malformedFrame();
+
+		memcpy(buf, frame.payload, frame.length);
+		buf[frame.length] = '\0';
+	}
+
+	// Deal the next game while the result is on screen
+	frameSend(sockfd, OP_GAME_START, NULL, 0);
+	pendingGame = GAME_PREFETCHED;
+
+	if (frame.opcode == OP_GAME_WIN){
 		printf("Word: %s\n\n", buf);
 		printf("Congratulations! You won!\n\nWould you like to return to the menu? (y/n): ");
-		scanf("%s", input);
+		readWord(input, sizeof input);
 
 		input[1] = '\0';
 
@@ -234,43 +468,151 @@ void hangman(){
 			quit();
 		} else {
 			puts("\n-------------------------------------------------------------------------------------");
-			showMenu(0);
 		}
 
 	} else {
 
 		printf("Oh no! You lost!\n\nWould you like to return to the menu? (y/n): ");
-		scanf("%s", input);
+		readWord(input, sizeof input);
 
 		if(strcmp(&input[0], "n") == 0){
 			quit();
-		} else {
-			showMenu(0);
 		}
 
 	}
 }
 
+// Take up a game the server resumed, if there is one
+int takeResumedGame(){
+	if (pendingGame != GAME_RESUMED) return 0;
+
+	pendingGame = GAME_NONE;
+	return 1;
+}
+
+// Send a request from the menu. The server gives up a game dealt
+// ahead of time for it, so the state of that game comes first
+// and is read past. Returns 0 if the session was resumed instead.
+int sendRequest(int opcode, const void *payload, size_t len){
+	frameSend(sockfd, opcode, payload, len);
+
+	if (pendingGame != GAME_PREFETCHED) return 1;
+
+	pendingGame = GAME_NONE;
+	return recvFrame();
+}
+
+// Read the next word the user types, as scanf("%s") would, but
+// without blocking the connection: while waiting, the server's
+// frames are read ahead into the frame reader, so a reply or the
+// next game is there the moment it is asked for. Quits once the
+// input ends.
+void readWord(char *word, size_t size){
+
+	while (1) {
+		size_t length = 0;
+
+		while (typedLength > 0 && isspace((unsigned char) typed[typedStart])) {
+			typedStart++;
+			typedLength--;
+		}
+
+		while (length < typedLength && !isspace((unsigned char) typed[typedStart + length])) length++;
+
+		// A word is whole once something follows it, or the input
+		// has ended, or it fills the buffer
+		if (length > 0 && (length < typedLength || typedEnd || length == sizeof typed)) {
+			size_t copied = length < size - 1 ? length : size - 1;
+
+			memcpy(word, typed + typedStart, copied);
+			word[copied] = '\0';
+			typedStart += length;
+			typedLength -= length;
+			return;
+		}
+
+		if (typedEnd) quit();
+
+		memmove(typed, typed + typedStart, typedLength);
+		typedStart = 0;
+
+		waitForInput();
+	}
+}
+
+// Wait for the user to type more, reading whatever the server
+// sends in the meantime
+void waitForInput(){
+
+	struct pollfd fds[2];
+	int watchServer = !serverClosed && reader.len < reader.cap;
+	ssize_t n;
+
+	fflush(stdout);
+
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = sockfd;
+	fds[1].events = POLLIN;
+
+	if (poll(fds, watchServer ? 2 : 1, -1) == -1) return;
+
+	// A closed connection is found again, and resumed, by the
+	// next request
+	if (watchServer && fds[1].revents && frameReaderFill(&reader, sockfd) <= 0) serverClosed = 1;
+
+	if (fds[0].revents) {
+		if ((n = read(STDIN_FILENO, typed + typedLength, sizeof typed - typedLength)) <= 0) {
+			typedEnd = 1;
+		} else {
+			typedLength += n;
+		}
+	}
+}
+
 void checkForConnection(){
 	printf("Please wait to join the Hangman Online Game Lobby.\nYou have been placed in a queue.\n");
-	recv(sockfd, buf, MAXDATASIZE, 0);
+
+	if (!waitForThread()) exit(1);
 }
 
-void leaderboard(){
+// Wait for the server to pick the connection up, showing the
+// place in the queue as it goes. Returns 0 if the server is too
+// busy to take it.
+int waitForThread(){
+	recvFrame();
 
-	char *array[100];
-	int index = -1;
-	send(sockfd, "lb-start", sizeof("lb-start"), 0);
-	recv(sockfd, buf, MAXDATASIZE, 0);
+	while (frame.opcode == OP_QUEUED && frame.length >= 8) {
+		unsigned long wait = get32(frame.payload + 4);
 
-	do {
-		index++;
-		array[index] = malloc(sizeof buf);
-		strcpy(array[index], buf);
-		recv(sockfd, buf, MAXDATASIZE, 0);
+		if (wait) {
+			printf("You are number %lu in the queue, about %lu seconds to go.\n", get32(frame.payload), (wait + 999) / 1000);
+		} else {
+			printf("You are number %lu in the queue.\n", get32(frame.payload));
+		}
 
-	} while(strcmp(buf, "lb-end") != 0);
+		recvFrame();
+	}
 
+	if (frame.opcode == OP_BUSY) {
+		printf("The server is too busy right now. Try again in %lu seconds.\n",
+			frame.length >= 4 ? (get32(frame.payload) + 999) / 1000 : 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Show the leaderboard. The server is sent the version of the
+// copy held here, and only sends the rows again if it has changed.
+void leaderboard(){
+
+	int status = fetchLeaderboard();
+
+	if (status != 1) {
+		if (status == 0) puts("\nThe leaderboard could not be read.");
+		return;
+	}
 
 	puts("\nLeaderboard:");
 	puts("---------------------------------------------");
@@ -280,20 +622,163 @@ void leaderboard(){
 	printf("%-5s|\n", "Wins");
 	puts("---------------------------------------------");
 
-	for(int i = 0; i <= index; i++){
-		//printf("%s\n", array[i]);
-		printf("| %-5d| ", i + 1);
-		printf("%-20s| ", strtok(array[i], "&"));
-		printf("%-6s| ", strtok(NULL, "&"));
-		printf("%-5s|\n", strtok(NULL, "&"));
-	}
+	for (size_t i = 0; i < board.count; i++){
+		struct BoardRow *row = &board.rows[i];
 
-	for (int i = 0; i < index; i++){
-		free(array[i]);
+		printf("| %-5zu| ", i + 1);
+		printf("%-20.*s| ", (int) row->nameLength, board.names + row->name);
+		printf("%-6lu| ", row->played);
+		printf("%-5lu|\n", row->won);
 	}
 
 	puts("---------------------------------------------");
-	showMenu(0);
+}
+
+// Bring the board up to date. Returns 0 if the reply was cut
+// short or the rows could not be stored, or ERROR if the session
+// was resumed before it came.
+int fetchLeaderboard(){
+
+	unsigned char version[4];
+	int stored = 1;
+
+	put32(version, board.version);
+
+	if (!sendRequest(OP_LEADERBOARD, version, board.valid ? sizeof version : 0) || !recvFrame()) return ERROR;
+
+	if (frame.opcode == OP_LB_NOT_MODIFIED) return board.valid;
+
+	board.valid = 0;
+	board.count = 0;
+	board.namesLength = 0;
+
+	// Rows that can't be stored are still read, so the reply
+	// doesn't run on into the next one
+	while (frame.opcode == OP_LB_ROW) {
+		if (frame.length < 8 || !addBoardRow(get32(frame.payload), get32(frame.payload + 4), frame.payload + 8, frame.length - 8)) stored = 0;
+		if (!recvFrame()) return ERROR;
+	}
+
+	if (!stored || frame.opcode != OP_LB_END || frame.length < 4) return 0;
+
+	board.version = get32(frame.payload);
+	board.valid = 1;
+
+	return 1;
+}
+
+// Append a row to the board, growing it if it is full
+int addBoardRow(unsigned long played, unsigned long won, const unsigned char *name, size_t nameLength){
+
+	struct BoardRow *row;
+
+	if (board.count == board.cap) {
+		size_t cap = board.cap ? board.cap * 2 : 64;
+		struct BoardRow *rows = realloc(board.rows, cap * sizeof *rows);
+
+		if (rows == NULL) return 0;
+
+		board.rows = rows;
+		board.cap = cap;
+	}
+
+	if (board.namesLength + nameLength > board.namesCap) {
+		size_t cap = board.namesCap ? board.namesCap : 1024;
+		char *names;
+
+		while (cap < board.namesLength + nameLength) cap *= 2;
+
+		if ((names = realloc(board.names, cap)) == NULL) return 0;
+
+		board.names = names;
+		board.namesCap = cap;
+	}
+
+	row = &board.rows[board.count++];
+	row->played = played;
+	row->won = won;
+	row->name = board.namesLength;
+	row->nameLength = nameLength;
+
+	memcpy(board.names + board.namesLength, name, nameLength);
+	board.namesLength += nameLength;
+
+	return 1;
+}
+
+// Page through the rankings, or jump to the top
+// or to the user's own place in them.
+void rankings(){
+
+	unsigned char query[6];
+	unsigned long page = 0, total = 0;
+	char view = 't';
+	char input[64];
+	int sent;
+
+	while (view != 'b') {
+
+		if (view == 't') {
+			query[0] = 0;
+			query[1] = RANK_PAGE_SIZE;
+			sent = sendRequest(OP_LB_TOP, query, 2);
+			page = 0;
+		} else if (view == 'm') {
+			query[0] = 0;
+			query[1] = RANK_RADIUS;
+			sent = sendRequest(OP_LB_AROUND, query, 2);
+		} else {
+			put32(query, page);
+			query[4] = 0;
+			query[5] = RANK_PAGE_SIZE;
+			sent = sendRequest(OP_LB_PAGE, query, 6);
+		}
+
+		if (!sent) return;
+
+		puts("\nRankings:");
+		puts("---------------------------------------------");
+		printf("| %-5s| ", "Rank");
+		printf("%-20s| ", "Name");
+		printf("%-6s| ", "Plays");
+		printf("%-5s|\n", "Wins");
+		puts("---------------------------------------------");
+
+		if (!recvFrame()) return;
+
+		while (frame.opcode == OP_LB_RANK_ROW) {
+			if (frame.length < 12) malformedFrame();
+
+			printf("| %-5lu| ", get32(frame.payload));
+			printf("%-20.*s| ", (int) frame.length - 12, frame.payload + 12);
+			printf("%-6lu| ", get32(frame.payload + 4));
+			printf("%-5lu|\n", get32(frame.payload + 8));
+			if (!recvFrame()) return;
+		}
+
+		if (frame.length == 4) total = get32(frame.payload);
+
+		puts("---------------------------------------------");
+		if (view != 'm') printf("Page %lu of %lu\n", page + 1, (total + RANK_PAGE_SIZE - 1) / RANK_PAGE_SIZE);
+		printf("\n<n> Next page  <p> Previous page  <t> Top  <m> Around me  <b> Back: ");
+		readWord(input, sizeof input);
+
+		switch (input[0]) {
+			case 'n':
+				if ((page + 1) * RANK_PAGE_SIZE < total) page++;
+				view = 'n';
+			break;
+			case 'p':
+				if (page > 0) page--;
+				view = 'p';
+			break;
+			case 't':
+			case 'm':
+			case 'b':
+				view = input[0];
+			break;
+		}
+	}
 }
 
 char authenticateUser() {
@@ -301,13 +786,26 @@ char authenticateUser() {
 	checkForConnection();
 	loginMessage();
 
-	scanf("%s", password);
-	sprintf(buf, "%s&%s", username, password);
-	send(sockfd, buf, sizeof buf, 0);
-	recv(sockfd, buf, MAXDATASIZE, 0);
+	readWord(password, sizeof password);
+
+	// Username and password separated by a NUL
+	size_t length = strlen(username) + 1 + strlen(password);
+	memcpy(buf, username, strlen(username) + 1);
+	memcpy(buf + strlen(username) + 1, password, strlen(password));
+	frameSend(sockfd, OP_AUTH, buf, length);
+	recvFrame();
 
-	if (strcmp(buf, "success") == 0){
+	if (frame.opcode == OP_AUTH_OK){
+		if (frame.length >= RESUME_TICKET_SIZE) {
+			memcpy(ticket, frame.payload, RESUME_TICKET_SIZE);
+			hasTicket = 1;
+		}
 		return 1;
+	}	else if (frame.opcode == OP_BUSY) {
+		printf("The server can't take you right now. Try again in %lu seconds.\n",
+			frame.length >= 4 ? (get32(frame.payload) + 999) / 1000 : 1);
+		close(sockfd);
+		exit(1);
 	}	else {
 		close(sockfd);
 		return 0;
@@ -0,0 +1,459 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Credential store
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "credentials.h"
+
+#define ERROR -1
+
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+#define SHA256_BLOCK 64
+
+/* ---------------------------------------------------------------- */
+// SHA-256 (FIPS 180-4), HMAC and PBKDF2
+/* ---------------------------------------------------------------- */
+
+struct Sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t block[SHA256_BLOCK];
+	size_t used;
+};
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Mix one 64 byte block into the state
+static void sha256Block(uint32_t state[8], const uint8_t *p){
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+
+	for (int i = 0; i < 16; i++){
+		w[i] = ((uint32_t) p[i * 4] << 24) | ((uint32_t) p[i * 4 + 1] << 16) | ((uint32_t) p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	}
+
+	for (int i = 16; i < 64; i++){
+		uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (int i = 0; i < 64; i++){
+		uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+		uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256Init(struct Sha256 *ctx){
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, initial, sizeof initial);
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+static void sha256Update(struct Sha256 *ctx, const void *data, size_t len){
+	const uint8_t *p = data;
+
+	ctx->length += len;
+
+	while (len > 0){
+		size_t n = SHA256_BLOCK - ctx->used;
+
+		if (n > len) n = len;
+
+		memcpy(ctx->block + ctx->used, p, n);
+		ctx->used += n;
+		p += n;
+		len -= n;
+
+		if (ctx->used == SHA256_BLOCK){
+			sha256Block(ctx->state, ctx->block);
+			ctx->used = 0;
+		}
+	}
+}
+
+static void sha256Final(struct Sha256 *ctx, uint8_t out[CRED_HASH_SIZE]){
+	uint64_t bits = ctx->length * 8;
+	uint8_t pad = 0x80;
+
+	sha256Update(ctx, &pad, 1);
+	pad = 0;
+	while (ctx->used != SHA256_BLOCK - 8) sha256Update(ctx, &pad, 1);
+
+	for (int i = 7; i >= 0; i--) ctx->block[SHA256_BLOCK - 1 - i] = bits >> (i * 8);
+	sha256Block(ctx->state, ctx->block);
+
+	for (int i = 0; i < 8; i++){
+		out[i * 4] = ctx->state[i] >> 24;
+		out[i * 4 + 1] = ctx->state[i] >> 16;
+		out[i * 4 + 2] = ctx->state[i] >> 8;
+		out[i * 4 + 3] = ctx->state[i];
+	}
+}
+
+// SHA-256 of a buffer
+void sha256(const void *data, size_t len, uint8_t out[CRED_HASH_SIZE]){
+	struct Sha256 ctx;
+
+	sha256Init(&ctx);
+	sha256Update(&ctx, data, len);
+	sha256Final(&ctx, out);
+}
+
+// HMAC-SHA256 with the key already padded into its inner and
+// outer states, so PBKDF2 only pays for them once
+struct Hmac {
+	struct Sha256 inner, outer;
+};
+
+static void hmacInit(struct Hmac *hmac, const void *key, size_t keyLength){
+	uint8_t pad[SHA256_BLOCK], hashed[CRED_HASH_SIZE];
+
+	if (keyLength > SHA256_BLOCK){
+		sha256(key, keyLength, hashed);
+		key = hashed;
+		keyLength = CRED_HASH_SIZE;
+	}
+
+	memset(pad, 0x36, sizeof pad);
+	for (size_t i = 0; i < keyLength; i++) pad[i] ^= ((const uint8_t *) key)[i];
+	sha256Init(&hmac->inner);
+	sha256Update(&hmac->inner, pad, sizeof pad);
+
+	memset(pad, 0x5c, sizeof pad);
+	for (size_t i = 0; i < keyLength; i++) pad[i] ^= ((const uint8_t *) key)[i];
+	sha256Init(&hmac->outer);
+	sha256Update(&hmac->outer, pad, sizeof pad);
+}
+
+static void hmacRun(const struct Hmac *hmac, const void *data, size_t len, uint8_t out[CRED_HASH_SIZE]){
+	struct Sha256 ctx = hmac->inner;
+
+	sha256Update(&ctx, data, len);
+	sha256Final(&ctx, out);
+
+	ctx = hmac->outer;
+	sha256Update(&ctx, out, CRED_HASH_SIZE);
+	sha256Final(&ctx, out);
+}
+
+// PBKDF2-HMAC-SHA256 producing a single 32 byte block
+static void deriveKey(const char *password, const uint8_t *salt, unsigned int iterations, uint8_t out[CRED_HASH_SIZE]){
+	uint8_t first[CRED_SALT_SIZE + 4], u[CRED_HASH_SIZE];
+	struct Hmac hmac;
+
+	hmacInit(&hmac, password, strlen(password));
+
+	memcpy(first, salt, CRED_SALT_SIZE);
+	first[CRED_SALT_SIZE] = 0;
+	first[CRED_SALT_SIZE + 1] = 0;
+	first[CRED_SALT_SIZE + 2] = 0;
+	first[CRED_SALT_SIZE + 3] = 1;
+
+	hmacRun(&hmac, first, sizeof first, u);
+	memcpy(out, u, CRED_HASH_SIZE);
+
+	for (unsigned int i = 1; i < iterations; i++){
+		hmacRun(&hmac, u, CRED_HASH_SIZE, u);
+		for (int j = 0; j < CRED_HASH_SIZE; j++) out[j] ^= u[j];
+	}
+}
+
+/* ---------------------------------------------------------------- */
+// Store
+/* ---------------------------------------------------------------- */
+
+// FNV-1a hash of a string
+static unsigned long hashString(const char *s){
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*s){
+		hash ^= (unsigned char) *s++;
+		hash *= 1099511628211UL;
+	}
+
+	return hash;
+}
+
+// An account read from the text file, before it is hashed
+struct Account {
+	char *username;
+	char *password;
+};
+
+// Compile "username password" lines into a credential image.
+// The first line is the column header and is skipped, as are
+// blank lines. Malformed, overlong and duplicate accounts are
+// reported and skipped. The image is malloc'd.
+int credentialsCompile(FILE *fp, unsigned int iterations, unsigned char **image, size_t *size){
+	struct Account *accounts = NULL;
+	size_t count = 0, cap = 0, stringsLength = 0, slotCount = 16;
+	unsigned long lineNumber = 0;
+	char *line = NULL;
+	size_t lineCap = 0;
+	struct CredHeader header;
+	struct CredSlot *slots;
+	unsigned char *out;
+	char *strings;
+	FILE *urandom;
+
+	*image = NULL;
+	*size = 0;
+
+	if (iterations == 0) iterations = 1;
+
+	if ((urandom = fopen("/dev/urandom", "rb")) == NULL){
+		perror("/dev/urandom");
+		return ERROR;
+	}
+
+	while (getline(&line, &lineCap, fp) != -1){
+		char username[CRED_MAX_FIELD + 2], password[CRED_MAX_FIELD + 2], extra[2];
+		int fields;
+
+		if (lineNumber++ == 0) continue;
+
+		fields = sscanf(line, "%64s %64s %1s", username, password, extra);
+
+		if (fields <= 0) continue;
+
+		if (fields != 2 || strlen(username) > CRED_MAX_FIELD || strlen(password) > CRED_MAX_FIELD){
+			fprintf(stderr, "line %lu: expected username password\n", lineNumber);
+			continue;
+		}
+
+		if (count == cap){
+			cap = cap ? cap * 2 : 1024;
+			accounts = realloc(accounts, cap * sizeof(struct Account));
+		}
+
+		accounts[count].username = strdup(username);
+		accounts[count].password = strdup(password);
+		stringsLength += strlen(username) + 1;
+		count++;
+	}
+
+	free(line);
+
+	while (slotCount < count * 2) slotCount *= 2;
+
+	memset(&header, 0, sizeof header);
+	header.magic = CRED_MAGIC;
+	header.version = CRED_VERSION;
+	header.slotCount = slotCount;
+	header.iterations = iterations;
+	header.slotsOffset = ALIGN(sizeof header);
+	header.stringsOffset = header.slotsOffset + slotCount * sizeof(struct CredSlot);
+	header.size = header.stringsOffset + stringsLength + 1;
+
+	out = calloc(1, header.size);
+	slots = (struct CredSlot *) (out + header.slotsOffset);
+	strings = (char *) out + header.stringsOffset;
+	stringsLength = 0;
+
+	for (size_t a = 0; a < count; a++){
+		size_t i = hashString(accounts[a].username) & (slotCount - 1);
+		size_t length = strlen(accounts[a].username);
+		int duplicate = 0;
+
+		while (slots[i].name){
+			if (strcmp(strings + slots[i].name - 1, accounts[a].username) == 0){
+				duplicate = 1;
+				break;
+			}
+			i = (i + 1) & (slotCount - 1);
+		}
+
+		if (duplicate){
+			fprintf(stderr, "%s: duplicate account skipped\n", accounts[a].username);
+		} else if (fread(slots[i].salt, 1, CRED_SALT_SIZE, urandom) != CRED_SALT_SIZE){
+			fprintf(stderr, "%s: no randomness for a salt\n", accounts[a].username);
+		} else {
+			memcpy(strings + stringsLength, accounts[a].username, length + 1);
+			slots[i].name = stringsLength + 1;
+			slots[i].nameLength = length;
+			deriveKey(accounts[a].password, slots[i].salt, iterations, slots[i].hash);
+			stringsLength += length + 1;
+			header.userCount++;
+		}
+
+		// Don't leave plaintext lying around in freed memory
+		memset(accounts[a].password, 0, strlen(accounts[a].password));
+		free(accounts[a].password);
+		free(accounts[a].username);
+	}
+
+	free(accounts);
+	fclose(urandom);
+
+	header.size = header.stringsOffset + stringsLength + 1;
+	memcpy(out, &header, sizeof header);
+
+	*image = out;
+	*size = header.size;
+
+	return header.userCount > 0 ? 1 : ERROR;
+}
+
+// Check an image's header and point the store into it.
+// Only the header is inspected, so this is constant time.
+static int credentialsAttach(struct Credentials *store, void *image, size_t size){
+	const struct CredHeader *header = image;
+
+	if (size < sizeof(struct CredHeader)) return ERROR;
+	if (header->magic != CRED_MAGIC || header->version != CRED_VERSION) return ERROR;
+	if (header->size != size || header->userCount == 0 || header->iterations == 0) return ERROR;
+	if (header->slotCount == 0 || (header->slotCount & (header->slotCount - 1)) != 0) return ERROR;
+	if (header->slotsOffset + (uint64_t) header->slotCount * sizeof(struct CredSlot) > header->stringsOffset) return ERROR;
+	if (header->stringsOffset >= size || ((char *) image)[size - 1] != '\0') return ERROR;
+
+	store->header = header;
+	store->slots = (const struct CredSlot *) ((char *) image + header->slotsOffset);
+	store->strings = (char *) image + header->stringsOffset;
+	store->userCount = header->userCount;
+	store->image = image;
+	store->size = size;
+
+	return 1;
+}
+
+// Hash a text credential file straight into memory
+int credentialsLoadText(struct Credentials *store, const char *path){
+	unsigned char *image;
+	size_t size;
+	FILE *fp;
+	int status;
+
+	if ((fp = fopen(path, "r")) == NULL) return ERROR;
+
+	status = credentialsCompile(fp, CRED_DEFAULT_ITERATIONS, &image, &size);
+	fclose(fp);
+
+	if (status == ERROR || credentialsAttach(store, image, size) == ERROR){
+		free(image);
+		return ERROR;
+	}
+
+	store->mapped = 0;
+	return 1;
+}
+
+// Map a compiled credential store and use it in place
+int credentialsMap(struct Credentials *store, const char *path){
+	struct stat st;
+	void *image;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) return ERROR;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0){
+		close(fd);
+		return ERROR;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (image == MAP_FAILED) return ERROR;
+
+	if (credentialsAttach(store, image, st.st_size) == ERROR){
+		munmap(image, st.st_size);
+		return ERROR;
+	}
+
+	// Logins probe single slots, so don't bother reading ahead
+	madvise(image, st.st_size, MADV_RANDOM);
+
+	store->mapped = 1;
+	return 1;
+}
+
+// Unmap or free the store image
+void credentialsFree(struct Credentials *store){
+	if (store->image == NULL) return;
+
+	if (store->mapped){
+		munmap(store->image, store->size);
+	} else {
+		free(store->image);
+	}
+
+	store->image = NULL;
+	store->userCount = 0;
+}
+
+// Find the slot holding a username, or ERROR if there is none
+long credentialsFind(const struct Credentials *store, const char *username){
+	size_t mask = store->header->slotCount - 1;
+	size_t i = hashString(username) & mask;
+	size_t length = strlen(username);
+
+	while (store->slots[i].name){
+		const struct CredSlot *slot = &store->slots[i];
+
+		if (slot->nameLength == length && memcmp(store->strings + slot->name - 1, username, length) == 0){
+			return i;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return ERROR;
+}
+
+// Check a login. Returns the user's slot, or ERROR if the
+// username is unknown or the password is wrong. An unknown
+// username still pays for a key derivation, so the time taken
+// doesn't tell which accounts exist.
+long credentialsCheck(const struct Credentials *store, const char *username, const char *password){
+	static const uint8_t dummySalt[CRED_SALT_SIZE];
+	long slot = credentialsFind(store, username);
+	uint8_t hash[CRED_HASH_SIZE], diff = 0;
+
+	if (slot == ERROR){
+		deriveKey(password, dummySalt, store->header->iterations, hash);
+		return ERROR;
+	}
+
+	deriveKey(password, store->slots[slot].salt, store->header->iterations, hash);
+
+	// Compare every byte so the time taken says nothing about
+	// how much of the hash matched
+	for (int i = 0; i < CRED_HASH_SIZE; i++) diff |= hash[i] ^ store->slots[slot].hash[i];
+
+	return diff == 0 ? slot : ERROR;
+}
@@ -0,0 +1,93 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Credential store
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Accounts are held as one flat binary image, laid out like the
+// dictionary so it can be mapped and used in place:
+//
+//	CredHeader
+//	CredSlot[slotCount]	open addressed table keyed by username
+//	strings			NUL terminated usernames
+//
+// Passwords are never stored. Each slot keeps a random salt and
+// PBKDF2-HMAC-SHA256(password, salt, iterations), so checking a
+// login is one hash probe and one key derivation however many
+// accounts there are. An unknown username is derived against a
+// fixed salt all the same, so a login takes as long whether or
+// not the account exists.
+//
+// authc compiles Authentication.txt into such an image ahead of
+// time; the text file can still be loaded directly, in which
+// case it is hashed into the same layout at startup.
+
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CRED_MAGIC 0x44524348	// "HCRD" read as a native word
+#define CRED_VERSION 1
+
+#define CRED_SALT_SIZE 16
+#define CRED_HASH_SIZE 32
+
+// Longest username or password a store accepts
+#define CRED_MAX_FIELD 63
+
+// Logins are checked on the worker threads, so every iteration
+// is paid for by the other sessions on that worker. The default
+// favours slow offline guessing; authc -i can lower it where
+// login throughput matters more.
+#ifndef CRED_DEFAULT_ITERATIONS
+#define CRED_DEFAULT_ITERATIONS 10000
+#endif
+
+struct CredHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t userCount;
+	uint32_t slotCount;	// a power of two, at most half full
+	uint32_t iterations;
+	uint32_t reserved;
+	uint64_t slotsOffset;
+	uint64_t stringsOffset;
+	uint64_t size;
+};
+
+struct CredSlot {
+	uint32_t name;		// offset into the strings plus one, 0 if empty
+	uint32_t nameLength;
+	uint8_t salt[CRED_SALT_SIZE];
+	uint8_t hash[CRED_HASH_SIZE];
+};
+
+struct Credentials {
+	const struct CredHeader *header;
+	const struct CredSlot *slots;
+	const char *strings;
+	size_t userCount;
+
+	void *image;
+	size_t size;
+	int mapped;
+};
+
+int credentialsCompile(FILE *fp, unsigned int iterations, unsigned char **image, size_t *size);
+int credentialsLoadText(struct Credentials *store, const char *path);
+int credentialsMap(struct Credentials *store, const char *path);
+void credentialsFree(struct Credentials *store);
+
+long credentialsFind(const struct Credentials *store, const char *username);
+long credentialsCheck(const struct Credentials *store, const char *username, const char *password);
+
+void sha256(const void *data, size_t len, uint8_t out[CRED_HASH_SIZE]);
+
+static inline const char *credentialsName(const struct Credentials *store, long slot){
+	return store->strings + store->slots[slot].name - 1;
+}
+
+#endif
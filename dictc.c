@@ -0,0 +1,72 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Dictionary compiler
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Turns an "object,type" text file into the binary image the
+// server maps with -d. Usage: dictc hangman_text.txt hangman.dict
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dictionary.h"
+
+#define ERROR -1
+
+int main(int argc, char *argv[]){
+	struct Dictionary dictionary;
+	unsigned char *image;
+	char tmpPath[4096];
+	size_t size;
+	FILE *fp;
+
+	if (argc != 3){
+		fprintf(stderr, "usage: dictc input.txt output.dict\n");
+		return 1;
+	}
+
+	if ((fp = fopen(argv[1], "r")) == NULL){
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (dictionaryCompile(fp, &image, &size) == ERROR){
+		fprintf(stderr, "%s: no usable entries\n", argv[1]);
+		return 1;
+	}
+
+	fclose(fp);
+
+	// Write next to the target and rename, so a server never
+	// maps a half written dictionary
+	snprintf(tmpPath, sizeof tmpPath, "%s.tmp", argv[2]);
+
+	if ((fp = fopen(tmpPath, "wb")) == NULL || fwrite(image, 1, size, fp) != size || fclose(fp) != 0){
+		perror(tmpPath);
+		return 1;
+	}
+
+	if (rename(tmpPath, argv[2]) == -1){
+		perror(argv[2]);
+		return 1;
+	}
+
+	free(image);
+
+	if (dictionaryMap(&dictionary, argv[2]) == ERROR){
+		fprintf(stderr, "%s: failed to read back\n", argv[2]);
+		return 1;
+	}
+
+	printf("Compiled %zu phrases in %u categories (%zu bytes) to %s\n",
+		dictionary.entryCount, dictionary.header->categoryCount, size, argv[2]);
+	printf("Difficulty buckets: %u easy, %u medium, %u hard\n",
+		dictionary.header->buckets[0].count, dictionary.header->buckets[1].count, dictionary.header->buckets[2].count);
+
+	dictionaryFree(&dictionary);
+
+	return 0;
+}
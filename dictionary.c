@@ -0,0 +1,428 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Hangman dictionary
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dictionary.h"
+
+#define ERROR -1
+
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+// Growable byte buffer used while compiling
+struct Buffer {
+	unsigned char *data;
+	size_t len, cap;
+};
+
+// Append bytes to a buffer. Returns the offset they landed at.
+static size_t bufferAppend(struct Buffer *buffer, const void *p, size_t n){
+	size_t offset = buffer->len;
+
+	if (buffer->len + n > buffer->cap){
+		size_t cap = buffer->cap ? buffer->cap * 2 : 4096;
+		while (cap < buffer->len + n) cap *= 2;
+		buffer->data = realloc(buffer->data, cap);
+		buffer->cap = cap;
+	}
+
+	memcpy(buffer->data + buffer->len, p, n);
+	buffer->len += n;
+
+	return offset;
+}
+
+// FNV-1a hash of a string
+static unsigned long hashString(const char *s){
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*s){
+		hash ^= (unsigned char) *s++;
+		hash *= 1099511628211UL;
+	}
+
+	return hash;
+}
+
+// Categories seen so far, with a hash table of their indexes
+// (plus one) so each object type is only stored once
+struct CategorySet {
+	struct DictCategory *list;
+	size_t count, cap;
+	uint32_t *table;
+	size_t mask;
+};
+
+static void categoryIndex(struct CategorySet *set, struct Buffer *strings, size_t category){
+	size_t i = hashString((char *) strings->data + set->list[category].name) & set->mask;
+
+	while (set->table[i]) i = (i + 1) & set->mask;
+
+	set->table[i] = category + 1;
+}
+
+// Find the category for an object type, adding it if it is new
+static int findCategory(struct CategorySet *set, struct Buffer *strings, const char *type, size_t typeLength){
+	size_t i = hashString(type) & set->mask;
+
+	while (set->table[i]){
+		size_t category = set->table[i] - 1;
+
+		if (strcmp((char *) strings->data + set->list[category].name, type) == 0) return category;
+
+		i = (i + 1) & set->mask;
+	}
+
+	if (set->count == 0xffff) return ERROR;
+
+	if (set->count == set->cap){
+		set->cap = set->cap ? set->cap * 2 : 64;
+		set->list = realloc(set->list, set->cap * sizeof(struct DictCategory));
+	}
+
+	set->list[set->count].name = bufferAppend(strings, type, typeLength + 1);
+	set->list[set->count].entryCount = 0;
+	set->count++;
+
+	// Keep the table at most half full
+	if (set->count * 2 > set->mask + 1){
+		free(set->table);
+		set->mask = (set->mask + 1) * 2 - 1;
+		set->table = calloc(set->mask + 1, sizeof(uint32_t));
+
+		for (size_t c = 0; c < set->count; c++) categoryIndex(set, strings, c);
+	} else {
+		categoryIndex(set, strings, set->count - 1);
+	}
+
+	return set->count - 1;
+}
+
+// The set of letters a-z appearing in a string, one bit each
+uint32_t letterMask(const char *s, size_t len){
+	uint32_t mask = 0;
+
+	for (size_t i = 0; i < len; i++){
+		if (s[i] >= 'a' && s[i] <= 'z') mask |= 1u << (s[i] - 'a');
+	}
+
+	return mask;
+}
+
+// Count the bits set in a letter mask
+static int letterCount(uint32_t mask){
+	int count = 0;
+
+	for (; mask; mask &= mask - 1) count++;
+
+	return count;
+}
+
+// Score how hard a phrase is and place it in a bucket (0 based)
+static int entryBucket(const struct DictEntry *entry){
+	int length = entry->objectLength + entry->typeLength;
+	int spare = dictGuesses(length) - letterCount(entry->letters) - 10;
+	int score = letterCount(entry->letters) + 2 * letterCount(entry->letters & letterMask(DIFFICULTY_RARE_LETTERS, strlen(DIFFICULTY_RARE_LETTERS))) - spare;
+
+	if (score <= DIFFICULTY_EASY_MAX) return DIFFICULTY_EASY - 1;
+	if (score <= DIFFICULTY_MEDIUM_MAX) return DIFFICULTY_MEDIUM - 1;
+	return DIFFICULTY_HARD - 1;
+}
+
+// Build the alias table for one bucket (Vose's method). Each
+// entry weighs 1 / (entries of its category in the bucket).
+static void buildAlias(struct DictAlias *alias, const struct DictEntry *entries, size_t count, const uint32_t *categoryCount, size_t categories){
+	double *scaled = malloc(count * sizeof(double));
+	uint32_t *small = malloc(count * sizeof(uint32_t));
+	uint32_t *large = malloc(count * sizeof(uint32_t));
+	size_t smallCount = 0, largeCount = 0;
+
+	// Scale so the average cell is exactly 1
+	for (size_t i = 0; i < count; i++){
+		scaled[i] = (double) count / (categories * categoryCount[entries[i].category]);
+
+		if (scaled[i] < 1.0){
+			small[smallCount++] = i;
+		} else {
+			large[largeCount++] = i;
+		}
+	}
+
+	while (smallCount > 0 && largeCount > 0){
+		uint32_t less = small[--smallCount];
+		uint32_t more = large[largeCount - 1];
+
+		alias[less].threshold = scaled[less] * 4294967296.0;
+		alias[less].alias = more;
+
+		scaled[more] -= 1.0 - scaled[less];
+
+		if (scaled[more] < 1.0){
+			largeCount--;
+			small[smallCount++] = more;
+		}
+	}
+
+	// Whatever is left is 1 up to rounding error
+	while (largeCount > 0){
+		uint32_t i = large[--largeCount];
+		alias[i].threshold = UINT32_MAX;
+		alias[i].alias = i;
+	}
+
+	while (smallCount > 0){
+		uint32_t i = small[--smallCount];
+		alias[i].threshold = UINT32_MAX;
+		alias[i].alias = i;
+	}
+
+	free(scaled);
+	free(small);
+	free(large);
+}
+
+// Compile "object,type" lines into a dictionary image. Blank
+// lines are skipped, and malformed or overlong lines are
+// reported and skipped. Upper case letters are folded to lower
+// case. The image is malloc'd.
+int dictionaryCompile(FILE *fp, unsigned char **image, size_t *size){
+	struct Buffer strings = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+	struct CategorySet categories = { NULL, 0, 0, NULL, 63 };
+	struct DictEntry *entries = NULL, *sorted;
+	struct DictAlias *alias;
+	uint32_t *categoryCount;
+	size_t count = 0, cap = 0;
+	unsigned long lineNumber = 0;
+	char *line = NULL;
+	size_t lineCap = 0;
+	struct DictHeader header;
+
+	categories.table = calloc(categories.mask + 1, sizeof(uint32_t));
+
+	while (getline(&line, &lineCap, fp) != -1){
+		char *comma, *object, *type;
+		size_t objectLength, typeLength, end = strlen(line);
+		int category;
+
+		lineNumber++;
+
+		while (end > 0 && (line[end - 1] == '\n' || line[end - 1] == '\r' || line[end - 1] == ' ' || line[end - 1] == '\t')){
+			line[--end] = '\0';
+		}
+
+		if (end == 0) continue;
+
+		for (size_t i = 0; i < end; i++){
+			if (line[i] >= 'A' && line[i] <= 'Z') line[i] += 'a' - 'A';
+		}
+
+		if ((comma = strchr(line, ',')) == NULL){
+			fprintf(stderr, "line %lu: expected object,type\n", lineNumber);
+			continue;
+		}
+
+		*comma = '\0';
+		object = line;
+		type = comma + 1;
+		objectLength = comma - line;
+		typeLength = end - objectLength - 1;
+
+		if (objectLength == 0 || typeLength == 0 || objectLength + 1 + typeLength > DICT_MAX_PHRASE){
+			fprintf(stderr, "line %lu: empty or longer than %d characters\n", lineNumber, DICT_MAX_PHRASE);
+			continue;
+		}
+
+		if ((category = findCategory(&categories, &strings, type, typeLength)) == ERROR){
+			fprintf(stderr, "line %lu: too many categories\n", lineNumber);
+			continue;
+		}
+
+		if (count == cap){
+			cap = cap ? cap * 2 : 1024;
+			entries = realloc(entries, cap * sizeof(struct DictEntry));
+		}
+
+		entries[count].object = bufferAppend(&strings, object, objectLength + 1);
+		entries[count].objectType = categories.list[category].name;
+		entries[count].objectLength = objectLength;
+		entries[count].typeLength = typeLength;
+		entries[count].letters = letterMask(object, objectLength) | letterMask(type, typeLength);
+		entries[count].category = category;
+		entries[count].difficulty = entryBucket(&entries[count]) + 1;
+		entries[count].reserved = 0;
+		categories.list[category].entryCount++;
+		count++;
+	}
+
+	free(line);
+
+	memset(&header, 0, sizeof header);
+
+	// Sort the entries into their buckets, keeping file order
+	// within each, then build each bucket's alias table
+	sorted = malloc((count ? count : 1) * sizeof(struct DictEntry));
+	alias = malloc((count ? count : 1) * sizeof(struct DictAlias));
+	categoryCount = malloc((categories.count ? categories.count : 1) * sizeof(uint32_t));
+
+	for (size_t i = 0; i < count; i++) header.buckets[entries[i].difficulty - 1].count++;
+
+	for (int b = 1; b < DICT_BUCKETS; b++){
+		header.buckets[b].first = header.buckets[b - 1].first + header.buckets[b - 1].count;
+	}
+
+	for (int b = 0; b < DICT_BUCKETS; b++){
+		struct DictBucket *bucket = &header.buckets[b];
+		size_t n = 0;
+
+		memset(categoryCount, 0, categories.count * sizeof(uint32_t));
+
+		for (size_t i = 0; i < count; i++){
+			if (entries[i].difficulty != b + 1) continue;
+
+			sorted[bucket->first + n++] = entries[i];
+			if (categoryCount[entries[i].category]++ == 0) bucket->weight++;
+		}
+
+		if (bucket->count) buildAlias(alias + bucket->first, sorted + bucket->first, bucket->count, categoryCount, bucket->weight);
+	}
+
+	free(entries);
+	free(categoryCount);
+	entries = sorted;
+
+	// Lay the sections out one after another, 8 byte aligned
+	header.magic = DICT_MAGIC;
+	header.version = DICT_VERSION;
+	header.entryCount = count;
+	header.categoryCount = categories.count;
+	header.entriesOffset = ALIGN(sizeof header);
+	header.categoriesOffset = ALIGN(header.entriesOffset + count * sizeof(struct DictEntry));
+	header.aliasOffset = ALIGN(header.categoriesOffset + categories.count * sizeof(struct DictCategory));
+	header.stringsOffset = ALIGN(header.aliasOffset + count * sizeof(struct DictAlias));
+	header.size = header.stringsOffset + strings.len;
+
+	out.data = calloc(1, header.size);
+	out.cap = out.len = header.size;
+
+	memcpy(out.data, &header, sizeof header);
+	if (count) memcpy(out.data + header.entriesOffset, entries, count * sizeof(struct DictEntry));
+	if (categories.count) memcpy(out.data + header.categoriesOffset, categories.list, categories.count * sizeof(struct DictCategory));
+	if (count) memcpy(out.data + header.aliasOffset, alias, count * sizeof(struct DictAlias));
+	if (strings.len) memcpy(out.data + header.stringsOffset, strings.data, strings.len);
+
+	free(entries);
+	free(alias);
+	free(strings.data);
+	free(categories.list);
+	free(categories.table);
+
+	*image = out.data;
+	*size = header.size;
+
+	return count > 0 ? 1 : ERROR;
+}
+
+// Check an image's header and point the dictionary into it.
+// Only the header is inspected, so this is constant time.
+static int dictionaryAttach(struct Dictionary *dictionary, void *image, size_t size){
+	const struct DictHeader *header = image;
+
+	if (size < sizeof(struct DictHeader)) return ERROR;
+	if (header->magic != DICT_MAGIC || header->version != DICT_VERSION) return ERROR;
+	if (header->size != size || header->entryCount == 0) return ERROR;
+	if (header->entriesOffset + (uint64_t) header->entryCount * sizeof(struct DictEntry) > size) return ERROR;
+	if (header->categoriesOffset + (uint64_t) header->categoryCount * sizeof(struct DictCategory) > size) return ERROR;
+	if (header->aliasOffset + (uint64_t) header->entryCount * sizeof(struct DictAlias) > size) return ERROR;
+	if (header->stringsOffset >= size || ((char *) image)[size - 1] != '\0') return ERROR;
+
+	for (int b = 0; b < DICT_BUCKETS; b++){
+		if ((uint64_t) header->buckets[b].first + header->buckets[b].count > header->entryCount) return ERROR;
+	}
+
+	dictionary->header = header;
+	dictionary->entries = (const struct DictEntry *) ((char *) image + header->entriesOffset);
+	dictionary->categories = (const struct DictCategory *) ((char *) image + header->categoriesOffset);
+	dictionary->alias = (const struct DictAlias *) ((char *) image + header->aliasOffset);
+	dictionary->strings = (char *) image + header->stringsOffset;
+	dictionary->entryCount = header->entryCount;
+	dictionary->image = image;
+	dictionary->size = size;
+
+	return 1;
+}
+
+// Compile a text dictionary straight into memory
+int dictionaryLoadText(struct Dictionary *dictionary, const char *path){
+	unsigned char *image;
+	size_t size;
+	FILE *fp;
+	int status;
+
+	if ((fp = fopen(path, "r")) == NULL) return ERROR;
+
+	status = dictionaryCompile(fp, &image, &size);
+	fclose(fp);
+
+	if (status == ERROR || dictionaryAttach(dictionary, image, size) == ERROR){
+		free(image);
+		return ERROR;
+	}
+
+	dictionary->mapped = 0;
+	return 1;
+}
+
+// Map a compiled dictionary and use it in place. Pages are
+// only read in as games touch them.
+int dictionaryMap(struct Dictionary *dictionary, const char *path){
+	struct stat st;
+	void *image;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) return ERROR;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0){
+		close(fd);
+		return ERROR;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (image == MAP_FAILED) return ERROR;
+
+	if (dictionaryAttach(dictionary, image, st.st_size) == ERROR){
+		munmap(image, st.st_size);
+		return ERROR;
+	}
+
+	// Games pick phrases at random, so don't bother reading ahead
+	madvise(image, st.st_size, MADV_RANDOM);
+
+	dictionary->mapped = 1;
+	return 1;
+}
+
+// Unmap or free the dictionary image
+void dictionaryFree(struct Dictionary *dictionary){
+	if (dictionary->image == NULL) return;
+
+	if (dictionary->mapped){
+		munmap(dictionary->image, dictionary->size);
+	} else {
+		free(dictionary->image);
+	}
+
+	dictionary->image = NULL;
+	dictionary->entryCount = 0;
+}
@@ -0,0 +1,129 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Hangman dictionary
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// The dictionary is held as one flat binary image:
+//
+//	DictHeader
+//	DictEntry[entryCount]		offsets and lengths of each phrase
+//	DictCategory[categoryCount]	one per distinct object type
+//	DictAlias[entryCount]		sampling tables, see below
+//	strings				NUL terminated, types stored once
+//
+// Entries are sorted into difficulty buckets, and each bucket
+// has an alias table over its entries for O(1) weighted picks.
+// Within a bucket every category carries the same total weight,
+// so a category with many phrases doesn't crowd out the rest.
+//
+// dictc compiles hangman_text.txt into such an image ahead of
+// time, and the server can mmap it and use it in place, so
+// startup costs the same however many phrases there are. The
+// text file can still be loaded directly; it is compiled into
+// the same layout in memory first.
+
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define DICT_MAGIC 0x54434448	// "HDCT" read as a native word
+#define DICT_VERSION 3
+
+// Longest "type object" phrase a game can be played with
+#define DICT_MAX_PHRASE 255
+
+// Difficulty buckets. A phrase's score is its distinct letters,
+// plus two for each rare one, less the spare guesses a long
+// phrase earns beyond the usual ten.
+#define DIFFICULTY_ANY 0
+#define DIFFICULTY_EASY 1
+#define DIFFICULTY_MEDIUM 2
+#define DIFFICULTY_HARD 3
+#define DICT_BUCKETS 3
+
+#define DIFFICULTY_EASY_MAX 5
+#define DIFFICULTY_MEDIUM_MAX 8
+#define DIFFICULTY_RARE_LETTERS "jkqvxz"
+
+struct DictBucket {
+	uint32_t first;		// first entry in the bucket
+	uint32_t count;
+	uint32_t weight;	// categories in the bucket
+	uint32_t reserved;
+};
+
+struct DictHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entryCount;
+	uint32_t categoryCount;
+	uint64_t entriesOffset;
+	uint64_t categoriesOffset;
+	uint64_t aliasOffset;
+	uint64_t stringsOffset;
+	uint64_t size;
+	struct DictBucket buckets[DICT_BUCKETS];
+};
+
+struct DictEntry {
+	uint32_t object;	// offsets into the string area
+	uint32_t objectType;
+	uint32_t letters;	// bit n set if 'a' + n is in the phrase
+	uint16_t objectLength;
+	uint16_t typeLength;
+	uint16_t category;
+	uint8_t difficulty;
+	uint8_t reserved;
+};
+
+// One cell of a bucket's alias table: keep the bucket's i-th
+// entry if a uniform 32 bit draw is below threshold, otherwise
+// take the alias-th
+struct DictAlias {
+	uint32_t threshold;
+	uint32_t alias;
+};
+
+struct DictCategory {
+	uint32_t name;
+	uint32_t entryCount;
+};
+
+struct Dictionary {
+	const struct DictHeader *header;
+	const struct DictEntry *entries;
+	const struct DictCategory *categories;
+	const struct DictAlias *alias;
+	const char *strings;
+	size_t entryCount;
+
+	void *image;
+	size_t size;
+	int mapped;
+};
+
+int dictionaryCompile(FILE *fp, unsigned char **image, size_t *size);
+int dictionaryLoadText(struct Dictionary *dictionary, const char *path);
+int dictionaryMap(struct Dictionary *dictionary, const char *path);
+void dictionaryFree(struct Dictionary *dictionary);
+
+uint32_t letterMask(const char *s, size_t len);
+
+// Guesses a game of a phrase with this many letters allows
+static inline int dictGuesses(int length){
+	return length + 10 < 26 ? length + 10 : 26;
+}
+
+static inline const char *dictObject(const struct Dictionary *dictionary, size_t i){
+	return dictionary->strings + dictionary->entries[i].object;
+}
+
+static inline const char *dictObjectType(const struct Dictionary *dictionary, size_t i){
+	return dictionary->strings + dictionary->entries[i].objectType;
+}
+
+#endif
@@ -0,0 +1,164 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Hangman game engine
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "game.h"
+#include "tables.h"
+#include "slab.h"
+
+unsigned long gamesStarted = 0, guessesMade = 0, gamesWon = 0, gamesLost = 0;
+
+static struct Slab arena[GAME_CLASSES];
+
+// The size class whose halves hold a phrase of this length
+// and its terminator
+static int sizeClass(int length){
+	int c = 0;
+
+	while (c < GAME_CLASSES - 1 && (GAME_SMALLEST_HALF << c) < length + 1) c++;
+
+	return c;
+}
+
+// Set up the game arena
+int gameInit(){
+	for (int c = 0; c < GAME_CLASSES; c++){
+		if (slabInit(&arena[c], "game", 2 * (GAME_SMALLEST_HALF << c)) == -1) return -1;
+	}
+
+	return 1;
+}
+
+// Release the game arena. No game may be in play.
+void gameFree(){
+	for (int c = 0; c < GAME_CLASSES; c++) slabDestroy(&arena[c]);
+}
+
+// Bytes the game arena has taken from the system
+unsigned long gameArenaBytes(){
+	unsigned long bytes = 0;
+
+	for (int c = 0; c < GAME_CLASSES; c++) bytes += arena[c].bytes;
+
+	return bytes;
+}
+
+// Set up a game of dictionary entry i and its ____ _____ string.
+// Returns -1, with no game started, if the arena is out of memory.
+int startGame(struct Game *game, const struct Dictionary *dictionary, size_t i){
+	const struct DictEntry *entry = &dictionary->entries[i];
+	struct Entry *pair = &game->pair;
+	int typeLength = entry->typeLength;
+	int objectLength = entry->objectLength;
+	int half;
+
+	pair->object = dictObject(dictionary, i);
+	pair->objectType = dictObjectType(dictionary, i);
+	pair->objectLength = objectLength;
+	pair->typeLength = typeLength;
+
+	game->length = typeLength + 1 + objectLength;
+	game->guesses = dictGuesses(objectLength + typeLength);
+	game->letters = entry->letters;
+	game->guessed = 0;
+	game->tables = NULL;
+
+	// Both strings are zero padded to whole vector blocks
+	half = GAME_SMALLEST_HALF << sizeClass(game->length);
+	game->words = slabAlloc(&arena[sizeClass(game->length)]);
+
+	if (game->words == NULL){
+		game->phrase = NULL;
+		return -1;
+	}
+
+	memset(game->words, 0, 2 * half);
+	game->phrase = game->words + half;
+
+	memcpy(game->phrase, pair->objectType, typeLength);
+	game->phrase[typeLength] = ' ';
+	memcpy(game->phrase + typeLength + 1, pair->object, objectLength);
+
+	// Generate the ____ _____ string, showing anything that
+	// can't be guessed
+	for (int c = 0; c < game->length; c++){
+		char ch = game->phrase[c];
+		game->words[c] = (ch >= 'a' && ch <= 'z') ? '_' : ch;
+	}
+
+	__atomic_fetch_add(&gamesStarted, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+// Copy letter into words wherever the phrase has it
+void revealLetter(char *words, const char *phrase, int length, char letter){
+#ifdef __SSE2__
+	__m128i needle = _mm_set1_epi8(letter);
+
+	for (int i = 0; i < length; i += 16){
+		__m128i block = _mm_loadu_si128((const __m128i *) (phrase + i));
+		__m128i shown = _mm_loadu_si128((const __m128i *) (words + i));
+		__m128i hits = _mm_cmpeq_epi8(block, needle);
+
+		shown = _mm_or_si128(_mm_and_si128(hits, needle), _mm_andnot_si128(hits, shown));
+		_mm_storeu_si128((__m128i *) (words + i), shown);
+	}
+#else
+	for (int i = 0; i < length; i++){
+		if (phrase[i] == letter) words[i] = letter;
+	}
+#endif
+}
+
+// Apply a single guess to the game and report whether
+// the game was won, lost or should continue.
+int guessLetter(struct Game *game, char letter){
+
+	__atomic_fetch_add(&guessesMade, 1, __ATOMIC_RELAXED);
+
+	if (letter >= 'a' && letter <= 'z'){
+		unsigned int bit = 1u << (letter - 'a');
+
+		// Only reveal letters that are new and in the phrase
+		if ((game->guessed & bit) == 0 && (game->letters & bit) != 0){
+			revealLetter(game->words, game->phrase, game->length, letter);
+		}
+
+		game->guessed |= bit;
+	}
+
+	game->guesses--;
+
+	if ((game->letters & ~game->guessed) == 0){
+		__atomic_fetch_add(&gamesWon, 1, __ATOMIC_RELAXED);
+		return GAME_WIN;
+	}
+
+	if (game->guesses <= 0){
+		__atomic_fetch_add(&gamesLost, 1, __ATOMIC_RELAXED);
+		return GAME_LOSS;
+	}
+
+	return GAME_CONTINUE;
+}
+
+// Free the dynamically allocated game data, and let go of
+// the dictionary generation the game was dealt from
+void endGame(struct Game *game){
+	if (game->tables) tablesRelease(game->tables);
+
+	slabFree(&arena[sizeClass(game->length)], game->words);
+	game->tables = NULL;
+	game->words = NULL;
+	game->phrase = NULL;
+}
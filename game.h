@@ -0,0 +1,67 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Hangman game engine
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// A game keeps the letters of its phrase and the letters guessed
+// so far as 26-bit masks, so a hit, a repeated guess or a win is
+// decided with a couple of bit operations. Revealing a hit
+// compares the phrase against the letter 16 bytes at a time and
+// blends the matches into the masked phrase. Characters other
+// than a-z are shown from the start.
+//
+// The masked phrase and the phrase share one block from the game
+// arena, a slab per size class, each half padded to whole vector
+// blocks. Most phrases fit the 64 byte class.
+
+#ifndef GAME_H
+#define GAME_H
+
+#include "dictionary.h"
+
+struct Tables;
+
+#define GAME_CONTINUE 0
+#define GAME_WIN 1
+#define GAME_LOSS 2
+
+// Room for the longest phrase, padded to whole vector blocks
+#define PHRASE_CAPACITY ((DICT_MAX_PHRASE + 1 + 15) & ~15)
+
+// Game arena size classes: halves of 32, 64, 128 and 256 bytes
+#define GAME_CLASSES 4
+#define GAME_SMALLEST_HALF 32
+
+// A view of one dictionary phrase
+struct Entry {
+	const char *object;
+	const char *objectType;
+	int objectLength;
+	int typeLength;
+};
+
+struct Game {
+	struct Entry pair;
+	int guesses;
+	int length;
+	unsigned int letters;
+	unsigned int guessed;
+	char *words;	// the masked phrase shown to the player
+	char *phrase;	// the "type object" phrase, in the same block
+	struct Tables *tables;	// generation the entry came from, if pinned
+};
+
+extern unsigned long gamesStarted, guessesMade, gamesWon, gamesLost;
+
+int gameInit();
+void gameFree();
+unsigned long gameArenaBytes();
+
+int startGame(struct Game *game, const struct Dictionary *dictionary, size_t i);
+int guessLetter(struct Game *game, char letter);
+void endGame(struct Game *game);
+
+void revealLetter(char *words, const char *phrase, int length, char letter);
+
+#endif
@@ -0,0 +1,562 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard journal
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define ERROR -1
+
+#define RECORD_HEADER 14
+#define MAX_NAME 255
+
+#define SNAPSHOT_MAGIC 0x484d534e	// "HMSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER 20
+
+struct JournalStats journalStats;
+
+// Leaves room in a PATH_MAX buffer for the file names
+static char dataDir[PATH_MAX - 64];
+static unsigned long segment = 0;
+static unsigned long segmentBytes = 0;
+static int logFd = -1;
+static time_t lastSnapshot;
+
+// Records waiting for the flusher, filled by game threads
+static unsigned char *pending = NULL;
+static size_t pendingLen = 0, pendingCap = 0;
+static int stopping = 0;
+
+static pthread_t flusher;
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long crcTable[256];
+
+static void *flushLoop(void *data);
+
+/* ---------------------------------------------------------------- */
+// Encoding
+/* ---------------------------------------------------------------- */
+
+static void putU32(unsigned char *p, unsigned long v){
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static unsigned long getU32(const unsigned char *p){
+	return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) | ((unsigned long) p[2] << 8) | p[3];
+}
+
+static void buildCrcTable(){
+	for (unsigned long i = 0; i < 256; i++){
+		unsigned long c = i;
+
+		for (int k = 0; k < 8; k++){
+			c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+		}
+
+		crcTable[i] = c;
+	}
+}
+
+// IEEE CRC32 of a block of bytes
+static unsigned long crc32(const unsigned char *p, size_t len){
+	unsigned long crc = 0xffffffffUL;
+
+	while (len--) crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffffUL;
+}
+
+// Write one record into out. Returns its size.
+static size_t encodeRecord(unsigned char *out, const char *name, unsigned long long results){
+	size_t len = strlen(name);
+
+	if (len > MAX_NAME) len = MAX_NAME;
+
+	out[4] = len >> 8;
+	out[5] = len & 0xff;
+	putU32(out + 6, results >> 32);
+	putU32(out + 10, results & 0xffffffff);
+	memcpy(out + RECORD_HEADER, name, len);
+	putU32(out, crc32(out + 4, RECORD_HEADER - 4 + len));
+
+	return RECORD_HEADER + len;
+}
+
+/* ---------------------------------------------------------------- */
+// Files
+/* ---------------------------------------------------------------- */
+
+static long nanosSince(struct timespec *start){
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+static void segmentPath(char *path, unsigned long n){
+	snprintf(path, PATH_MAX, "%s/leaderboard-%lu.log", dataDir, n);
+}
+
+static void snapshotPath(char *path, const char *suffix){
+	snprintf(path, PATH_MAX, "%s/leaderboard.snapshot%s", dataDir, suffix);
+}
+
+// Make a directory entry change (create, rename, unlink) durable
+static void syncDir(){
+	int fd = open(dataDir, O_RDONLY | O_DIRECTORY);
+
+	if (fd != -1){
+		fsync(fd);
+		close(fd);
+	}
+}
+
+static int writeAll(int fd, const unsigned char *p, size_t len){
+	while (len > 0){
+		ssize_t n = write(fd, p, len);
+
+		if (n == -1){
+			if (errno == EINTR) continue;
+			return ERROR;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+// Read a whole file into memory. Returns NULL if it can't be read.
+static unsigned char *readFile(const char *path, size_t *len){
+	FILE *fp = fopen(path, "rb");
+	unsigned char *data;
+	long size;
+
+	if (fp == NULL) return NULL;
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	data = malloc(size > 0 ? size : 1);
+	*len = fread(data, 1, size, fp);
+	fclose(fp);
+
+	return data;
+}
+
+// Start a new, empty log segment
+static int openSegment(unsigned long n){
+	char path[PATH_MAX];
+
+	segmentPath(path, n);
+
+	if ((logFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1){
+		perror(path);
+		return ERROR;
+	}
+
+	segment = n;
+	segmentBytes = 0;
+	syncDir();
+
+	return 1;
+}
+
+/* ---------------------------------------------------------------- */
+// Recovery
+/* ---------------------------------------------------------------- */
+
+// Apply every valid record in a block, stopping at the first
+// one that is torn or fails its checksum. Returns the count.
+static unsigned long replayRecords(const unsigned char *p, size_t len){
+	unsigned long count = 0;
+	char name[MAX_NAME + 1];
+
+	while (len >= RECORD_HEADER){
+		size_t nameLength = (p[4] << 8) | p[5];
+		struct LeaderBoard *entry;
+
+		if (len < RECORD_HEADER + nameLength || nameLength == 0) break;
+		if (crc32(p + 4, RECORD_HEADER - 4 + nameLength) != getU32(p)) break;
+
+		memcpy(name, p + RECORD_HEADER, nameLength);
+		name[nameLength] = '\0';
+
+		if (addLeaderboardEntry(name) == ERROR){
+			fprintf(stderr, "journal: no room on the leaderboard for %s\n", name);
+		}
+
+		if ((entry = findLeaderboardEntry(name)) != NULL){
+			restoreResults(entry, ((unsigned long long) getU32(p + 6) << 32) | getU32(p + 10));
+		}
+
+		p += RECORD_HEADER + nameLength;
+		len -= RECORD_HEADER + nameLength;
+		count++;
+	}
+
+	return count;
+}
+
+// Load the snapshot, if there is one. Returns the last log
+// segment it covers, or 0 if there is no usable snapshot.
+static unsigned long loadSnapshot(){
+	char path[PATH_MAX];
+	unsigned char *data;
+	unsigned long covered = 0;
+	size_t len;
+
+	snapshotPath(path, "");
+
+	if ((data = readFile(path, &len)) == NULL) return 0;
+
+	if (len >= SNAPSHOT_HEADER && getU32(data) == SNAPSHOT_MAGIC && getU32(data + 4) == SNAPSHOT_VERSION){
+		covered = ((unsigned long) getU32(data + 8) << 32) | getU32(data + 12);
+		replayRecords(data + SNAPSHOT_HEADER, len - SNAPSHOT_HEADER);
+	} else {
+		fprintf(stderr, "Ignoring unreadable snapshot %s\n", path);
+	}
+
+	free(data);
+	return covered;
+}
+
+static int compareSegments(const void *a, const void *b){
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+	return x == y ? 0 : (x < y ? -1 : 1);
+}
+
+// Rebuild the leaderboard from the snapshot and the log
+// segments written after it. Returns the newest segment seen,
+// and counts the segments that held any records in *replayed.
+static unsigned long recover(unsigned long *replayed){
+	unsigned long covered, newest, *segments = NULL;
+	size_t count = 0, cap = 0;
+	struct dirent *file;
+	struct timespec start;
+	DIR *dir;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	covered = newest = loadSnapshot();
+
+	if ((dir = opendir(dataDir)) != NULL){
+		while ((file = readdir(dir)) != NULL){
+			unsigned long n;
+			char tail;
+
+			if (sscanf(file->d_name, "leaderboard-%lu.lo%c", &n, &tail) != 2 || tail != 'g') continue;
+
+			if (n > newest) newest = n;
+			if (n <= covered) continue;
+
+			if (count == cap){
+				cap = cap ? cap * 2 : 16;
+				segments = realloc(segments, cap * sizeof(unsigned long));
+			}
+
+			segments[count++] = n;
+		}
+
+		closedir(dir);
+	}
+
+	if (count > 0) qsort(segments, count, sizeof(unsigned long), compareSegments);
+
+	for (size_t i = 0; i < count; i++){
+		char path[PATH_MAX];
+		unsigned char *data;
+		size_t len;
+
+		segmentPath(path, segments[i]);
+
+		if ((data = readFile(path, &len)) != NULL){
+			journalStats.recoveredRecords += replayRecords(data, len);
+			if (len > 0) (*replayed)++;
+			free(data);
+		}
+	}
+
+	free(segments);
+
+	journalStats.recoveredUsers = leaderboardCount();
+	journalStats.recoveryNanos = nanosSince(&start);
+
+	return newest;
+}
+
+/* ---------------------------------------------------------------- */
+// Snapshots
+/* ---------------------------------------------------------------- */
+
+// Write every user's totals to a new snapshot and drop the log
+// segments it replaces. The log moves to a new segment first, so
+// any result recorded before that point is already counted in
+// the totals the snapshot reads.
+static void takeSnapshot(){
+	char path[PATH_MAX], tmpPath[PATH_MAX];
+	unsigned long covered = segment, count = leaderboardCount();
+	unsigned char header[SNAPSHOT_HEADER];
+	unsigned char record[RECORD_HEADER + MAX_NAME];
+	FILE *fp;
+
+	close(logFd);
+	if (openSegment(covered + 1) == ERROR) return;
+
+	snapshotPath(tmpPath, ".tmp");
+	snapshotPath(path, "");
+
+	if ((fp = fopen(tmpPath, "wb")) == NULL){
+		perror(tmpPath);
+		return;
+	}
+
+	putU32(header, SNAPSHOT_MAGIC);
+	putU32(header + 4, SNAPSHOT_VERSION);
+	putU32(header + 8, (unsigned long long) covered >> 32);
+	putU32(header + 12, covered & 0xffffffff);
+	putU32(header + 16, count);
+	fwrite(header, 1, SNAPSHOT_HEADER, fp);
+
+	for (unsigned long i = 0; i < count; i++){
+		struct LeaderBoard *entry = leaderboardAt(i);
+		unsigned long long results = __atomic_load_n(&entry->local, __ATOMIC_RELAXED);
+
+		if (results == 0) continue;
+
+		fwrite(record, 1, encodeRecord(record, entry->username, results), fp);
+	}
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1){
+		perror(tmpPath);
+		fclose(fp);
+		return;
+	}
+
+	fclose(fp);
+
+	if (rename(tmpPath, path) == -1){
+		perror(path);
+		return;
+	}
+
+	syncDir();
+
+	for (unsigned long n = covered; n > 0; n--){
+		segmentPath(path, n);
+		if (unlink(path) == -1 && errno == ENOENT) break;
+	}
+
+	lastSnapshot = time(NULL);
+	journalStats.snapshots++;
+}
+
+/* ---------------------------------------------------------------- */
+// Journal
+/* ---------------------------------------------------------------- */
+
+// Recover the leaderboard from dir and start journalling
+// results into it
+int journalOpen(const char *dir){
+	unsigned long newest, replayed = 0;
+	char path[PATH_MAX];
+	struct stat info;
+
+	buildCrcTable();
+	snprintf(dataDir, sizeof dataDir, "%s", dir);
+
+	newest = recover(&replayed);
+
+	printf("Recovered %lu users from %s (%lu log records) in %.2f ms\n",
+		journalStats.recoveredUsers, dataDir, journalStats.recoveredRecords,
+		journalStats.recoveryNanos / 1e6);
+
+	// Never append after a possibly torn tail; start afresh. An
+	// empty newest segment has no tail, so it is used again rather
+	// than leaving one more file behind on every restart.
+	segmentPath(path, newest);
+
+	if (newest > 0 && stat(path, &info) == 0 && info.st_size == 0){
+		if (openSegment(newest) == ERROR) return ERROR;
+	} else if (openSegment(newest + 1) == ERROR){
+		return ERROR;
+	}
+
+	// Fold the log into a snapshot straight away once it spans
+	// more than one segment, rather than waiting for new results
+	if (replayed > 1) takeSnapshot();
+
+	lastSnapshot = time(NULL);
+	stopping = 0;
+
+	pthread_create(&flusher, NULL, flushLoop, NULL);
+
+	resultListener = journalRecord;
+
+	return 1;
+}
+
+// Queue a user's new totals for the next commit. This is all a
+// game thread pays for durability; it never waits on the disk.
+void journalRecord(struct LeaderBoard *entry, unsigned long long results){
+	unsigned char record[RECORD_HEADER + MAX_NAME];
+	struct timespec start;
+	size_t size;
+	int wasEmpty;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size = encodeRecord(record, entry->username, results);
+
+	pthread_mutex_lock(&journal_mutex);
+
+	if (pendingLen + size > pendingCap){
+		size_t cap = pendingCap ? pendingCap * 2 : 4096;
+		while (cap < pendingLen + size) cap *= 2;
+		pending = realloc(pending, cap);
+		pendingCap = cap;
+	}
+
+	memcpy(pending + pendingLen, record, size);
+	wasEmpty = pendingLen == 0;
+	pendingLen += size;
+
+	pthread_mutex_unlock(&journal_mutex);
+
+	if (wasEmpty) pthread_cond_signal(&journal_cond);
+
+	__atomic_fetch_add(&journalStats.results, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&journalStats.appendNanos, nanosSince(&start), __ATOMIC_RELAXED);
+}
+
+// Commit batches of records as they build up, and take a
+// snapshot when the log has grown or enough time has passed.
+static void *flushLoop(void *data){
+	unsigned char *batch = NULL;
+	size_t batchCap = 0;
+
+	pthread_mutex_lock(&journal_mutex);
+
+	while (1){
+		while (pendingLen == 0 && !stopping){
+			struct timespec wake;
+
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_sec += 1;
+
+			if (pthread_cond_timedwait(&journal_cond, &journal_mutex, &wake) == ETIMEDOUT) break;
+		}
+
+		if (pendingLen > 0){
+			unsigned char *full;
+			size_t len, fullCap;
+			struct timespec start;
+
+			// Give other games a moment to join this commit
+			if (!stopping){
+				pthread_mutex_unlock(&journal_mutex);
+				usleep(JOURNAL_COMMIT_DELAY_US);
+				pthread_mutex_lock(&journal_mutex);
+			}
+
+			// Swap buffers so game threads can keep appending
+			// while this batch is written out
+			full = pending;
+			fullCap = pendingCap;
+			len = pendingLen;
+			pending = batch;
+			pendingCap = batchCap;
+			pendingLen = 0;
+			batch = full;
+			batchCap = fullCap;
+
+			pthread_mutex_unlock(&journal_mutex);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			if (writeAll(logFd, batch, len) == ERROR || fdatasync(logFd) == -1){
+				perror("journal");
+			}
+
+			segmentBytes += len;
+			journalStats.commits++;
+			journalStats.bytesWritten += len;
+			journalStats.commitNanos += nanosSince(&start);
+
+			pthread_mutex_lock(&journal_mutex);
+		}
+
+		if (pendingLen == 0 && stopping) break;
+
+		if (segmentBytes >= JOURNAL_SNAPSHOT_BYTES || (segmentBytes > 0 && time(NULL) - lastSnapshot >= JOURNAL_SNAPSHOT_INTERVAL)){
+			pthread_mutex_unlock(&journal_mutex);
+			takeSnapshot();
+			pthread_mutex_lock(&journal_mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&journal_mutex);
+
+	free(batch);
+
+	return NULL;
+}
+
+// Commit whatever is still pending and stop the flusher
+void journalClose(){
+	if (logFd == -1) return;
+
+	resultListener = NULL;
+
+	pthread_mutex_lock(&journal_mutex);
+	stopping = 1;
+	pthread_mutex_unlock(&journal_mutex);
+	pthread_cond_signal(&journal_cond);
+
+	pthread_join(flusher, NULL);
+
+	close(logFd);
+	logFd = -1;
+
+	free(pending);
+	pending = NULL;
+	pendingLen = pendingCap = 0;
+}
+
+// Print what durability has cost so far
+void printJournalStats(FILE *fp){
+	fprintf(fp, "Journal: recovery took %.2f ms for %lu users and %lu log records\n",
+		journalStats.recoveryNanos / 1e6, journalStats.recoveredUsers, journalStats.recoveredRecords);
+
+	if (journalStats.results == 0) return;
+
+	fprintf(fp, "Journal: %lu results, %.0f ns per result on game threads\n",
+		journalStats.results, (double) journalStats.appendNanos / journalStats.results);
+
+	if (journalStats.commits == 0) return;
+
+	fprintf(fp, "Journal: %lu commits, %.1f results and %.1f us per commit, %lu bytes, %lu snapshots\n",
+		journalStats.commits, (double) journalStats.results / journalStats.commits,
+		journalStats.commitNanos / 1e3 / journalStats.commits, journalStats.bytesWritten,
+		journalStats.snapshots);
+}
@@ -0,0 +1,66 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard journal
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Makes the leaderboard survive restarts. Every recorded result
+// is appended to a log as the user's new totals on this server,
+// so replaying a record twice (or out of order) is harmless: the
+// largest total wins. Results merged in from other servers are
+// theirs to keep. Game threads only copy the record into a buffer; a
+// flusher thread writes and fsyncs whatever has built up in one
+// go (group commit), and every so often writes a compacted
+// snapshot of the whole table and starts a new log segment.
+//
+// On disk, in the data directory:
+//	leaderboard.snapshot	every user's totals, as of some segment
+//	leaderboard-<n>.log	results recorded since segment n began
+//
+// Each record is a CRC32, the username length (u16), games
+// played (u32), games won (u32), then the username. Recovery
+// stops at the first torn or corrupt record of a segment.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+
+#include "leaderboard.h"
+
+// How long the flusher waits for more results to share a
+// commit, and how often (in seconds, or bytes of log) it
+// snapshots. All can be overridden at build time.
+#ifndef JOURNAL_COMMIT_DELAY_US
+#define JOURNAL_COMMIT_DELAY_US 2000
+#endif
+
+#ifndef JOURNAL_SNAPSHOT_INTERVAL
+#define JOURNAL_SNAPSHOT_INTERVAL 60
+#endif
+
+#ifndef JOURNAL_SNAPSHOT_BYTES
+#define JOURNAL_SNAPSHOT_BYTES (4 * 1024 * 1024)
+#endif
+
+struct JournalStats {
+	unsigned long results;		// records appended by game threads
+	unsigned long appendNanos;	// time game threads spent appending
+	unsigned long commits;		// write + fsync batches
+	unsigned long commitNanos;
+	unsigned long bytesWritten;
+	unsigned long snapshots;
+	unsigned long recoveredUsers;
+	unsigned long recoveredRecords;
+	unsigned long recoveryNanos;
+};
+
+extern struct JournalStats journalStats;
+
+int journalOpen(const char *dir);
+void journalRecord(struct LeaderBoard *entry, unsigned long long results);
+void journalClose();
+
+void printJournalStats(FILE *fp);
+
+#endif
@@ -0,0 +1,114 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard reply cache
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lbcache.h"
+#include "leaderboard.h"
+#include "protocol.h"
+
+#define ERROR -1
+
+// Row payload ahead of the username: plays and wins
+#define ROW_FIELDS 8
+
+unsigned long lbcacheBuilds = 0, lbcacheHits = 0, lbcacheNotModified = 0;
+
+static struct LeaderboardReply *cached = NULL;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Encode every row and the end frame, labelled with version
+static struct LeaderboardReply *build(unsigned long version){
+	struct LeaderboardReply *reply;
+	unsigned long count = leaderboardCount();
+	unsigned char payload[ROW_FIELDS + 64], end[4];
+	size_t size = FRAME_HEADER_SIZE + sizeof end;
+
+	// Usernames never change, so sizing first is safe
+	for (unsigned long i = 0; i < count; i++){
+		size += FRAME_HEADER_SIZE + ROW_FIELDS + strlen(leaderboardAt(i)->username);
+	}
+
+	if ((reply = malloc(sizeof *reply + size)) == NULL) return NULL;
+
+	reply->refs = 1;
+	reply->version = version;
+	reply->frames = count + 1;
+	reply->length = 0;
+
+	for (unsigned long i = 0; i < count; i++){
+		struct LeaderBoard *entry = leaderboardAt(i);
+		size_t len = strlen(entry->username);
+		unsigned long gamesPlayed, gamesWon;
+
+		readResults(entry, &gamesPlayed, &gamesWon);
+
+		put32(payload, gamesPlayed);
+		put32(payload + 4, gamesWon);
+		memcpy(payload + ROW_FIELDS, entry->username, len);
+
+		reply->length += frameEncode(reply->data + reply->length, OP_LB_ROW, payload, ROW_FIELDS + len);
+	}
+
+	put32(end, version);
+	reply->length += frameEncode(reply->data + reply->length, OP_LB_END, end, sizeof end);
+
+	__atomic_fetch_add(&lbcacheBuilds, 1, __ATOMIC_RELAXED);
+
+	return reply;
+}
+
+// Whether an OP_LEADERBOARD payload names the version that is
+// still current. An empty payload never does.
+int lbcacheUnchanged(const unsigned char *payload, size_t len){
+	if (len < 4 || get32(payload) != (leaderboardChanges() & 0xffffffff)) return 0;
+
+	__atomic_fetch_add(&lbcacheNotModified, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+// A reference to the current reply, rebuilt first if results
+// have changed since it was built. Requests that arrive during a
+// rebuild wait for it and share it. Returns NULL if there is no
+// memory for a rebuild.
+struct LeaderboardReply *lbcacheGet(){
+	struct LeaderboardReply *reply;
+	unsigned long version;
+
+	pthread_mutex_lock(&cache_mutex);
+
+	version = leaderboardChanges();
+
+	if (cached && cached->version == version){
+		__atomic_fetch_add(&lbcacheHits, 1, __ATOMIC_RELAXED);
+	} else if ((reply = build(version))){
+		if (cached) lbcacheRelease(cached);
+		cached = reply;
+	}
+
+	if ((reply = cached)) __atomic_fetch_add(&reply->refs, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&cache_mutex);
+
+	return reply;
+}
+
+// Drop a reference, freeing the reply with the last one
+void lbcacheRelease(struct LeaderboardReply *reply){
+	if (__atomic_sub_fetch(&reply->refs, 1, __ATOMIC_ACQ_REL) == 0) free(reply);
+}
+
+// Drop the cached reply
+void lbcacheFree(){
+	pthread_mutex_lock(&cache_mutex);
+
+	if (cached) lbcacheRelease(cached);
+	cached = NULL;
+
+	pthread_mutex_unlock(&cache_mutex);
+}
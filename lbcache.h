@@ -0,0 +1,39 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard reply cache
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// The full leaderboard reply is encoded once, as the OP_LB_ROW
+// frames and the OP_LB_END that close it, and shared by every
+// request until a result changes. It is then rebuilt by the next
+// request that asks, so a burst of requests after a game costs
+// one rebuild, and a quiet leaderboard costs none. Each request
+// is a single write of a buffer nobody changes.
+//
+// A reply is labelled with the leaderboard's change count from
+// just before it was built, and OP_LB_END carries the label. A
+// client that sends its label back with OP_LEADERBOARD is told
+// OP_LB_NOT_MODIFIED if nothing has changed since.
+
+#ifndef LBCACHE_H
+#define LBCACHE_H
+
+#include <stddef.h>
+
+struct LeaderboardReply {
+	unsigned long refs;
+	unsigned long version;
+	size_t frames;
+	size_t length;
+	unsigned char data[];
+};
+
+extern unsigned long lbcacheBuilds, lbcacheHits, lbcacheNotModified;
+
+int lbcacheUnchanged(const unsigned char *payload, size_t len);
+struct LeaderboardReply *lbcacheGet();
+void lbcacheRelease(struct LeaderboardReply *reply);
+void lbcacheFree();
+
+#endif
@@ -0,0 +1,562 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard store
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "leaderboard.h"
+
+#define ERROR -1
+
+// The hash index maps usernames to slot numbers. A slot value
+// of 0 is empty, otherwise it holds the user's number plus one.
+// When it grows, the old index is kept on a list rather than
+// freed, as lock-free readers may still be probing it.
+struct LeaderboardIndex {
+	unsigned long mask;
+	unsigned int *slots;
+	struct LeaderboardIndex *previous;
+};
+
+static struct LeaderBoard *chunks[LEADERBOARD_MAX_CHUNKS];
+static struct LeaderboardIndex *nameIndex = NULL;
+static unsigned long userCount = 0;
+
+static unsigned int rankRoot = 0;
+
+// Users whose results changed since they were last ranked
+static struct LeaderBoard *rankPending = NULL;
+
+// Bumped after every change a full listing would show
+static unsigned long changes = 0;
+
+void (*resultListener)(struct LeaderBoard *entry, unsigned long long results) = NULL;
+
+static pthread_mutex_t insert_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rank_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void rankInsert(struct LeaderBoard *entry);
+static void rankMark(struct LeaderBoard *entry);
+
+// FNV-1a hash of the username
+static unsigned long hashName(const char *name){
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*name){
+		hash ^= (unsigned char) *name++;
+		hash *= 1099511628211UL;
+	}
+
+	return hash;
+}
+
+// Create an empty nameIndex with room for size slots. Returns
+// NULL if there is no memory for it.
+static struct LeaderboardIndex *createIndex(unsigned long size){
+	struct LeaderboardIndex *created = malloc(sizeof(struct LeaderboardIndex));
+
+	if (created == NULL) return NULL;
+
+	if ((created->slots = calloc(size, sizeof(unsigned int))) == NULL){
+		free(created);
+		return NULL;
+	}
+
+	created->mask = size - 1;
+	created->previous = NULL;
+
+	return created;
+}
+
+// Put a user into an nameIndex that is not yet visible to readers,
+// or that only the insert lock holder writes to.
+static void indexInsert(struct LeaderboardIndex *target, unsigned long user){
+	unsigned long i = hashName(leaderboardAt(user)->username) & target->mask;
+
+	while (target->slots[i] != 0) i = (i + 1) & target->mask;
+
+	__atomic_store_n(&target->slots[i], (unsigned int) user + 1, __ATOMIC_RELEASE);
+}
+
+// Size the nameIndex for the number of users we expect to see
+int leaderboardInit(unsigned long expectedUsers){
+	unsigned long size = 16;
+
+	while (size < expectedUsers * 2) size <<= 1;
+
+	if ((nameIndex = createIndex(size)) == NULL) return ERROR;
+
+	return 1;
+}
+
+// Release every slot, chunk and nameIndex
+void leaderboardFree(){
+	unsigned long count = leaderboardCount();
+
+	for (unsigned long i = 0; i < count; i++){
+		free(leaderboardAt(i)->username);
+	}
+
+	for (int i = 0; i < LEADERBOARD_MAX_CHUNKS && chunks[i]; i++){
+		free(chunks[i]);
+		chunks[i] = NULL;
+	}
+
+	while (nameIndex){
+		struct LeaderboardIndex *previous = nameIndex->previous;
+		free(nameIndex->slots);
+		free(nameIndex);
+		nameIndex = previous;
+	}
+
+	userCount = 0;
+	rankRoot = 0;
+	rankPending = NULL;
+}
+
+// A number that goes up whenever a user is added or a result
+// recorded. A copy of the table made after reading it is at
+// least that fresh.
+unsigned long leaderboardChanges(){
+	return __atomic_load_n(&changes, __ATOMIC_ACQUIRE);
+}
+
+// Number of users on the leaderboard
+unsigned long leaderboardCount(){
+	return __atomic_load_n(&userCount, __ATOMIC_ACQUIRE);
+}
+
+// The i'th user, in the order they were added
+struct LeaderBoard *leaderboardAt(unsigned long i){
+	struct LeaderBoard *chunk = __atomic_load_n(&chunks[i >> LEADERBOARD_CHUNK_BITS], __ATOMIC_ACQUIRE);
+
+	return &chunk[i & (LEADERBOARD_CHUNK - 1)];
+}
+
+// Look a user up by name without locking. Returns NULL if
+// they have no leaderboard entry yet.
+struct LeaderBoard *findLeaderboardEntry(const char *name){
+	struct LeaderboardIndex *current = __atomic_load_n(&nameIndex, __ATOMIC_ACQUIRE);
+	unsigned long i = hashName(name) & current->mask;
+	unsigned int slot;
+
+	while ((slot = __atomic_load_n(&current->slots[i], __ATOMIC_ACQUIRE)) != 0){
+		struct LeaderBoard *entry = leaderboardAt(slot - 1);
+
+		if (strcmp(entry->username, name) == 0) return entry;
+
+		i = (i + 1) & current->mask;
+	}
+
+	return NULL;
+}
+
+// Add a leaderboard entry for a username
+// Only one user is added at a time, but
+// lookups and results carry on meanwhile.
+// Returns LEADERBOARD_EXISTS if the user already has one, and
+// ERROR if the table is full or out of memory.
+int addLeaderboardEntry(char *name){
+	struct LeaderBoard *entry;
+	struct LeaderboardIndex *grown = NULL;
+	unsigned long user;
+	char *username;
+
+	if (findLeaderboardEntry(name)) return LEADERBOARD_EXISTS;
+
+	pthread_mutex_lock(&insert_mutex);
+
+	// Check again in case they were added while we waited
+	if (findLeaderboardEntry(name)){
+		pthread_mutex_unlock(&insert_mutex);
+		return LEADERBOARD_EXISTS;
+	}
+
+	user = userCount;
+
+	if ((user >> LEADERBOARD_CHUNK_BITS) >= LEADERBOARD_MAX_CHUNKS){
+		pthread_mutex_unlock(&insert_mutex);
+		return ERROR;
+	}
+
+	// Everything the user needs is allocated before they are
+	// ranked, so a failure leaves no trace of them
+	if (chunks[user >> LEADERBOARD_CHUNK_BITS] == NULL){
+		struct LeaderBoard *chunk = calloc(LEADERBOARD_CHUNK, sizeof(struct LeaderBoard));
+
+		if (chunk == NULL){
+			pthread_mutex_unlock(&insert_mutex);
+			return ERROR;
+		}
+
+		__atomic_store_n(&chunks[user >> LEADERBOARD_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+	}
+
+	// Keep the nameIndex at most half full, building the bigger one
+	// off to the side and publishing it once it is complete.
+	if ((user + 1) * 2 > nameIndex->mask + 1){
+		if ((grown = createIndex((nameIndex->mask + 1) * 2)) == NULL){
+			pthread_mutex_unlock(&insert_mutex);
+			return ERROR;
+		}
+	}
+
+	if ((username = strdup(name)) == NULL){
+		if (grown){
+			free(grown->slots);
+			free(grown);
+		}
+
+		pthread_mutex_unlock(&insert_mutex);
+		return ERROR;
+	}
+
+	entry = leaderboardAt(user);
+	entry->username = username;
+	entry->results = entry->local = 0;
+	entry->number = user;
+
+	// Rank the user before anyone can find them, so a result is
+	// never recorded for a user the tree doesn't hold yet
+	rankInsert(entry);
+
+	if (grown){
+		for (unsigned long i = 0; i < user; i++){
+			indexInsert(grown, i);
+		}
+
+		grown->previous = nameIndex;
+		__atomic_store_n(&nameIndex, grown, __ATOMIC_RELEASE);
+	}
+
+	indexInsert(nameIndex, user);
+	__atomic_store_n(&userCount, user + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&insert_mutex);
+
+	__atomic_fetch_add(&changes, 1, __ATOMIC_RELEASE);
+
+	return LEADERBOARD_ADDED;
+}
+
+// Add a win in the leaderboard 
+// depending on the username.
+int addWinFor(char *name){
+	struct LeaderBoard *entry = findLeaderboardEntry(name);
+
+	if (entry == NULL) return 0;
+
+	recordResult(entry, RESULT_PLAYED | RESULT_WON);
+	return 1;
+}
+
+// Add a loss in the leaderboard 
+// depending on the username.
+int addLossFor(char *name){
+	struct LeaderBoard *entry = findLeaderboardEntry(name);
+
+	if (entry == NULL) return 0;
+
+	recordResult(entry, RESULT_PLAYED);
+	return 1;
+}
+
+// Count a finished game against a user, and mark them to
+// be moved to their new place in the rankings
+void recordResult(struct LeaderBoard *entry, unsigned long long result){
+	unsigned long long local = __atomic_add_fetch(&entry->local, result, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&entry->results, result, __ATOMIC_RELAXED);
+
+	rankMark(entry);
+	__atomic_fetch_add(&changes, 1, __ATOMIC_RELEASE);
+
+	if (resultListener) resultListener(entry, local);
+}
+
+// Bring a user's local results up to a previously recorded
+// value. Every result adds a play, so a later value always has
+// more plays and sorts higher; older values are simply ignored.
+void restoreResults(struct LeaderBoard *entry, unsigned long long results){
+	unsigned long long current = __atomic_load_n(&entry->local, __ATOMIC_RELAXED);
+
+	while (current < results){
+		if (__atomic_compare_exchange_n(&entry->local, &current, results, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			mergeResults(entry, results - current);
+			return;
+		}
+	}
+}
+
+// Add results another server recorded, without telling the
+// listener: they are that server's to keep
+void mergeResults(struct LeaderBoard *entry, unsigned long long delta){
+	__atomic_fetch_add(&entry->results, delta, __ATOMIC_RELAXED);
+
+	rankMark(entry);
+	__atomic_fetch_add(&changes, 1, __ATOMIC_RELEASE);
+}
+
+// Read a user's games played and won. Both come from the same
+// word, so a reader never sees a win without its play.
+void readResults(struct LeaderBoard *entry, unsigned long *gamesPlayed, unsigned long *gamesWon){
+	unsigned long long results = __atomic_load_n(&entry->results, __ATOMIC_RELAXED);
+
+	*gamesPlayed = results >> 32;
+	*gamesWon = results & 0xffffffff;
+}
+
+/* ---------------------------------------------------------------- */
+// Rank tree
+/* ---------------------------------------------------------------- */
+
+#define NODE(n) leaderboardAt((n) - 1)
+
+// Heap priority of a node, a hash of its number so the
+// tree shape does not depend on the order users arrive in.
+static unsigned long rankPriority(unsigned int n){
+	unsigned long x = n * 0x9e3779b97f4a7c15UL;
+
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+
+	return x ^ (x >> 31);
+}
+
+static unsigned long rankSize(unsigned int n){
+	return n ? NODE(n)->rankSize : 0;
+}
+
+static void rankResize(unsigned int n){
+	struct LeaderBoard *node = NODE(n);
+	node->rankSize = 1 + rankSize(node->rankLeft) + rankSize(node->rankRight);
+}
+
+// Negative if results a (belonging to node an) rank above b.
+// Win ratios are compared by cross multiplying, counting a
+// user with no plays as having a ratio of zero.
+static int compareRank(unsigned long long a, unsigned int an, unsigned long long b, unsigned int bn){
+	unsigned long long aWon = a & 0xffffffff, aPlayed = a >> 32;
+	unsigned long long bWon = b & 0xffffffff, bPlayed = b >> 32;
+	unsigned long long aRatio, bRatio;
+
+	if (aWon != bWon) return aWon > bWon ? -1 : 1;
+
+	aRatio = aWon * (bPlayed ? bPlayed : 1);
+	bRatio = bWon * (aPlayed ? aPlayed : 1);
+	if (aRatio != bRatio) return aRatio > bRatio ? -1 : 1;
+
+	if (aPlayed != bPlayed) return aPlayed > bPlayed ? -1 : 1;
+
+	return an == bn ? 0 : (an < bn ? -1 : 1);
+}
+
+// Split tree t into the nodes ranking above the given
+// results (left) and the rest (right)
+static void rankSplit(unsigned int t, unsigned long long results, unsigned int n, unsigned int *left, unsigned int *right){
+	struct LeaderBoard *node;
+
+	if (t == 0){
+		*left = *right = 0;
+		return;
+	}
+
+	node = NODE(t);
+
+	if (compareRank(node->rankedResults, t, results, n) < 0){
+		rankSplit(node->rankRight, results, n, &node->rankRight, right);
+		*left = t;
+	} else {
+		rankSplit(node->rankLeft, results, n, left, &node->rankLeft);
+		*right = t;
+	}
+
+	rankResize(t);
+}
+
+// Join two trees where every node of left ranks above right
+static unsigned int rankMerge(unsigned int left, unsigned int right){
+	if (left == 0) return right;
+	if (right == 0) return left;
+
+	if (rankPriority(left) > rankPriority(right)){
+		NODE(left)->rankRight = rankMerge(NODE(left)->rankRight, right);
+		rankResize(left);
+		return left;
+	}
+
+	NODE(right)->rankLeft = rankMerge(left, NODE(right)->rankLeft);
+	rankResize(right);
+	return right;
+}
+
+// Take node n out of tree t
+static unsigned int rankRemove(unsigned int t, unsigned int n){
+	struct LeaderBoard *node = NODE(t), *target = NODE(n);
+
+	if (t == n) return rankMerge(node->rankLeft, node->rankRight);
+
+	if (compareRank(target->rankedResults, n, node->rankedResults, t) < 0){
+		node->rankLeft = rankRemove(node->rankLeft, n);
+	} else {
+		node->rankRight = rankRemove(node->rankRight, n);
+	}
+
+	rankResize(t);
+	return t;
+}
+
+// Place node n in the tree, ordered by its rankedResults
+static void rankPlace(unsigned int n){
+	unsigned int left, right;
+	struct LeaderBoard *node = NODE(n);
+
+	node->rankLeft = node->rankRight = 0;
+	node->rankSize = 1;
+
+	rankSplit(rankRoot, node->rankedResults, n, &left, &right);
+	rankRoot = rankMerge(rankMerge(left, n), right);
+}
+
+// Add a new user to the rankings
+static void rankInsert(struct LeaderBoard *entry){
+	pthread_mutex_lock(&rank_mutex);
+
+	entry->rankedResults = __atomic_load_n(&entry->results, __ATOMIC_RELAXED);
+	rankPlace(entry->number + 1);
+
+	pthread_mutex_unlock(&rank_mutex);
+}
+
+// Put a user on the re-rank list, unless they are on it already
+static void rankMark(struct LeaderBoard *entry){
+	struct LeaderBoard *head;
+
+	if (__atomic_exchange_n(&entry->rankDirty, 1, __ATOMIC_ACQ_REL)) return;
+
+	head = __atomic_load_n(&rankPending, __ATOMIC_RELAXED);
+
+	do {
+		entry->rankNext = head;
+	} while (!__atomic_compare_exchange_n(&rankPending, &head, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Move every user on the re-rank list to the place their current
+// results earn. Called with the rank lock held.
+static void rankFlush(){
+	struct LeaderBoard *entry = __atomic_exchange_n(&rankPending, NULL, __ATOMIC_ACQUIRE);
+
+	while (entry){
+		struct LeaderBoard *next = entry->rankNext;
+		unsigned int n = entry->number + 1;
+
+		// Cleared before the results are read, so a result that
+		// lands meanwhile lists the user again. The link was read
+		// first, as listing them again overwrites it.
+		__atomic_store_n(&entry->rankDirty, 0, __ATOMIC_RELEASE);
+
+		rankRoot = rankRemove(rankRoot, n);
+		entry->rankedResults = __atomic_load_n(&entry->results, __ATOMIC_ACQUIRE);
+		rankPlace(n);
+
+		entry = next;
+	}
+}
+
+// Zero based rank of node n
+static unsigned long rankOf(unsigned int n){
+	struct LeaderBoard *target = NODE(n);
+	unsigned long rank = 0;
+	unsigned int t = rankRoot;
+
+	while (t){
+		int order = compareRank(target->rankedResults, n, NODE(t)->rankedResults, t);
+
+		if (order < 0){
+			t = NODE(t)->rankLeft;
+		} else if (order > 0){
+			rank += rankSize(NODE(t)->rankLeft) + 1;
+			t = NODE(t)->rankRight;
+		} else {
+			return rank + rankSize(NODE(t)->rankLeft);
+		}
+	}
+
+	return rank;
+}
+
+// Node holding zero based rank k
+static unsigned int rankSelect(unsigned long k){
+	unsigned int t = rankRoot;
+
+	while (t){
+		unsigned long leftSize = rankSize(NODE(t)->rankLeft);
+
+		if (k < leftSize){
+			t = NODE(t)->rankLeft;
+		} else if (k == leftSize){
+			return t;
+		} else {
+			k -= leftSize + 1;
+			t = NODE(t)->rankRight;
+		}
+	}
+
+	return 0;
+}
+
+// Copy out count rows from the given rank. Called with the
+// rank lock held.
+static unsigned long copyRows(unsigned long start, unsigned long count, struct RankedRow *rows){
+	unsigned long total = rankSize(rankRoot), filled = 0;
+
+	for (unsigned long k = start; k < total && filled < count; k++){
+		unsigned int n = rankSelect(k);
+
+		rows[filled].rank = k + 1;
+		rows[filled].entry = NODE(n);
+		rows[filled].results = NODE(n)->rankedResults;
+		filled++;
+	}
+
+	return filled;
+}
+
+// Fill rows with the users ranked from start (zero based)
+// onwards. Returns how many rows were filled, and the number
+// of ranked users through total.
+unsigned long rankedRange(unsigned long start, unsigned long count, struct RankedRow *rows, unsigned long *total){
+	unsigned long filled;
+
+	pthread_mutex_lock(&rank_mutex);
+
+	rankFlush();
+	*total = rankSize(rankRoot);
+	filled = copyRows(start, count, rows);
+
+	pthread_mutex_unlock(&rank_mutex);
+
+	return filled;
+}
+
+// Fill rows with the user and up to radius neighbours
+// either side of them.
+unsigned long rankedAround(struct LeaderBoard *entry, unsigned long radius, struct RankedRow *rows, unsigned long *total){
+	unsigned long rank, filled;
+
+	pthread_mutex_lock(&rank_mutex);
+
+	rankFlush();
+	rank = rankOf(entry->number + 1);
+	*total = rankSize(rankRoot);
+	filled = copyRows(rank > radius ? rank - radius : 0, radius * 2 + 1, rows);
+
+	pthread_mutex_unlock(&rank_mutex);
+
+	return filled;
+}
@@ -0,0 +1,106 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard store
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Every user gets a stat slot that never moves once created.
+// Slots live in fixed size chunks that are allocated as the
+// user count grows, and are found by username through an
+// open-addressing hash index. Games played and won are packed
+// into one 64-bit word so a result is recorded with a single
+// atomic add, without taking any lock. Only adding a new user
+// takes a lock, and readers never wait for it.
+//
+// Alongside the index, users are kept in rank order (most wins,
+// then best win ratio, then most plays) in a treap whose nodes
+// live in the stat slots themselves. Each node counts the nodes
+// beneath it, so finding a user's rank or the user at a given
+// rank takes logarithmic time however large the table grows.
+// The treap has a lock, which results don't take: a result only
+// pushes its user onto a lock-free list of users to re-rank, once
+// until they are re-ranked. The next ranked query moves those
+// users under the lock before it reads, so it always sees every
+// result recorded before it started, and games never wait on it.
+//
+// A change counter goes up with every new user and every result,
+// so a copy of the table can tell cheaply whether it is stale.
+//
+// A user's results are the sum of those recorded here, which the
+// journal keeps, and those merged in from other servers, which
+// replication keeps. On a lone server the two are the same.
+
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#define LEADERBOARD_CHUNK_BITS 12
+#define LEADERBOARD_CHUNK (1 << LEADERBOARD_CHUNK_BITS)
+#define LEADERBOARD_MAX_CHUNKS 4096
+
+// How many of a user's latest phrases word selection avoids
+#define LEADERBOARD_RECENT 8
+
+// What addLeaderboardEntry did. It returns -1 when the table is
+// full or out of memory.
+#define LEADERBOARD_ADDED 1
+#define LEADERBOARD_EXISTS 0
+
+// One packed result: a play in the high half, a win in the low
+#define RESULT_PLAYED (1ULL << 32)
+#define RESULT_WON 1ULL
+
+struct LeaderBoard {
+	char *username;
+	unsigned long long results;	// every server's results
+	unsigned long long local;	// those recorded by this server
+
+	// Rank tree links, guarded by the rank lock. Links are user
+	// numbers plus one, with 0 meaning no child, and the node is
+	// ordered by the results it had when last placed in the tree.
+	unsigned int number;
+	unsigned int rankLeft, rankRight, rankSize;
+	unsigned long long rankedResults;
+
+	// Set while the user waits on the re-rank list
+	unsigned int rankDirty;
+	struct LeaderBoard *rankNext;
+
+	// Dictionary entries (plus one) of the user's latest games,
+	// written round robin. Only a hint, so sessions of the same
+	// user may race on it harmlessly.
+	unsigned int recent[LEADERBOARD_RECENT];
+	unsigned int recentNext;
+};
+
+// A user and the results they were ranked by
+struct RankedRow {
+	unsigned long rank;
+	struct LeaderBoard *entry;
+	unsigned long long results;
+};
+
+int leaderboardInit(unsigned long expectedUsers);
+void leaderboardFree();
+
+struct LeaderBoard *findLeaderboardEntry(const char *name);
+struct LeaderBoard *leaderboardAt(unsigned long i);
+unsigned long leaderboardCount();
+unsigned long leaderboardChanges();
+
+int addLeaderboardEntry(char *name);
+int addLossFor(char *name);
+int addWinFor(char *name);
+
+// Called with a user's new local results every time a game is
+// recorded, on the thread that recorded it.
+extern void (*resultListener)(struct LeaderBoard *entry, unsigned long long results);
+
+void recordResult(struct LeaderBoard *entry, unsigned long long result);
+void restoreResults(struct LeaderBoard *entry, unsigned long long results);
+void mergeResults(struct LeaderBoard *entry, unsigned long long delta);
+void readResults(struct LeaderBoard *entry, unsigned long *gamesPlayed, unsigned long *gamesWon);
+
+unsigned long rankedRange(unsigned long start, unsigned long count, struct RankedRow *rows, unsigned long *total);
+unsigned long rankedAround(struct LeaderBoard *entry, unsigned long radius, struct RankedRow *rows, unsigned long *total);
+
+#endif
@@ -0,0 +1,525 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Load generator
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "protocol.h"
+#include "loadgen.h"
+
+#define ERROR -1
+
+// A reply that takes longer than this counts as an error
+#define LOAD_TIMEOUT_SECONDS 10
+
+// Pause after a failed session so a refused connection does not spin
+#define LOAD_RETRY_MS 10
+
+// Tries at a ticket the server still thinks is in use
+#define LOAD_RESUME_ATTEMPTS 20
+
+// The server turned the session away with OP_BUSY
+#define LOAD_BUSY -2
+
+static const char *typeNames[LOAD_TYPES] = {
+	"connect", "auth", "game start", "guess", "leaderboard", "ranks", "resume"
+};
+
+static const char frequencyOrder[] = "etaoinshrdlcumwfgypbvkjxqz";
+
+struct Account {
+	char username[64];
+	char password[64];
+};
+
+struct LoadSession {
+	int id;
+	int sockfd;
+	struct Account *account;
+	unsigned char ticket[RESUME_TICKET_SIZE];
+	int hasTicket;
+	unsigned long retryMs;		// from the last OP_BUSY
+	unsigned long boardVersion;	// of the last full leaderboard seen
+	int hasBoard;
+	unsigned long long seed;
+	unsigned char *in;
+	struct FrameReader reader;
+	struct Frame frame;
+};
+
+static struct LoadOptions options;
+static struct LoadResults results;
+
+static struct Account accounts[LOAD_MAX_ACCOUNTS];
+static int accountCount = 0;
+static unsigned long nextAccount = 0;
+
+static struct sockaddr_storage serverAddr;
+static socklen_t serverAddrLength;
+
+static volatile int stopping = 0;
+
+// xorshift64*, one state per session
+static unsigned long long nextRandom(unsigned long long *state){
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+static double nextUniform(unsigned long long *state){
+	return (nextRandom(state) >> 11) * 0x1.0p-53;
+}
+
+// Read the "username password" lines after the header line
+static int loadAccounts(const char *path){
+	FILE *fp = fopen(path, "r");
+	char line[256];
+
+	if (fp == NULL) return ERROR;
+
+	fgets(line, sizeof line, fp);
+
+	while (accountCount < LOAD_MAX_ACCOUNTS && fgets(line, sizeof line, fp)){
+		struct Account *account = &accounts[accountCount];
+
+		if (sscanf(line, "%63s %63s", account->username, account->password) == 2) accountCount++;
+	}
+
+	fclose(fp);
+
+	return accountCount > 0 ? accountCount : ERROR;
+}
+
+// Wait as long as the think time distribution says
+static void think(struct LoadSession *session){
+	double ms = options.thinkMs;
+	struct timespec ts;
+
+	if (ms <= 0) return;
+
+	if (options.think == THINK_UNIFORM){
+		ms = 2 * ms * nextUniform(&session->seed);
+	} else if (options.think == THINK_EXPONENTIAL){
+		ms = -ms * log(1 - nextUniform(&session->seed));
+	}
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long) ((ms - ts.tv_sec * 1000.0) * 1e6);
+	nanosleep(&ts, NULL);
+}
+
+// Send a request and time it until its reply has arrived. With
+// until set, frames are read until one with that opcode; the
+// last frame read is left in session->frame.
+static int exchange(struct LoadSession *session, int type, int opcode, const void *payload, size_t len, int until){
+	unsigned long long start = metricsNow();
+
+	if (frameSend(session->sockfd, opcode, payload, len) == ERROR) return ERROR;
+
+	do {
+		if (frameRecv(session->sockfd, &session->reader, &session->frame) <= 0) return ERROR;
+	} while (until && session->frame.opcode != until);
+
+	histogramRecord(&results.latency[type], metricsNow() - start);
+
+	return 1;
+}
+
+// Connect and wait for the server to pick the session up.
+// Returns LOAD_BUSY if the server has no room for it.
+static int openSession(struct LoadSession *session){
+	struct timeval timeout = { LOAD_TIMEOUT_SECONDS, 0 };
+	unsigned long long start = metricsNow();
+
+	if ((session->sockfd = socket(serverAddr.ss_family, SOCK_STREAM, 0)) == -1) return ERROR;
+
+	setsockopt(session->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	setsockopt(session->sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+	frameReaderInit(&session->reader, session->in, FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+
+	if (connect(session->sockfd, (struct sockaddr *) &serverAddr, serverAddrLength) == -1) return ERROR;
+
+	do {
+		if (frameRecv(session->sockfd, &session->reader, &session->frame) <= 0) return ERROR;
+	} while (session->frame.opcode == OP_QUEUED);
+
+	if (session->frame.opcode == OP_BUSY){
+		session->retryMs = session->frame.length >= 4 ? get32(session->frame.payload) : LOAD_RETRY_MS;
+		return LOAD_BUSY;
+	}
+
+	if (session->frame.opcode != OP_CONNECTED) return ERROR;
+
+	histogramRecord(&results.latency[LOAD_CONNECT], metricsNow() - start);
+
+	return 1;
+}
+
+// Log in as the next account in turn
+static int login(struct LoadSession *session){
+	struct Account *account = &accounts[__atomic_fetch_add(&nextAccount, 1, __ATOMIC_RELAXED) % accountCount];
+	size_t nameLength = strlen(account->username) + 1;
+	char buf[128];
+
+	memcpy(buf, account->username, nameLength);
+	memcpy(buf + nameLength, account->password, strlen(account->password));
+
+	if (exchange(session, LOAD_AUTH, OP_AUTH, buf, nameLength + strlen(account->password), 0) == ERROR) return ERROR;
+
+	if (session->frame.opcode != OP_AUTH_OK) return ERROR;
+
+	session->account = account;
+	session->hasTicket = session->frame.length >= RESUME_TICKET_SIZE;
+	if (session->hasTicket) memcpy(session->ticket, session->frame.payload, RESUME_TICKET_SIZE);
+
+	return 1;
+}
+
+// Drop the connection mid-game and get back into the game on a
+// new one with the ticket from the login
+static int dropAndResume(struct LoadSession *session){
+	struct timespec retry = { 0, 1000000L };
+	unsigned char payload[RESUME_TICKET_SIZE + 64];
+	size_t nameLength = strlen(session->account->username);
+	int status;
+
+	close(session->sockfd);
+	session->sockfd = -1;
+
+	if ((status = openSession(session)) != 1) return status;
+
+	memcpy(payload, session->ticket, RESUME_TICKET_SIZE);
+	memcpy(payload + RESUME_TICKET_SIZE, session->account->username, nameLength);
+
+	// The server may not have seen the old connection close yet
+	for (int attempt = 0; ; attempt++){
+		if (exchange(session, LOAD_RESUME, OP_RESUME, payload, RESUME_TICKET_SIZE + nameLength, 0) == ERROR) return ERROR;
+
+		if (session->frame.opcode == OP_AUTH_OK) break;
+		if (attempt == LOAD_RESUME_ATTEMPTS) return ERROR;
+
+		nanosleep(&retry, NULL);
+	}
+
+	if (session->frame.length <= RESUME_TICKET_SIZE || !session->frame.payload[RESUME_TICKET_SIZE]) return ERROR;
+
+	memcpy(session->ticket, session->frame.payload, RESUME_TICKET_SIZE);
+
+	if (frameRecv(session->sockfd, &session->reader, &session->frame) <= 0 || session->frame.opcode != OP_GAME_STATE) return ERROR;
+
+	__atomic_fetch_add(&results.resumes, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+// Whether the last frame leaves the game waiting for a guess
+static int stillPlaying(struct Frame *frame){
+	return frame->opcode == OP_GAME_STATE || (frame->opcode == OP_GUESS_RESULTS && frame->payload[0] == BATCH_PLAYING);
+}
+
+// Play one game to the end with the chosen guess strategy,
+// sending options.batch letters per message
+static int playGame(struct LoadSession *session){
+	char letters[26];
+	int next = 0;
+	int drop = session->hasTicket && (int) (nextRandom(&session->seed) % 100) < options.dropPercent;
+	int status;
+
+	memcpy(letters, frequencyOrder, 26);
+
+	if (options.strategy == STRATEGY_RANDOM){
+		for (int i = 25; i > 0; i--){
+			int j = nextRandom(&session->seed) % (i + 1);
+			char letter = letters[i];
+
+			letters[i] = letters[j];
+			letters[j] = letter;
+		}
+	}
+
+	think(session);
+
+	if (exchange(session, LOAD_START, OP_GAME_START, NULL, 0, 0) == ERROR) return ERROR;
+
+	while (stillPlaying(&session->frame)){
+		int count = options.batch < 26 - next ? options.batch : 26 - next;
+
+		if (count == 0) return ERROR;
+
+		think(session);
+
+		if (count == 1){
+			if (exchange(session, LOAD_GUESS, OP_GUESS, &letters[next], 1, 0) == ERROR) return ERROR;
+		} else if (exchange(session, LOAD_GUESS, OP_GUESS_BATCH, &letters[next], count, 0) == ERROR){
+			return ERROR;
+		}
+
+		next += count;
+
+		if (drop && stillPlaying(&session->frame)){
+			if ((status = dropAndResume(session)) != 1) return status;
+			drop = 0;
+		}
+	}
+
+	// A batch that ended the game is followed by the win or loss
+	if (session->frame.opcode == OP_GUESS_RESULTS && frameRecv(session->sockfd, &session->reader, &session->frame) <= 0) return ERROR;
+
+	if (session->frame.opcode == OP_GAME_WIN){
+		__atomic_fetch_add(&results.wins, 1, __ATOMIC_RELAXED);
+	} else if (session->frame.opcode != OP_GAME_LOSS){
+		return ERROR;
+	}
+
+	__atomic_fetch_add(&results.games, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+// Ask for the whole leaderboard, sending the version of the
+// last one seen as a client keeping a copy would
+static int fullLeaderboard(struct LoadSession *session){
+	unsigned char version[4];
+	unsigned long long start = metricsNow();
+
+	put32(version, session->boardVersion);
+
+	if (frameSend(session->sockfd, OP_LEADERBOARD, version, session->hasBoard ? sizeof version : 0) == ERROR) return ERROR;
+
+	do {
+		if (frameRecv(session->sockfd, &session->reader, &session->frame) <= 0) return ERROR;
+	} while (session->frame.opcode != OP_LB_END && session->frame.opcode != OP_LB_NOT_MODIFIED);
+
+	histogramRecord(&results.latency[LOAD_LEADERBOARD], metricsNow() - start);
+
+	if (session->frame.opcode == OP_LB_NOT_MODIFIED){
+		__atomic_fetch_add(&results.unchanged, 1, __ATOMIC_RELAXED);
+	} else if (session->frame.length >= 4){
+		session->boardVersion = get32(session->frame.payload);
+		session->hasBoard = 1;
+	}
+
+	return 1;
+}
+
+// Ask for either the whole leaderboard or the top ten ranks
+static int viewLeaderboard(struct LoadSession *session){
+	unsigned char query[2] = { 0, 10 };
+
+	think(session);
+
+	if (nextRandom(&session->seed) & 1) return fullLeaderboard(session);
+
+	return exchange(session, LOAD_RANKS, OP_LB_TOP, query, sizeof query, OP_LB_END);
+}
+
+// One whole session from connect to quit
+static int runSession(struct LoadSession *session){
+	int status;
+
+	if ((status = openSession(session)) != 1) return status;
+	if (login(session) == ERROR) return ERROR;
+
+	for (int i = 0; i < options.games && !stopping; i++){
+		if ((status = playGame(session)) != 1) return status;
+
+		if ((int) (nextRandom(&session->seed) % 100) < options.leaderboardPercent && viewLeaderboard(session) == ERROR) return ERROR;
+	}
+
+	frameSend(session->sockfd, OP_QUIT, NULL, 0);
+
+	__atomic_fetch_add(&results.sessions, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+static void *sessionLoop(void *data){
+	struct LoadSession *session = data;
+	struct timespec retry = { 0, LOAD_RETRY_MS * 1000000L };
+
+	while (!stopping){
+		int status = runSession(session);
+
+		if (session->sockfd != -1) close(session->sockfd);
+		session->sockfd = -1;
+
+		if (status == LOAD_BUSY && !stopping){
+			struct timespec wait = { session->retryMs / 1000, (session->retryMs % 1000) * 1000000L };
+
+			__atomic_fetch_add(&results.rejected, 1, __ATOMIC_RELAXED);
+			nanosleep(&wait, NULL);
+		} else if (status == ERROR && !stopping){
+			__atomic_fetch_add(&results.errors, 1, __ATOMIC_RELAXED);
+			nanosleep(&retry, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+// Resolve the server address once for every session
+static int resolveServer(){
+	struct addrinfo hints, *info;
+	char port[16];
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof port, "%d", options.port);
+
+	if (getaddrinfo(options.host, port, &hints, &info) != 0) return ERROR;
+
+	memcpy(&serverAddr, info->ai_addr, info->ai_addrlen);
+	serverAddrLength = info->ai_addrlen;
+	freeaddrinfo(info);
+
+	return 1;
+}
+
+// Print throughput and the latency of each message type
+static void printResults(double elapsed){
+	printf("%d sessions against %s:%d for %.1f s\n", options.sessions, options.host, options.port, elapsed);
+	printf("Sessions %lu (%.1f/s)  Games %lu (%.1f/s, %.0f%% won)  Resumes %lu  Rejected %lu  Errors %lu\n",
+		results.sessions, results.sessions / elapsed, results.games, results.games / elapsed,
+		results.games ? 100.0 * results.wins / results.games : 0.0, results.resumes, results.rejected, results.errors);
+	printf("Leaderboards %llu, %lu not modified\n\n", results.latency[LOAD_LEADERBOARD].count, results.unchanged);
+
+	printf("%-12s %10s %10s %10s %10s %10s\n", "message", "count", "p50 us", "p99 us", "p999 us", "max us");
+
+	for (int i = 0; i < LOAD_TYPES; i++){
+		struct Histogram *histogram = &results.latency[i];
+
+		if (histogram->count == 0) continue;
+
+		printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", typeNames[i], histogram->count,
+			histogramPercentile(histogram, 0.5) / 1e3, histogramPercentile(histogram, 0.99) / 1e3,
+			histogramPercentile(histogram, 0.999) / 1e3, histogram->max / 1e3);
+	}
+}
+
+static void usage(){
+	fprintf(stderr, "usage: client --bench [-n sessions] [-d seconds] [-g games per session] [-s frequency|random] [-b letters]\n"
+		"                      [-k think ms] [-x fixed|uniform|exponential] [-l leaderboard %%] [-r reconnect %%]\n"
+		"                      [-a accounts] hostname port\n");
+	exit(1);
+}
+
+// Entry point for client --bench, with argv starting at --bench
+int loadgenMain(int argc, char *argv[]){
+	struct LoadSession *sessions;
+	pthread_t *threads;
+	pthread_attr_t attr;
+	struct timespec runTime;
+	unsigned long long start, stop;
+	int opt;
+
+	options.sessions = 16;
+	options.seconds = 10;
+	options.games = 3;
+	options.strategy = STRATEGY_FREQUENCY;
+	options.batch = 1;
+	options.think = THINK_EXPONENTIAL;
+	options.thinkMs = 0;
+	options.leaderboardPercent = 10;
+	options.dropPercent = 0;
+	options.accounts = "Authentication.txt";
+
+	while ((opt = getopt(argc, argv, "n:d:g:s:b:k:x:l:r:a:")) != -1){
+		switch (opt){
+			case 'n': options.sessions = atoi(optarg); break;
+			case 'd': options.seconds = atoi(optarg); break;
+			case 'g': options.games = atoi(optarg); break;
+			case 'b': options.batch = atoi(optarg); break;
+			case 'k': options.thinkMs = atof(optarg); break;
+			case 'l': options.leaderboardPercent = atoi(optarg); break;
+			case 'r': options.dropPercent = atoi(optarg); break;
+			case 'a': options.accounts = optarg; break;
+			case 's':
+				if (strcmp(optarg, "frequency") == 0) options.strategy = STRATEGY_FREQUENCY;
+				else if (strcmp(optarg, "random") == 0) options.strategy = STRATEGY_RANDOM;
+				else usage();
+			break;
+			case 'x':
+				if (strcmp(optarg, "fixed") == 0) options.think = THINK_FIXED;
+				else if (strcmp(optarg, "uniform") == 0) options.think = THINK_UNIFORM;
+				else if (strcmp(optarg, "exponential") == 0) options.think = THINK_EXPONENTIAL;
+				else usage();
+			break;
+			default: usage();
+		}
+	}
+
+	if (argc - optind != 2 || options.sessions < 1 || options.games < 1 || options.batch < 1 || options.batch > GUESS_BATCH_MAX) usage();
+
+	options.host = argv[optind];
+	options.port = atoi(argv[optind + 1]);
+
+	if (loadAccounts(options.accounts) == ERROR){
+		fprintf(stderr, "%s: no accounts to log in with\n", options.accounts);
+		return 1;
+	}
+
+	if (resolveServer() == ERROR){
+		fprintf(stderr, "%s: could not resolve\n", options.host);
+		return 1;
+	}
+
+	sessions = calloc(options.sessions, sizeof *sessions);
+	threads = calloc(options.sessions, sizeof *threads);
+
+	// Session threads only block on sockets, so a small stack
+	// lets a run have thousands of them
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+
+	start = metricsNow();
+
+	for (int i = 0; i < options.sessions; i++){
+		sessions[i].id = i;
+		sessions[i].sockfd = -1;
+		sessions[i].seed = (start ^ (0x9E3779B97F4A7C15ULL * (i + 1))) | 1;
+		sessions[i].in = malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+
+		if (pthread_create(&threads[i], &attr, sessionLoop, &sessions[i]) != 0){
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	runTime.tv_sec = options.seconds;
+	runTime.tv_nsec = 0;
+	nanosleep(&runTime, NULL);
+	stopping = 1;
+	stop = metricsNow();
+
+	// Sessions finish the request they are on, which may be a
+	// connect still waiting out SYN retries
+
+	for (int i = 0; i < options.sessions; i++){
+		pthread_join(threads[i], NULL);
+		free(sessions[i].in);
+	}
+
+	printResults((stop - start) / 1e9);
+
+	free(sessions);
+	free(threads);
+
+	return results.errors ? 2 : 0;
+}
@@ -0,0 +1,69 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Load generator
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// client --bench runs many sessions against a server at once
+// with no one at the keyboard. Each session thread connects, logs
+// in as one of the accounts in Authentication.txt, plays some
+// games, sometimes asks for the leaderboard, quits and starts
+// again until the run is over. Every request is timed from send
+// to the last frame of its reply and kept in a histogram per
+// message type.
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "metrics.h"
+
+// Message types that are timed
+#define LOAD_CONNECT 0		// connect until OP_CONNECTED
+#define LOAD_AUTH 1
+#define LOAD_START 2
+#define LOAD_GUESS 3		// one letter or a whole batch
+#define LOAD_LEADERBOARD 4
+#define LOAD_RANKS 5
+#define LOAD_RESUME 6		// OP_RESUME until the game is back
+#define LOAD_TYPES 7
+
+// How a session picks its next letter
+#define STRATEGY_FREQUENCY 0	// most common English letters first
+#define STRATEGY_RANDOM 1	// a fresh shuffle of the alphabet each game
+
+// How long a session waits between requests
+#define THINK_FIXED 0
+#define THINK_UNIFORM 1		// between 0 and twice the mean
+#define THINK_EXPONENTIAL 2
+
+#define LOAD_MAX_ACCOUNTS 1024
+
+struct LoadOptions {
+	const char *host;
+	int port;
+	int sessions;		// concurrent sessions
+	int seconds;		// length of the run
+	int games;		// games per session before it quits
+	int strategy;
+	int batch;		// letters per guess message
+	int think;
+	double thinkMs;		// mean think time
+	int leaderboardPercent;	// chance after each game of a leaderboard request
+	int dropPercent;	// chance per game of reconnecting mid-game
+	const char *accounts;	// file of "username password" lines
+};
+
+struct LoadResults {
+	struct Histogram latency[LOAD_TYPES];
+	unsigned long sessions;
+	unsigned long games;
+	unsigned long wins;
+	unsigned long resumes;
+	unsigned long rejected;	// turned away with OP_BUSY
+	unsigned long unchanged;	// leaderboards answered not modified
+	unsigned long errors;
+};
+
+int loadgenMain(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,156 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Lobby
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "lobby.h"
+#include "protocol.h"
+
+#define ERROR -1
+
+// Milliseconds the connection at a position should wait, or 0
+// if nothing has been picked up lately to tell. Called with the
+// lock held.
+static unsigned long estimate(struct Lobby *lobby, unsigned long position){
+	return lobby->rate > 0 ? (unsigned long) (position * 1000.0 / lobby->rate) : 0;
+}
+
+// Tell every waiting connection where it stands, and fold the
+// last tick's pick ups into the rate
+static void *noticeLoop(void *data){
+	struct Lobby *lobby = data;
+	struct timespec tick = { LOBBY_NOTICE_MS / 1000, (LOBBY_NOTICE_MS % 1000) * 1000000L };
+	unsigned long lastTaken = 0;
+
+	while (1){
+		unsigned char out[FRAME_HEADER_SIZE + 8];
+		unsigned long position = 0;
+		double latest;
+
+		nanosleep(&tick, NULL);
+
+		// Stopping only ever happens between ticks, never with
+		// the lock held
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_mutex_lock(&lobby->mutex);
+
+		latest = (lobby->taken - lastTaken) * 1000.0 / LOBBY_NOTICE_MS;
+		lastTaken = lobby->taken;
+		lobby->rate = lobby->rate > 0 ? (1 - LOBBY_RATE_WEIGHT) * lobby->rate + LOBBY_RATE_WEIGHT * latest : latest;
+
+		for (struct LobbyEntry *entry = lobby->head.next; entry != &lobby->head; entry = entry->next){
+			unsigned char payload[8];
+			size_t len;
+			ssize_t sent;
+
+			put32(payload, ++position);
+			put32(payload + 4, estimate(lobby, position));
+			len = frameEncode(out, OP_QUEUED, payload, sizeof payload);
+
+			// A short write would break the framing, so the
+			// client is cut off rather than sent the rest
+			if ((sent = send(entry->fd, out, len, MSG_DONTWAIT | MSG_NOSIGNAL)) == (ssize_t) len){
+				countSent(1, len);
+				lobby->notices++;
+			} else if (sent > 0){
+				shutdown(entry->fd, SHUT_RDWR);
+			}
+		}
+
+		pthread_mutex_unlock(&lobby->mutex);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	return NULL;
+}
+
+// Open an empty lobby and start its notifier
+int lobbyStart(struct Lobby *lobby){
+	memset(lobby, 0, sizeof *lobby);
+
+	pthread_mutex_init(&lobby->mutex, NULL);
+	lobby->head.next = lobby->head.prev = &lobby->head;
+
+	if (slabInit(&lobby->entries, "lobby", sizeof(struct LobbyEntry)) == ERROR) return ERROR;
+
+	if (pthread_create(&lobby->thread, NULL, noticeLoop, lobby) != 0) return ERROR;
+
+	return 1;
+}
+
+// Add a connection to the back of the line. Returns NULL if
+// there is no memory for it, in which case it is sent no notices.
+struct LobbyEntry *lobbyJoin(struct Lobby *lobby, int fd){
+	struct LobbyEntry *entry = slabAlloc(&lobby->entries);
+
+	if (entry == NULL) return NULL;
+
+	entry->fd = fd;
+
+	pthread_mutex_lock(&lobby->mutex);
+
+	entry->prev = lobby->head.prev;
+	entry->next = &lobby->head;
+	entry->prev->next = entry;
+	lobby->head.prev = entry;
+	lobby->waiting++;
+
+	pthread_mutex_unlock(&lobby->mutex);
+
+	return entry;
+}
+
+// Unlink a connection from the line, counting it as picked up
+// if a thread has it
+static void removeEntry(struct Lobby *lobby, struct LobbyEntry *entry, int taken){
+	pthread_mutex_lock(&lobby->mutex);
+
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	lobby->waiting--;
+	lobby->taken += taken;
+
+	pthread_mutex_unlock(&lobby->mutex);
+
+	slabFree(&lobby->entries, entry);
+}
+
+// Take a connection out of the lobby, once a thread has it
+void lobbyLeave(struct Lobby *lobby, struct LobbyEntry *entry){
+	removeEntry(lobby, entry, 1);
+}
+
+// Take out a connection no thread will pick up, such as one
+// turned away after it joined, without counting it towards the
+// pick up rate
+void lobbyDrop(struct Lobby *lobby, struct LobbyEntry *entry){
+	removeEntry(lobby, entry, 0);
+}
+
+// Milliseconds a connection at this place in line should wait,
+// or 0 if there is no estimate yet
+unsigned long lobbyEstimate(struct Lobby *lobby, unsigned long position){
+	unsigned long ms;
+
+	pthread_mutex_lock(&lobby->mutex);
+	ms = estimate(lobby, position);
+	pthread_mutex_unlock(&lobby->mutex);
+
+	return ms;
+}
+
+// Stop sending notices. Connections still waiting are left as
+// they are.
+void lobbyStop(struct Lobby *lobby){
+	if (lobby->head.next == NULL) return;
+
+	pthread_cancel(lobby->thread);
+	pthread_join(lobby->thread, NULL);
+}
@@ -0,0 +1,55 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Lobby
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// In pool mode an admitted connection waits in the request queue
+// until a thread is free. The lobby keeps the waiting connections
+// in arrival order, and a notifier thread tells each of them every
+// LOBBY_NOTICE_MS where it stands: its place in line and how long
+// that should take, at the rate threads have lately been picking
+// connections up.
+//
+// A thread takes its connection out of the lobby before it uses
+// the socket, and both happen under the lobby's lock, so the
+// notifier never writes to a socket a session owns or one that
+// has been closed. Notices are sent without blocking; a client
+// that lets them pile up past its socket buffer is cut off.
+
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#include <pthread.h>
+
+#include "slab.h"
+
+#define LOBBY_NOTICE_MS 1000
+
+// Weight of the latest tick in the smoothed pick up rate
+#define LOBBY_RATE_WEIGHT 0.3
+
+struct LobbyEntry {
+	int fd;
+	struct LobbyEntry *prev, *next;
+};
+
+struct Lobby {
+	pthread_mutex_t mutex;
+	struct LobbyEntry head;		// the oldest waiting connection is head.next
+	unsigned long waiting;
+	unsigned long taken;		// connections picked up by a thread
+	double rate;			// picked up per second, smoothed
+	unsigned long notices;
+	struct Slab entries;
+	pthread_t thread;
+};
+
+int lobbyStart(struct Lobby *lobby);
+struct LobbyEntry *lobbyJoin(struct Lobby *lobby, int fd);
+void lobbyLeave(struct Lobby *lobby, struct LobbyEntry *entry);
+void lobbyDrop(struct Lobby *lobby, struct LobbyEntry *entry);
+unsigned long lobbyEstimate(struct Lobby *lobby, unsigned long position);
+void lobbyStop(struct Lobby *lobby);
+
+#endif
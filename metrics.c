@@ -0,0 +1,288 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Server metrics
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+#define ERROR -1
+
+// Largest metrics page the admin port serves
+#define METRICS_PAGE_SIZE (256 * 1024)
+
+static struct Metric metrics[METRICS_MAX];
+static int metricCount = 0;
+
+static int adminSocket = -1;
+static pthread_t adminThread;
+
+// Nanoseconds on the monotonic clock
+unsigned long long metricsNow(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------- */
+// Histograms
+/* ---------------------------------------------------------------- */
+
+// The bucket a value falls in. Values below one sub-bucket
+// step get a bucket each; above that, the top bit picks the
+// power of two and the next HISTOGRAM_SUB_BITS bits the step.
+static int bucketOf(unsigned long long value){
+	int top;
+
+	if (value < HISTOGRAM_SUB_BUCKETS) return value;
+
+	top = 63 - __builtin_clzll(value);
+
+	if (top >= HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+
+	return (top - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> (top - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// The largest value a bucket holds
+static unsigned long long bucketLimit(int bucket){
+	int band = bucket / HISTOGRAM_SUB_BUCKETS, step = bucket % HISTOGRAM_SUB_BUCKETS;
+
+	if (band == 0) return step;
+
+	return ((unsigned long long) (HISTOGRAM_SUB_BUCKETS + step + 1) << (band - 1)) - 1;
+}
+
+// Record one value, in nanoseconds
+void histogramRecord(struct Histogram *histogram, unsigned long long nanos){
+	unsigned long long seen = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&histogram->counts[bucketOf(nanos)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, nanos, __ATOMIC_RELAXED);
+
+	while (nanos > seen && !__atomic_compare_exchange_n(&histogram->max, &seen, nanos, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// The value below which the given fraction of recordings fall,
+// rounded up to its bucket's limit
+unsigned long long histogramPercentile(struct Histogram *histogram, double percentile){
+	unsigned long long count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	unsigned long long target = count * percentile, seen = 0;
+	unsigned long long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+	if (count == 0) return 0;
+	if (target >= count) target = count - 1;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+		seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+
+		if (seen > target) return bucketLimit(i) < max ? bucketLimit(i) : max;
+	}
+
+	return max;
+}
+
+/* ---------------------------------------------------------------- */
+// Registry
+/* ---------------------------------------------------------------- */
+
+static struct Metric *addMetric(int type, const char *name, const char *help){
+	struct Metric *metric;
+
+	if (metricCount == METRICS_MAX){
+		fprintf(stderr, "Too many metrics registered, at %s: raise METRICS_MAX\n", name);
+		exit(1);
+	}
+
+	metric = &metrics[metricCount++];
+	memset(metric, 0, sizeof *metric);
+	metric->type = type;
+	metric->name = name;
+	metric->help = help;
+
+	return metric;
+}
+
+// Register a count that only goes up
+void metricsCounter(const char *name, const char *help, unsigned long *value){
+	struct Metric *metric = addMetric(METRIC_COUNTER, name, help);
+
+	metric->value = value;
+}
+
+// Register a level, either a variable or a function to read it
+void metricsGauge(const char *name, const char *help, unsigned long *value, unsigned long (*read)()){
+	struct Metric *metric = addMetric(METRIC_GAUGE, name, help);
+
+	metric->value = value;
+	metric->read = read;
+}
+
+// Register a latency histogram
+void metricsHistogram(struct Histogram *histogram, const char *name, const char *help){
+	struct Metric *metric = addMetric(METRIC_HISTOGRAM, name, help);
+
+	histogram->name = name;
+	histogram->help = help;
+
+	metric->histogram = histogram;
+}
+
+static unsigned long metricValue(struct Metric *metric){
+	if (metric->read) return metric->read();
+	return __atomic_load_n(metric->value, __ATOMIC_RELAXED);
+}
+
+// Append to a buffer, never past its end
+static size_t append(char *out, size_t cap, size_t len, const char *format, ...){
+	va_list args;
+	int n;
+
+	if (len >= cap) return len;
+
+	va_start(args, format);
+	n = vsnprintf(out + len, cap - len, format, args);
+	va_end(args);
+
+	if (n < 0) return len;
+	return len + n < cap ? len + n : cap - 1;
+}
+
+// A short human readable report: every counter, then the count
+// and percentiles of every histogram in microseconds
+size_t metricsSummary(char *out, size_t cap){
+	size_t len = 0;
+
+	out[0] = '\0';
+
+	for (int i = 0; i < metricCount; i++){
+		struct Metric *metric = &metrics[i];
+		struct Histogram *histogram = metric->histogram;
+
+		if (metric->type != METRIC_HISTOGRAM){
+			len = append(out, cap, len, "%-28s %lu\n", metric->name, metricValue(metric));
+			continue;
+		}
+
+		len = append(out, cap, len, "%-28s n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+			metric->name, histogram->count,
+			histogramPercentile(histogram, 0.5) / 1e3, histogramPercentile(histogram, 0.99) / 1e3,
+			histogramPercentile(histogram, 0.999) / 1e3, histogram->max / 1e3);
+	}
+
+	return len;
+}
+
+// Prometheus text exposition. Histograms are reported in seconds
+// at every power of two nanoseconds from 1 us, which fall on
+// bucket edges so the cumulative counts are exact.
+size_t metricsPrometheus(char *out, size_t cap){
+	size_t len = 0;
+
+	out[0] = '\0';
+
+	for (int i = 0; i < metricCount; i++){
+		struct Metric *metric = &metrics[i];
+		struct Histogram *histogram = metric->histogram;
+		unsigned long long cumulative = 0;
+		int bucket = 0;
+
+		if (metric->type != METRIC_HISTOGRAM){
+			len = append(out, cap, len, "# HELP hangman_%s %s\n# TYPE hangman_%s %s\nhangman_%s %lu\n",
+				metric->name, metric->help, metric->name,
+				metric->type == METRIC_COUNTER ? "counter" : "gauge",
+				metric->name, metricValue(metric));
+			continue;
+		}
+
+		len = append(out, cap, len, "# HELP hangman_%s_seconds %s\n# TYPE hangman_%s_seconds histogram\n",
+			metric->name, metric->help, metric->name);
+
+		for (int bits = 10; bits < HISTOGRAM_MAX_BITS; bits++){
+			unsigned long long limit = (1ULL << bits) - 1;
+
+			while (bucket < HISTOGRAM_BUCKETS && bucketLimit(bucket) <= limit){
+				cumulative += __atomic_load_n(&histogram->counts[bucket++], __ATOMIC_RELAXED);
+			}
+
+			len = append(out, cap, len, "hangman_%s_seconds_bucket{le=\"%.9g\"} %llu\n",
+				metric->name, (limit + 1) / 1e9, cumulative);
+		}
+
+		while (bucket < HISTOGRAM_BUCKETS) cumulative += __atomic_load_n(&histogram->counts[bucket++], __ATOMIC_RELAXED);
+
+		len = append(out, cap, len, "hangman_%s_seconds_bucket{le=\"+Inf\"} %llu\nhangman_%s_seconds_sum %.9f\nhangman_%s_seconds_count %llu\n",
+			metric->name, cumulative, metric->name, histogram->sum / 1e9, metric->name, cumulative);
+	}
+
+	return len;
+}
+
+/* ---------------------------------------------------------------- */
+// Admin port
+/* ---------------------------------------------------------------- */
+
+// Answer each connection with the metrics page and close it.
+// Whatever the client sent (normally an HTTP GET) is ignored.
+static void *adminLoop(void *data){
+	char *page = malloc(METRICS_PAGE_SIZE), request[1024];
+
+	while (1){
+		char header[128];
+		size_t len;
+		int fd, headerLength;
+
+		if ((fd = accept(adminSocket, NULL, NULL)) == -1) continue;
+
+		if (recv(fd, request, sizeof request, 0) >= 0){
+			len = metricsPrometheus(page, METRICS_PAGE_SIZE);
+			headerLength = snprintf(header, sizeof header,
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+
+			if (send(fd, header, headerLength, MSG_NOSIGNAL) == headerLength){
+				send(fd, page, len, MSG_NOSIGNAL);
+			}
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+// Serve Prometheus text on a port bound to the loopback address
+int metricsServe(int port){
+	struct sockaddr_in addr;
+	int yes = 1;
+
+	if ((adminSocket = socket(AF_INET, SOCK_STREAM, 0)) == -1) return ERROR;
+
+	setsockopt(adminSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(adminSocket, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(adminSocket, 16) == -1){
+		close(adminSocket);
+		adminSocket = -1;
+		return ERROR;
+	}
+
+	if (pthread_create(&adminThread, NULL, adminLoop, NULL) != 0) return ERROR;
+
+	return 1;
+}
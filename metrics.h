@@ -0,0 +1,68 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Server metrics
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Latency histograms and counters that any thread can update
+// with a few atomic adds and no locks.
+//
+// A histogram is log-linear, like HdrHistogram: each power of two
+// of nanoseconds is split into HISTOGRAM_SUB_BUCKETS equal steps,
+// so any recorded value is kept to within 1/8 of itself from a
+// nanosecond up to about 18 minutes, in a fixed 2.6 KiB.
+//
+// Metrics are registered once at startup and can then be read as
+// a short text summary or as Prometheus text, which the admin
+// port serves to anything that connects to it. Registering more
+// than METRICS_MAX is a startup error, so none are left out.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+#define METRICS_MAX 64
+
+struct Histogram {
+	const char *name;
+	const char *help;
+	unsigned long long counts[HISTOGRAM_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+};
+
+#define METRIC_COUNTER 0
+#define METRIC_GAUGE 1
+#define METRIC_HISTOGRAM 2
+
+struct Metric {
+	int type;
+	const char *name;
+	const char *help;
+	unsigned long *value;		// counters and gauges kept elsewhere
+	unsigned long (*read)();	// or gauges computed when read
+	struct Histogram *histogram;
+};
+
+void histogramRecord(struct Histogram *histogram, unsigned long long nanos);
+unsigned long long histogramPercentile(struct Histogram *histogram, double percentile);
+
+void metricsCounter(const char *name, const char *help, unsigned long *value);
+void metricsGauge(const char *name, const char *help, unsigned long *value, unsigned long (*read)());
+void metricsHistogram(struct Histogram *histogram, const char *name, const char *help);
+
+size_t metricsSummary(char *out, size_t cap);
+size_t metricsPrometheus(char *out, size_t cap);
+
+int metricsServe(int port);
+
+unsigned long long metricsNow();
+
+#endif
@@ -0,0 +1,540 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Elastic worker pool
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pool.h"
+
+#define ERROR -1
+
+// NUMA nodes looked for in sysfs
+#define POOL_MAX_NODES 64
+
+// Nanoseconds on the monotonic clock, for request timestamps
+unsigned long long poolNow(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Raise *target to value if it is larger
+static void atomicMax(unsigned long long *target, unsigned long long value){
+	unsigned long long seen = __atomic_load_n(target, __ATOMIC_RELAXED);
+
+	while (value > seen && !__atomic_compare_exchange_n(target, &seen, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Park the calling thread while *word still holds value
+static void futexWait(int *word, int value){
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+// Wake up to count threads parked on word
+static void futexWake(int *word, int count){
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Wake up to count of a shard's parked workers
+static void ringBell(struct PoolShard *shard, int count){
+	__atomic_fetch_add(&shard->bell, 1, __ATOMIC_SEQ_CST);
+	futexWake(&shard->bell, count);
+}
+
+// Take a request from the worker's own shard, or failing that
+// steal one from the nearest shard that has any
+static int takeRequest(struct WorkerPool *pool, struct PoolWorker *worker, struct Request *request){
+	struct PoolShard *home = &pool->shards[worker->shard];
+
+	if (queueTryPop(&home->queue, request)) return 1;
+
+	for (int i = 0; i < pool->shardCount - 1; i++){
+		struct PoolShard *victim = &pool->shards[home->order[i]];
+
+		if (queueTryPop(&victim->queue, request)){
+			__atomic_fetch_add(&victim->steals, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&pool->stats.steals, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Claim one of the pending retirements, if there are any
+static int claimRetirement(struct WorkerPool *pool){
+	int pending = __atomic_load_n(&pool->retiring, __ATOMIC_RELAXED);
+
+	while (pending > 0){
+		if (__atomic_compare_exchange_n(&pool->retiring, &pending, pending - 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return 1;
+	}
+
+	return 0;
+}
+
+// Wait for a request, parking while every shard is empty.
+// Returns 0 if the worker should retire instead.
+static int nextRequest(struct WorkerPool *pool, struct PoolWorker *worker, struct Request *request){
+	struct PoolShard *home = &pool->shards[worker->shard];
+
+	while (1){
+		int seen;
+
+		if (claimRetirement(pool)) return 0;
+		if (takeRequest(pool, worker, request)) return 1;
+
+		seen = __atomic_load_n(&home->bell, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&home->sleepers, 1, __ATOMIC_SEQ_CST);
+
+		// Look again now we are registered, so a push or a
+		// retirement that happened in between cannot be missed
+		if (takeRequest(pool, worker, request)){
+			__atomic_fetch_sub(&home->sleepers, 1, __ATOMIC_SEQ_CST);
+			return 1;
+		}
+
+		if (__atomic_load_n(&pool->retiring, __ATOMIC_SEQ_CST) == 0){
+			__atomic_fetch_add(&pool->stats.parks, 1, __ATOMIC_RELAXED);
+			futexWait(&home->bell, seen);
+		}
+
+		__atomic_fetch_sub(&home->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+// Take requests until asked to retire
+static void *workerLoop(void *data){
+	struct PoolWorker *worker = data;
+	struct WorkerPool *pool = worker->pool;
+	struct Request request;
+
+	while (nextRequest(pool, worker, &request)){
+		unsigned long long wait;
+
+		wait = poolNow() - request.enqueued;
+		__atomic_fetch_add(&pool->stats.waitNanos, wait, __ATOMIC_RELAXED);
+		atomicMax(&pool->stats.maxWaitNanos, wait);
+		atomicMax(&pool->tickMaxWait, wait);
+		if (pool->waits) histogramRecord(pool->waits, wait);
+
+		__atomic_fetch_add(&pool->stats.busy, 1, __ATOMIC_RELAXED);
+		pool->handle(&request, worker->id);
+		__atomic_fetch_sub(&pool->stats.busy, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&pool->stats.served, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_sub(&pool->stats.threads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pool->stats.threadsRetired, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&worker->alive, 0, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+// Start up to count more workers in free slots. Returns how
+// many were started.
+static int addWorkers(struct WorkerPool *pool, int count){
+	int started = 0;
+
+	for (int i = 0; i < pool->max && started < count; i++){
+		struct PoolWorker *worker = &pool->workers[i];
+		pthread_attr_t attr;
+		int failed;
+
+		if (__atomic_load_n(&worker->alive, __ATOMIC_ACQUIRE)) continue;
+
+		worker->alive = 1;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if (pool->pinned){
+			struct PoolShard *shard = &pool->shards[worker->shard];
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			for (int c = shard->first; c < shard->first + shard->count; c++) CPU_SET(pool->cpus[c], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+		}
+
+		failed = pthread_create(&worker->thread, &attr, workerLoop, worker) != 0;
+		pthread_attr_destroy(&attr);
+
+		if (failed){
+			worker->alive = 0;
+			break;
+		}
+
+		started++;
+	}
+
+	__atomic_fetch_add(&pool->stats.threads, started, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pool->stats.threadsStarted, started, __ATOMIC_RELAXED);
+
+	if (pool->stats.threads > pool->stats.peak) pool->stats.peak = pool->stats.threads;
+
+	return started;
+}
+
+// Ask count workers to exit once they are free, waking every
+// parked worker so the idle ones can take up the request
+static void retireWorkers(struct WorkerPool *pool, int count){
+	__atomic_fetch_add(&pool->retiring, count, __ATOMIC_SEQ_CST);
+
+	for (int i = 0; i < pool->shardCount; i++){
+		ringBell(&pool->shards[i], INT_MAX);
+	}
+}
+
+// Sample the queue every tick and resize the pool
+static void *superviseLoop(void *data){
+	struct WorkerPool *pool = data;
+	struct timespec tick = { 0, POOL_TICK_MS * 1000000L };
+	int pressured = 0, idleTicks = 0;
+
+	while (1){
+		unsigned long depth, threads, busy, idle;
+		unsigned long long wait;
+
+		nanosleep(&tick, NULL);
+
+		depth = poolDepth(pool);
+		threads = __atomic_load_n(&pool->stats.threads, __ATOMIC_RELAXED);
+		busy = __atomic_load_n(&pool->stats.busy, __ATOMIC_RELAXED);
+		idle = threads > busy ? threads - busy : 0;
+		wait = __atomic_exchange_n(&pool->tickMaxWait, 0, __ATOMIC_RELAXED);
+
+		// Requests still queued now have waited at least a tick
+		if (depth > 0 && wait < POOL_TICK_MS * 1000000ULL) wait = POOL_TICK_MS * 1000000ULL;
+
+		if (depth > 0 && (wait >= POOL_GROW_WAIT_MS * 1000000ULL || depth > threads)){
+			pressured++;
+		} else {
+			pressured = 0;
+		}
+
+		if (depth == 0 && idle > 0 && threads > (unsigned long) pool->min){
+			idleTicks++;
+		} else {
+			idleTicks = 0;
+		}
+
+		if (pressured >= POOL_GROW_TICKS && threads < (unsigned long) pool->max){
+			int started = addWorkers(pool, depth < (unsigned long) (pool->max - threads) ? depth : pool->max - threads);
+
+			if (started > 0){
+				pool->stats.grows++;
+				printf("Pool: grew to %lu threads (%lu queued, waited %.1f ms)\n",
+					threads + started, depth, wait / 1e6);
+			}
+
+			pressured = 0;
+		} else if (idleTicks >= POOL_SHRINK_TICKS){
+			unsigned long retire = idle / 2 > 0 ? idle / 2 : 1;
+
+			if (threads - retire < (unsigned long) pool->min) retire = threads - pool->min;
+
+			retireWorkers(pool, retire);
+			pool->stats.shrinks++;
+			printf("Pool: shrinking to %lu threads\n", threads - retire);
+
+			idleTicks = 0;
+		}
+	}
+
+	return NULL;
+}
+
+// The NUMA node of every CPU, from sysfs. CPUs are left on
+// node 0 where the kernel has no nodes to show.
+static void readNodes(int *nodes, int limit){
+	char path[64], list[4096];
+
+	memset(nodes, 0, limit * sizeof *nodes);
+
+	for (int node = 0; node < POOL_MAX_NODES; node++){
+		FILE *fp;
+		char *p = list;
+
+		snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+
+		if ((fp = fopen(path, "r")) == NULL) continue;
+
+		if (fgets(list, sizeof list, fp) == NULL) list[0] = '\0';
+		fclose(fp);
+
+		// A list of ranges such as "0-3,8-11"
+		while (*p >= '0' && *p <= '9'){
+			long from = strtol(p, &p, 10), to = from;
+
+			if (*p == '-') to = strtol(p + 1, &p, 10);
+
+			for (long cpu = from; cpu <= to && cpu < limit; cpu++) nodes[cpu] = node;
+
+			if (*p == ',') p++;
+		}
+	}
+}
+
+// Find the CPUs the process may run on, grouped by node, and
+// give each shard an even share of them. With more shards than
+// CPUs, shards share CPUs in turn.
+static int placeShards(struct WorkerPool *pool){
+	int nodes[CPU_SETSIZE];
+	cpu_set_t allowed;
+
+	readNodes(nodes, CPU_SETSIZE);
+
+	if (sched_getaffinity(0, sizeof allowed, &allowed) == -1){
+		CPU_ZERO(&allowed);
+		CPU_SET(0, &allowed);
+	}
+
+	pool->cpus = malloc(CPU_COUNT(&allowed) * sizeof(int));
+	pool->cpuLimit = 0;
+
+	if (pool->cpus == NULL) return ERROR;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		int at;
+
+		if (!CPU_ISSET(cpu, &allowed)) continue;
+
+		// Insertion sort by node, keeping CPU order within one
+		for (at = pool->cpuCount; at > 0 && nodes[pool->cpus[at - 1]] > nodes[cpu]; at--){
+			pool->cpus[at] = pool->cpus[at - 1];
+		}
+
+		pool->cpus[at] = cpu;
+		pool->cpuCount++;
+		pool->cpuLimit = cpu + 1;
+	}
+
+	if ((pool->cpuShard = malloc(pool->cpuLimit * sizeof(int))) == NULL) return ERROR;
+
+	for (int cpu = 0; cpu < pool->cpuLimit; cpu++) pool->cpuShard[cpu] = -1;
+
+	for (int i = 0; i < pool->shardCount; i++){
+		struct PoolShard *shard = &pool->shards[i];
+
+		if (pool->shardCount >= pool->cpuCount){
+			shard->first = i % pool->cpuCount;
+			shard->count = 1;
+		} else {
+			shard->first = i * pool->cpuCount / pool->shardCount;
+			shard->count = (i + 1) * pool->cpuCount / pool->shardCount - shard->first;
+		}
+
+		shard->node = nodes[pool->cpus[shard->first]];
+
+		for (int c = shard->first; c < shard->first + shard->count; c++){
+			if (pool->cpuShard[pool->cpus[c]] == -1) pool->cpuShard[pool->cpus[c]] = i;
+		}
+	}
+
+	return 1;
+}
+
+// Order the shards each shard steals from: those on its own node
+// first, then the rest, each going round from the next shard on
+// so thieves spread out over their victims
+static int orderShards(struct WorkerPool *pool){
+	for (int i = 0; i < pool->shardCount; i++){
+		struct PoolShard *shard = &pool->shards[i];
+		int n = 0;
+
+		if ((shard->order = malloc(pool->shardCount * sizeof(int))) == NULL) return ERROR;
+
+		for (int pass = 0; pass < 2; pass++){
+			for (int step = 1; step < pool->shardCount; step++){
+				int other = (i + step) % pool->shardCount;
+
+				if ((pool->shards[other].node == shard->node) == (pass == 0)) shard->order[n++] = other;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// Set up the shards, each with an even share of capacity, then
+// start min workers and the supervisor. shards of 0 or less
+// means one per CPU.
+int poolStart(struct WorkerPool *pool, unsigned long capacity, int shards, int pinned, int min, int max, void (*handle)(struct Request *request, int worker)){
+	memset(pool, 0, sizeof *pool);
+
+	if (min < 1) min = 1;
+	if (max < min) max = min;
+
+	if (shards <= 0){
+		cpu_set_t allowed;
+
+		shards = sched_getaffinity(0, sizeof allowed, &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+	}
+
+	pool->handle = handle;
+	pool->min = min;
+	pool->max = max;
+	pool->pinned = pinned;
+	pool->shardCount = shards;
+	pool->workers = calloc(max, sizeof(struct PoolWorker));
+
+	if (pool->workers == NULL || posix_memalign((void **) &pool->shards, CACHE_LINE, shards * sizeof(struct PoolShard)) != 0) return ERROR;
+
+	memset(pool->shards, 0, shards * sizeof(struct PoolShard));
+
+	for (int i = 0; i < shards; i++){
+		if (queueInit(&pool->shards[i].queue, (capacity + shards - 1) / shards) == ERROR) return ERROR;
+	}
+
+	if (placeShards(pool) == ERROR || orderShards(pool) == ERROR) return ERROR;
+
+	for (int i = 0; i < max; i++){
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pool->workers[i].shard = i % shards;
+	}
+
+	if (addWorkers(pool, min) < min) return ERROR;
+
+	if (min < max){
+		if (pthread_create(&pool->supervisor, NULL, superviseLoop, pool) != 0) return ERROR;
+		pool->supervised = 1;
+	}
+
+	return 1;
+}
+
+// Queue a request on the shard serving cpu, or on each shard in
+// turn when cpu is -1 or not one of the pool's. If that shard is
+// full the nearest one with room takes it. Returns ERROR when
+// every shard is full.
+int poolSubmit(struct WorkerPool *pool, struct Request *request, int cpu){
+	int first = cpu >= 0 && cpu < pool->cpuLimit ? pool->cpuShard[cpu] : -1;
+	struct PoolShard *shard;
+	int i;
+
+	if (first < 0) first = __atomic_fetch_add(&pool->nextShard, 1, __ATOMIC_RELAXED) % pool->shardCount;
+
+	shard = &pool->shards[first];
+
+	if (!queueTryPush(&shard->queue, request)){
+		for (i = 0; i < pool->shardCount - 1; i++){
+			if (queueTryPush(&pool->shards[shard->order[i]].queue, request)) break;
+		}
+
+		if (i == pool->shardCount - 1) return ERROR;
+	}
+
+	// The push only publishes its slot with a release store, so
+	// fence before reading the sleeper counts. Paired with the
+	// worker's add to sleepers before it looks at the queues
+	// again, either the worker finds the request or it is seen
+	// here. Wake one of the shard's own workers if any are
+	// parked, or else one from the nearest shard.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&shard->sleepers, __ATOMIC_SEQ_CST) > 0){
+		ringBell(shard, 1);
+		return 1;
+	}
+
+	for (i = 0; i < pool->shardCount - 1; i++){
+		struct PoolShard *other = &pool->shards[shard->order[i]];
+
+		if (__atomic_load_n(&other->sleepers, __ATOMIC_SEQ_CST) > 0){
+			ringBell(other, 1);
+			break;
+		}
+	}
+
+	return 1;
+}
+
+// Requests waiting across every shard. Only a snapshot while
+// other threads are pushing and popping.
+unsigned long poolDepth(struct WorkerPool *pool){
+	unsigned long depth = 0;
+
+	for (int i = 0; i < pool->shardCount; i++){
+		depth += queueDepth(&pool->shards[i].queue);
+	}
+
+	return depth;
+}
+
+// Stop the supervisor, retire every worker once it is free and
+// wait until they have all exited
+void poolJoin(struct WorkerPool *pool){
+	struct timespec pause = { 0, 1000000L };
+	int waiting = 1;
+
+	if (pool->supervised){
+		pthread_cancel(pool->supervisor);
+		pthread_join(pool->supervisor, NULL);
+		pool->supervised = 0;
+	}
+
+	retireWorkers(pool, __atomic_load_n(&pool->stats.threads, __ATOMIC_RELAXED));
+
+	while (waiting){
+		waiting = 0;
+
+		for (int i = 0; i < pool->max; i++){
+			if (__atomic_load_n(&pool->workers[i].alive, __ATOMIC_ACQUIRE)) waiting = 1;
+		}
+
+		if (waiting) nanosleep(&pause, NULL);
+	}
+}
+
+// Cancel every thread and free the shards. Only used on the way
+// out.
+void poolStop(struct WorkerPool *pool){
+	if (pool->workers == NULL) return;
+
+	if (pool->supervised) pthread_cancel(pool->supervisor);
+
+	for (int i = 0; i < pool->max; i++){
+		if (__atomic_load_n(&pool->workers[i].alive, __ATOMIC_ACQUIRE)) pthread_cancel(pool->workers[i].thread);
+	}
+
+	for (int i = 0; pool->shards && i < pool->shardCount; i++){
+		queueFree(&pool->shards[i].queue);
+		free(pool->shards[i].order);
+	}
+
+	free(pool->shards);
+	free(pool->cpus);
+	free(pool->cpuShard);
+	free(pool->workers);
+	pool->shards = NULL;
+	pool->workers = NULL;
+}
+
+void printPoolStats(struct WorkerPool *pool, FILE *fp){
+	struct PoolStats *stats = &pool->stats;
+
+	fprintf(fp, "Pool: %lu threads (%d-%d, peak %lu), %lu grows, %lu shrinks, %lu started, %lu retired\n",
+		stats->threads, pool->min, pool->max, stats->peak, stats->grows, stats->shrinks,
+		stats->threadsStarted, stats->threadsRetired);
+
+	if (stats->served > 0){
+		fprintf(fp, "Pool: %lu requests, %.3f ms average wait, %.3f ms longest\n",
+			stats->served, stats->waitNanos / 1e6 / stats->served, stats->maxWaitNanos / 1e6);
+	}
+
+	fprintf(fp, "Pool: %d shards over %d CPUs%s, %lu requests stolen, %lu parks\n",
+		pool->shardCount, pool->cpuCount, pool->pinned ? " (pinned)" : "", stats->steals, stats->parks);
+}
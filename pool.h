@@ -0,0 +1,136 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Elastic worker pool
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Worker threads that take requests off a set of RequestQueues,
+// between a minimum and a maximum number of them. A supervisor
+// thread samples the queues every tick. While requests are
+// waiting and have waited long, it adds enough threads to serve
+// them; once threads have sat idle with nothing queued for a good
+// while, it retires some of them. Growing reacts within a couple
+// of ticks but shrinking takes seconds, so the pool doesn't flap
+// when the load wobbles around a threshold.
+//
+// The queue is split into shards, one per CPU by default, laid
+// out node by node across the CPUs the process may use. Each
+// worker belongs to a shard and takes its requests from there,
+// and only when that is empty steals from the others, nearest
+// first: shards on the same NUMA node, then the rest. A request
+// is queued on the shard of the CPU that received the
+// connection, if known, so a session is served where its packets
+// arrive. With pinning, workers only run on their shard's CPUs.
+// A worker that finds every shard empty parks on its own shard's
+// futex, and a new request wakes one of that shard's workers, or
+// failing that one from the nearest shard with any parked. One
+// shard is the plain shared queue.
+//
+// A thread is retired by counting it in retiring; the next
+// worker to look for a request exits instead.
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "metrics.h"
+
+// Tuning, all overridable at build time
+#ifndef POOL_TICK_MS
+#define POOL_TICK_MS 50
+#endif
+
+// Grow after this many ticks in a row with requests waiting
+// at least POOL_GROW_WAIT_MS, or with more waiting than threads
+#ifndef POOL_GROW_TICKS
+#define POOL_GROW_TICKS 2
+#endif
+
+#ifndef POOL_GROW_WAIT_MS
+#define POOL_GROW_WAIT_MS 20
+#endif
+
+// Shrink after this many ticks in a row with idle threads and
+// an empty queue, retiring half the idle threads at most
+#ifndef POOL_SHRINK_TICKS
+#define POOL_SHRINK_TICKS 100
+#endif
+
+struct PoolWorker {
+	struct WorkerPool *pool;
+	pthread_t thread;
+	int id;
+	int shard;		// where it takes requests from first
+	int alive;
+};
+
+struct PoolShard {
+	struct RequestQueue queue;
+	int first, count;	// its CPUs, as a range of the pool's cpus
+	int node;		// the NUMA node they are on
+	int *order;		// the other shards, nearest first
+
+	// Futex word bumped to wake the shard's parked workers
+	int bell __attribute__((aligned(CACHE_LINE)));
+	int sleepers;
+	unsigned long steals;	// requests other shards' workers took
+};
+
+struct PoolStats {
+	unsigned long threads;		// live worker threads
+	unsigned long busy;		// threads handling a request
+	unsigned long peak;
+	unsigned long grows;		// resize events
+	unsigned long shrinks;
+	unsigned long threadsStarted;
+	unsigned long threadsRetired;
+	unsigned long long waitNanos;	// total time requests spent queued
+	unsigned long long maxWaitNanos;
+	unsigned long served;
+	unsigned long steals;		// requests taken from another shard
+	unsigned long parks;		// times a worker found nothing and slept
+};
+
+struct WorkerPool {
+	struct PoolShard *shards;
+	int shardCount;
+	int pinned;			// workers only run on their shard's CPUs
+	unsigned long nextShard;	// for requests with no known CPU
+
+	int *cpus;			// CPUs to run on, grouped by node
+	int cpuCount;
+	int *cpuShard;			// shard serving each CPU number, or -1
+	int cpuLimit;
+
+	void (*handle)(struct Request *request, int worker);
+	int min, max;
+
+	struct PoolWorker *workers;
+	pthread_t supervisor;
+	int supervised;
+
+	// Workers asked to exit that have not yet done so
+	int retiring __attribute__((aligned(CACHE_LINE)));
+
+	// Longest wait seen since the supervisor's last tick
+	unsigned long long tickMaxWait;
+
+	// Every request's wait is also recorded here, if set
+	struct Histogram *waits;
+
+	struct PoolStats stats;
+};
+
+int poolStart(struct WorkerPool *pool, unsigned long capacity, int shards, int pinned, int min, int max, void (*handle)(struct Request *request, int worker));
+int poolSubmit(struct WorkerPool *pool, struct Request *request, int cpu);
+unsigned long poolDepth(struct WorkerPool *pool);
+void poolJoin(struct WorkerPool *pool);
+void poolStop(struct WorkerPool *pool);
+
+unsigned long long poolNow();
+
+void printPoolStats(struct WorkerPool *pool, FILE *fp);
+
+#endif
@@ -0,0 +1,212 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Frame reader and writer
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+#define ERROR -1
+
+struct ProtocolStats protocolStats;
+
+void (*sendObserver)(unsigned long long nanos) = NULL;
+
+// Nanoseconds on the monotonic clock
+static unsigned long long now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Point the reader at the buffer it should collect bytes in.
+// The buffer bounds the largest frame the reader accepts.
+void frameReaderInit(struct FrameReader *reader, unsigned char *buf, size_t cap){
+	reader->buf = buf;
+	reader->cap = cap;
+	reader->start = 0;
+	reader->len = 0;
+}
+
+// Read whatever is available on the socket into the reader.
+// Returns the bytes read, 0 when the peer has closed, or ERROR.
+int frameReaderFill(struct FrameReader *reader, int fd){
+	ssize_t n;
+
+	// Shift any partial frame to the front to make room
+	if (reader->start > 0){
+		memmove(reader->buf, reader->buf + reader->start, reader->len);
+		reader->start = 0;
+	}
+
+	if (reader->len == reader->cap) return ERROR;
+
+	do {
+		n = recv(fd, reader->buf + reader->len, reader->cap - reader->len, 0);
+	} while (n == -1 && errno == EINTR);
+
+	__atomic_fetch_add(&protocolStats.recvCalls, 1, __ATOMIC_RELAXED);
+
+	if (n <= 0) return n;
+
+	__atomic_fetch_add(&protocolStats.bytesRecv, n, __ATOMIC_RELAXED);
+	reader->len += n;
+
+	return n;
+}
+
+// Take the next whole frame out of the reader. Returns 1 when
+// a frame was produced, 0 when more bytes are needed, or ERROR
+// if the stream is not speaking this protocol.
+int frameNext(struct FrameReader *reader, struct Frame *frame){
+	unsigned char *p = reader->buf + reader->start;
+	size_t length;
+
+	if (reader->len < FRAME_HEADER_SIZE) return 0;
+
+	if (p[0] != PROTOCOL_VERSION) return ERROR;
+
+	length = (p[2] << 8) | p[3];
+
+	if (FRAME_HEADER_SIZE + length > reader->cap) return ERROR;
+	if (reader->len < FRAME_HEADER_SIZE + length) return 0;
+
+	frame->opcode = p[1];
+	frame->length = length;
+	frame->payload = p + FRAME_HEADER_SIZE;
+
+	reader->start += FRAME_HEADER_SIZE + length;
+	reader->len -= FRAME_HEADER_SIZE + length;
+
+	__atomic_fetch_add(&protocolStats.framesRecv, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+// Block until a whole frame has arrived. Returns 1 on success,
+// 0 when the peer closed the connection, or ERROR.
+int frameRecv(int fd, struct FrameReader *reader, struct Frame *frame){
+	int status;
+
+	while ((status = frameNext(reader, frame)) == 0){
+		if ((status = frameReaderFill(reader, fd)) <= 0) return status;
+	}
+
+	return status;
+}
+
+// Write the header and payload of a frame to out, which must
+// have room for FRAME_HEADER_SIZE + len bytes. With a NULL
+// payload only the header is written. Returns the frame size.
+size_t frameEncode(unsigned char *out, int opcode, const void *payload, size_t len){
+	out[0] = PROTOCOL_VERSION;
+	out[1] = opcode;
+	out[2] = len >> 8;
+	out[3] = len & 0xff;
+
+	if (payload && len > 0) memcpy(out + FRAME_HEADER_SIZE, payload, len);
+
+	return FRAME_HEADER_SIZE + len;
+}
+
+// Send a single frame. The header and payload go out together
+// in one system call unless the socket only takes part of it.
+int frameSend(int fd, int opcode, const void *payload, size_t len){
+	unsigned char header[FRAME_HEADER_SIZE];
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t size = FRAME_HEADER_SIZE + len;
+	size_t sent = 0;
+	unsigned long long start = sendObserver ? now() : 0;
+
+	if (len > FRAME_MAX_PAYLOAD) return ERROR;
+
+	frameEncode(header, opcode, NULL, len);
+
+	while (sent < size){
+		ssize_t n;
+		int count = 0;
+
+		if (sent < FRAME_HEADER_SIZE){
+			iov[count].iov_base = header + sent;
+			iov[count++].iov_len = FRAME_HEADER_SIZE - sent;
+		}
+
+		if (len > 0){
+			size_t offset = sent > FRAME_HEADER_SIZE ? sent - FRAME_HEADER_SIZE : 0;
+			iov[count].iov_base = (unsigned char *) payload + offset;
+			iov[count++].iov_len = len - offset;
+		}
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+		__atomic_fetch_add(&protocolStats.sendCalls, 1, __ATOMIC_RELAXED);
+
+		if (n == -1){
+			if (errno == EINTR) continue;
+			return ERROR;
+		}
+
+		sent += n;
+	}
+
+	countSent(1, size);
+
+	if (sendObserver) sendObserver(now() - start);
+
+	return 1;
+}
+
+// Send frames already put together with frameEncode in one
+// call, so a reply split over several frames is not held back
+// by Nagle waiting for the first to be acknowledged.
+int sendEncoded(int fd, const void *frames, size_t len, size_t count){
+	size_t sent = 0;
+	unsigned long long start = sendObserver ? now() : 0;
+
+	while (sent < len){
+		ssize_t n = send(fd, (const unsigned char *) frames + sent, len - sent, MSG_NOSIGNAL);
+
+		__atomic_fetch_add(&protocolStats.sendCalls, 1, __ATOMIC_RELAXED);
+
+		if (n == -1){
+			if (errno == EINTR) continue;
+			return ERROR;
+		}
+
+		sent += n;
+	}
+
+	countSent(count, len);
+
+	if (sendObserver) sendObserver(now() - start);
+
+	return 1;
+}
+
+// Record frames that were written without frameSend
+void countSent(size_t frames, size_t bytes){
+	__atomic_fetch_add(&protocolStats.framesSent, frames, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&protocolStats.bytesSent, bytes, __ATOMIC_RELAXED);
+}
+
+// Print the wire totals
+void printProtocolStats(FILE *fp){
+	fprintf(fp, "Sent %lu frames, %lu bytes in %lu send calls\n",
+		protocolStats.framesSent, protocolStats.bytesSent, protocolStats.sendCalls);
+	fprintf(fp, "Received %lu frames, %lu bytes in %lu recv calls\n",
+		protocolStats.framesRecv, protocolStats.bytesRecv, protocolStats.recvCalls);
+}
@@ -0,0 +1,138 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Wire protocol shared by the client and server
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Every message is a frame made of a four byte header followed
+// by the payload:
+//
+//	+---------+--------+-----------------------+------------
+//	| version | opcode | payload length (BE16) | payload ...
+//	+---------+--------+-----------------------+------------
+//
+// A frame whose version does not match PROTOCOL_VERSION is
+// rejected by the reader, so both ends must be rebuilt together
+// whenever the layout of a payload changes.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define PROTOCOL_VERSION 2
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_MAX_PAYLOAD 65535
+
+// Client -> server
+#define OP_AUTH 0x01		// username '\0' password
+#define OP_GAME_START 0x02	// optional difficulty (u8), 0 any, 1 easy, 2 medium, 3 hard
+#define OP_GUESS 0x03		// letter
+#define OP_LEADERBOARD 0x05	// optional version (u32) from the last OP_LB_END
+#define OP_QUIT 0x06		// (empty)
+#define OP_LB_TOP 0x07		// number of rows (u16)
+#define OP_LB_AROUND 0x08	// rows either side of the user (u16)
+#define OP_LB_PAGE 0x09		// page number (u32), page size (u16)
+#define OP_STATS 0x0A		// (empty) admin: ask for the metrics summary
+#define OP_GUESS_BATCH 0x0B	// letters, at most GUESS_BATCH_MAX, played in order
+#define OP_RESUME 0x0C		// ticket (RESUME_TICKET_SIZE bytes), username
+#define OP_RELOAD 0x0D		// (empty) admin: reload the dictionary and accounts
+
+// Server -> client
+#define OP_CONNECTED 0x40	// (empty) a thread has picked up the client
+#define OP_AUTH_OK 0x41		// ticket, if one was issued, then after a resume
+				// 1 (u8) if the game in progress follows
+#define OP_AUTH_FAILED 0x42	// (empty)
+#define OP_GAME_STATE 0x43	// guesses left (u8), masked phrase
+#define OP_GAME_WIN 0x44	// phrase
+#define OP_GAME_LOSS 0x45	// (empty)
+#define OP_LB_ROW 0x47		// games played (u32), games won (u32), username
+#define OP_LB_END 0x48		// ranked users (u32) after a ranked query, else the
+				// leaderboard's version (u32)
+#define OP_LB_RANK_ROW 0x49	// rank (u32), games played (u32), games won (u32), username
+#define OP_STATS_TEXT 0x4A	// metrics summary, or an admin reply
+#define OP_GUESS_RESULTS 0x4B	// result (u8), guesses left (u8), count (u8),
+				// an outcome (u8) per guess played, masked phrase
+#define OP_RESUME_FAILED 0x4C	// (empty) the connection stays open for OP_AUTH
+#define OP_QUEUED 0x4D		// place in line (u32), estimated wait in ms (u32, 0 if
+				// unknown), sent while waiting for OP_CONNECTED
+#define OP_BUSY 0x4E		// retry after ms (u32); the server then hangs up, unless
+				// it refused a game start, which leaves the user at the menu
+#define OP_LB_NOT_MODIFIED 0x4F	// version (u32): the client's copy is current
+
+// Server -> server, on replication links (see replica.h)
+#define OP_GOSSIP_HELLO 0x60	// node (u8)
+#define OP_GOSSIP_DELTA 0x61	// changed users' counters
+
+// A ticket still held by a connection the server has not yet
+// seen close is refused; a client may retry OP_RESUME shortly.
+#define RESUME_TICKET_SIZE 16
+
+// A batch stops at the guess that wins or loses the game; the
+// results are then followed by OP_GAME_WIN or OP_GAME_LOSS.
+#define GUESS_BATCH_MAX 26
+
+// Guess results fields
+#define BATCH_PLAYING 0
+#define BATCH_WON 1
+#define BATCH_LOST 2
+
+#define OUTCOME_MISS 0
+#define OUTCOME_HIT 1
+#define OUTCOME_REPEAT 2
+
+// Most rows a single ranked query returns
+#define LB_MAX_ROWS 100
+
+struct Frame {
+	int opcode;
+	size_t length;
+	unsigned char *payload;
+};
+
+// Buffers the bytes of a stream until whole frames are
+// available. Payloads point into the buffer and stay valid
+// until the reader is next filled.
+struct FrameReader {
+	unsigned char *buf;
+	size_t cap;
+	size_t start;
+	size_t len;
+};
+
+// Running totals for everything that went over the wire in
+// this process, so the framing overhead can be measured.
+struct ProtocolStats {
+	unsigned long framesSent, bytesSent, sendCalls;
+	unsigned long framesRecv, bytesRecv, recvCalls;
+};
+
+extern struct ProtocolStats protocolStats;
+
+// Called with the nanoseconds each frameSend took, if set
+extern void (*sendObserver)(unsigned long long nanos);
+
+void frameReaderInit(struct FrameReader *reader, unsigned char *buf, size_t cap);
+int frameReaderFill(struct FrameReader *reader, int fd);
+int frameNext(struct FrameReader *reader, struct Frame *frame);
+int frameRecv(int fd, struct FrameReader *reader, struct Frame *frame);
+
+size_t frameEncode(unsigned char *out, int opcode, const void *payload, size_t len);
+int frameSend(int fd, int opcode, const void *payload, size_t len);
+int sendEncoded(int fd, const void *frames, size_t len, size_t count);
+void countSent(size_t frames, size_t bytes);
+
+void printProtocolStats(FILE *fp);
+
+// Big endian helpers for payload fields
+static inline void put32(unsigned char *p, unsigned long v){
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline unsigned long get32(const unsigned char *p){
+	return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) | ((unsigned long) p[2] << 8) | p[3];
+}
+
+#endif
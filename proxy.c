@@ -0,0 +1,1325 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Front proxy
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Spreads clients over several servers while keeping each user on
+// the same one, so their resumption ticket and suspended game are
+// where they come back to. Clients connect to the proxy exactly as
+// they would to a server.
+//
+// The proxy answers a new connection with OP_CONNECTED itself and
+// reads the client's first frame for the username (OP_AUTH or
+// OP_RESUME). The username is hashed onto a ring holding
+// PROXY_VNODES points per backend, and the first healthy backend
+// clockwise from it takes the client, so adding or losing a
+// backend only moves the users whose points it held. The proxy
+// waits for that backend's own OP_CONNECTED, dropping any
+// OP_QUEUED before it, and replays the first frame. If the backend
+// can't be reached or answers OP_BUSY, the next one on the ring is
+// tried. From then on the backend's bytes are moved to the client
+// with splice through a pipe, so they never enter the proxy's
+// memory. The client's bytes, a few per guess, are copied through
+// a small buffer instead, so that every frame header can be
+// checked: a backend sees the proxy as a local peer and would
+// answer admin frames (OP_STATS, OP_RELOAD) from anyone, so they
+// are only passed on from clients on this machine.
+//
+// A health thread dials every backend each PROXY_HEALTH_MS and
+// waits for its first frame. PROXY_FALL failures in a row take a
+// backend off the ring, and PROXY_RISE successes put it back.
+//
+// Draining: backends can be listed in a file (-f). On SIGHUP it is
+// read again. A backend marked "drain", or taken out of the file,
+// gets no new clients but keeps those it has until they leave.
+// The proxy says when it has none left and can be stopped. On
+// SIGINT or SIGTERM the proxy itself stops accepting and exits
+// once its clients have gone, or after PROXY_DRAIN_SECONDS. A
+// second signal exits at once.
+//
+// Usage: ./proxy [-p port] [-w workers] [-b backlog] [-f backends file] [host:port ...]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "protocol.h"
+
+#define ERROR -1
+
+#define DEFAULT_PORT 12345
+#define DEFAULT_BACKLOG 128
+
+#define PROXY_MAX_BACKENDS 64
+#define PROXY_VNODES 160
+
+// Health checks
+#define PROXY_HEALTH_MS 1000
+#define PROXY_HEALTH_TIMEOUT_MS 1000
+#define PROXY_RISE 2
+#define PROXY_FALL 2
+
+#define PROXY_DRAIN_SECONDS 30
+
+// Most bytes moved by one splice call
+#define PROXY_SPLICE_BYTES 65536
+
+// Client bytes held on their way to the backend
+#define PROXY_FILTER_BYTES 4096
+
+// What a turned away client is told to wait
+#define BUSY_RETRY_MS 1000
+
+// A client's first frame is short, as in the server
+#define CLIENT_FRAME_MAX (FRAME_HEADER_SIZE + 256)
+
+#define ACCEPT_BATCH 64
+#define MAX_EVENTS 64
+
+// What a flow waits for
+#define WANT_READ 1
+#define WANT_WRITE 2
+
+struct Backend {
+	char name[280];			// host:port, as given
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+	int used;			// the slot holds a backend
+	int removed;			// gone from the list, kept while it has clients
+	int draining;			// takes no new clients
+	int healthy;
+	int rise, fall;			// health checks passed or failed in a row
+	unsigned long generation;	// bumped when the slot is reused
+	unsigned long sessions;		// clients now
+	unsigned long total;		// clients ever
+};
+
+struct RingPoint {
+	unsigned int hash;
+	int backend;
+};
+
+enum LinkState {
+	LINK_AWAIT_CLIENT,		// reading the client's first frame
+	LINK_CONNECTING,		// dialling a backend
+	LINK_AWAIT_BACKEND,		// reading up to the backend's OP_CONNECTED
+	LINK_SPLICING,
+	LINK_CLOSED			// freed once the worker's batch of events is done
+};
+
+// Bytes going one way through a pipe
+struct Flow {
+	int from, to;
+	int pipe[2];
+	size_t pending;			// in the pipe, not yet written on
+	int eof, shut;
+};
+
+// Client bytes on their way to the backend. A frame's header is
+// checked before any of the frame is passed on.
+struct Filter {
+	unsigned char buf[PROXY_FILTER_BYTES];
+	size_t start, length;		// bytes held
+	size_t checked;			// of those, checked and ready to send
+	size_t body;			// payload still to come of the frame being passed on
+};
+
+struct Link;
+
+// Which of a link's sockets an epoll event is for
+struct End {
+	struct Link *link;
+	int backend;
+};
+
+struct Link {
+	enum LinkState state;
+	struct Worker *worker;
+	int client, server;
+	struct End ends[2];
+	unsigned int clientEvents, serverEvents;
+	struct Backend *backend;
+	unsigned long long tried;	// backends tried, as a bit each
+	char username[64];
+	unsigned char first[CLIENT_FRAME_MAX];
+	size_t firstLen;
+	unsigned char reply[CLIENT_FRAME_MAX];
+	size_t replyLen;
+	struct Flow up, down;		// client to backend, backend to client
+	struct Filter filter;		// what up holds, as it has no pipe
+	int trusted;			// the client is on this machine
+	struct Link *nextClosed;
+};
+
+struct Worker {
+	int id;
+	int epfd;
+	int listening;
+	pthread_t thread;
+	unsigned long links;
+	struct Link *closed;		// links closed during this batch of events
+};
+
+struct ProxyStats {
+	unsigned long accepted;
+	unsigned long active;
+	unsigned long proxied;		// clients handed to a backend
+	unsigned long rejected;		// turned away with OP_BUSY
+	unsigned long failovers;	// backends skipped for one that answered
+	unsigned long refused;		// clients cut off for sending admin frames
+	unsigned long long bytesUp, bytesDown;
+};
+
+struct ProxyStats proxyStats;
+
+struct Backend backends[PROXY_MAX_BACKENDS];
+pthread_rwlock_t backends_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct RingPoint *ring = NULL;
+int ringSize = 0;
+
+struct Worker *workers = NULL;
+int workerCount = 1;
+pthread_t healthThread;
+
+int port = DEFAULT_PORT;
+int backlog = DEFAULT_BACKLOG;
+int sockfd;
+char *backendsFile = NULL;
+
+volatile sig_atomic_t draining = 0, reloadWanted = 0;
+
+// SETUP //
+void parseArguments(int argc, char *argv[], char ***names, int *nameCount);
+void startProxy();
+int loadBackends(char **names, int count, int *marks);
+int reloadBackendsFile();
+void buildRing();
+
+// BACKENDS //
+struct Backend *pickBackend(const char *username, unsigned long long tried, struct sockaddr_storage *addr, socklen_t *addrLen);
+void releaseBackend(struct Backend *backend);
+void *healthLoop(void *data);
+int probeBackend(struct sockaddr_storage *addr, socklen_t addrLen);
+int dialBackend(struct sockaddr_storage *addr, socklen_t addrLen);
+
+// WORKERS //
+void *workerLoop(void *data);
+void acceptClients(struct Worker *worker);
+void handleEvent(struct End *end, unsigned int events);
+int readClientFirst(struct Link *link);
+int connectNext(struct Link *link);
+int finishConnect(struct Link *link);
+int readBackendFirst(struct Link *link);
+int startSplicing(struct Link *link);
+int pumpLink(struct Link *link);
+int pumpFlow(struct Flow *flow, unsigned long long *bytes);
+int pumpFilter(struct Link *link);
+int checkFrames(struct Link *link);
+int watch(struct Link *link, int fd, unsigned int *current, unsigned int events);
+void rejectClient(struct Link *link);
+void closeLink(struct Link *link);
+
+// UTIL //
+unsigned int hashKey(const char *key);
+int isLoopback(int fd);
+int isAdminFrame(int opcode);
+int setNonBlocking(int fd);
+void handleStop();
+void handleHangup();
+void printProxyStats(FILE *fp);
+
+/* ---------------------------------------------------------------- */
+// Main Loop
+/* ---------------------------------------------------------------- */
+int main(int argc, char *argv[]){
+	struct timespec tick = { 1, 0 };
+	time_t drainStarted = 0;
+	char **names = NULL;
+	int nameCount = 0;
+
+	signal(SIGINT, handleStop);
+	signal(SIGTERM, handleStop);
+	signal(SIGHUP, handleHangup);
+	signal(SIGPIPE, SIG_IGN);
+
+	parseArguments(argc, argv, &names, &nameCount);
+
+	if ((backendsFile ? reloadBackendsFile() : loadBackends(names, nameCount, NULL)) == ERROR){
+		exit(1);
+	}
+
+	startProxy();
+
+	if (pthread_create(&healthThread, NULL, healthLoop, NULL) != 0){
+		perror("pthread_create");
+		exit(1);
+	}
+
+	// The main thread reloads the backends when asked, reports
+	// backends that have drained, and waits out a drain
+	while (1){
+		nanosleep(&tick, NULL);
+
+		if (reloadWanted){
+			reloadWanted = 0;
+			if (backendsFile) reloadBackendsFile();
+		}
+
+		pthread_rwlock_wrlock(&backends_lock);
+
+		for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+			struct Backend *backend = &backends[i];
+
+			if (!backend->used || backend->draining != 1 || __atomic_load_n(&backend->sessions, __ATOMIC_ACQUIRE) > 0) continue;
+
+			printf("Proxy: backend %s has drained%s\n", backend->name, backend->removed ? " and is removed" : "");
+
+			if (backend->removed){
+				backend->used = 0;
+			} else {
+				// Only say so once
+				backend->draining = 2;
+			}
+		}
+
+		pthread_rwlock_unlock(&backends_lock);
+
+		if (draining){
+			if (drainStarted == 0){
+				drainStarted = time(NULL);
+				printf("Proxy: draining %lu clients\n", __atomic_load_n(&proxyStats.active, __ATOMIC_RELAXED));
+			}
+
+			if (__atomic_load_n(&proxyStats.active, __ATOMIC_RELAXED) == 0 || time(NULL) - drainStarted >= PROXY_DRAIN_SECONDS) break;
+		}
+	}
+
+	printProxyStats(stdout);
+	return 0;
+}
+
+/* ---------------------------------------------------------------- */
+// Setup
+/* ---------------------------------------------------------------- */
+
+// Parse the command line. Backends are given as host:port
+// arguments, or in a file with -f.
+void parseArguments(int argc, char *argv[], char ***names, int *nameCount){
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:w:b:f:")) != -1){
+		switch (opt){
+			case 'p':
+				port = atoi(optarg);
+			break;
+			case 'w':
+				workerCount = atoi(optarg);
+			break;
+			case 'b':
+				backlog = atoi(optarg);
+			break;
+			case 'f':
+				backendsFile = optarg;
+			break;
+			default:
+				fprintf(stderr, "usage: proxy [-p port] [-w workers] [-b backlog] [-f backends file] [host:port ...]\n");
+				exit(1);
+		}
+	}
+
+	*names = argv + optind;
+	*nameCount = argc - optind;
+
+	if (backendsFile == NULL && *nameCount == 0){
+		fprintf(stderr, "No backends: give host:port arguments or -f file\n");
+		exit(1);
+	}
+
+	if (workerCount <= 0) workerCount = 1;
+}
+
+// Resolve a backend's address
+static int resolve(struct Backend *backend){
+	struct addrinfo hints, *found;
+	char host[256];
+	char *colon = strrchr(backend->name, ':');
+
+	if (colon == NULL || colon == backend->name || (size_t) (colon - backend->name) >= sizeof host) return ERROR;
+
+	snprintf(host, sizeof host, "%.*s", (int) (colon - backend->name), backend->name);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, colon + 1, &hints, &found) != 0) return ERROR;
+
+	memcpy(&backend->addr, found->ai_addr, found->ai_addrlen);
+	backend->addrLen = found->ai_addrlen;
+	freeaddrinfo(found);
+
+	return 1;
+}
+
+// Make the backends those named. One named again keeps its
+// clients and health; a new one starts out healthy; one no longer
+// named is drained and then removed. marks[i] set means names[i]
+// is to be drained.
+int loadBackends(char **names, int count, int *marks){
+	struct Backend resolved[PROXY_MAX_BACKENDS];
+	int listed[PROXY_MAX_BACKENDS];
+
+	if (count > PROXY_MAX_BACKENDS){
+		fprintf(stderr, "At most %d backends\n", PROXY_MAX_BACKENDS);
+		return ERROR;
+	}
+
+	// Resolve outside the lock, so clients aren't held up
+	for (int n = 0; n < count; n++){
+		memset(&resolved[n], 0, sizeof resolved[n]);
+		snprintf(resolved[n].name, sizeof resolved[n].name, "%s", names[n]);
+
+		if (resolve(&resolved[n]) == ERROR){
+			fprintf(stderr, "Cannot resolve backend '%s', expected host:port\n", names[n]);
+			return ERROR;
+		}
+	}
+
+	pthread_rwlock_wrlock(&backends_lock);
+
+	memset(listed, 0, sizeof listed);
+
+	for (int n = 0; n < count; n++){
+		struct Backend *backend = NULL, *free = NULL;
+
+		for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+			if (backends[i].used && strcmp(backends[i].name, resolved[n].name) == 0) backend = &backends[i];
+			if (!backends[i].used && free == NULL) free = &backends[i];
+		}
+
+		if (backend == NULL){
+			if ((backend = free) == NULL) break;
+
+			resolved[n].generation = backend->generation + 1;
+			*backend = resolved[n];
+			backend->used = backend->healthy = 1;
+			printf("Proxy: added backend %s\n", backend->name);
+		} else {
+			memcpy(&backend->addr, &resolved[n].addr, resolved[n].addrLen);
+			backend->addrLen = resolved[n].addrLen;
+			backend->removed = 0;
+		}
+
+		if (marks && marks[n]){
+			if (!backend->draining) printf("Proxy: draining backend %s\n", backend->name);
+			if (!backend->draining) backend->draining = 1;
+		} else {
+			backend->draining = 0;
+		}
+
+		listed[backend - backends] = 1;
+	}
+
+	for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+		if (!backends[i].used || listed[i] || backends[i].removed) continue;
+
+		printf("Proxy: removing backend %s once its clients leave\n", backends[i].name);
+		backends[i].removed = 1;
+		backends[i].draining = 1;
+	}
+
+	buildRing();
+
+	pthread_rwlock_unlock(&backends_lock);
+
+	return 1;
+}
+
+// Read the backends file: a host:port per line, followed by
+// "drain" to drain it. Blank lines and # comments are skipped.
+int reloadBackendsFile(){
+	char line[512], *names[PROXY_MAX_BACKENDS];
+	int marks[PROXY_MAX_BACKENDS], count = 0, status;
+	FILE *fp;
+
+	if ((fp = fopen(backendsFile, "r")) == NULL){
+		perror(backendsFile);
+		return ERROR;
+	}
+
+	while (fgets(line, sizeof line, fp) && count < PROXY_MAX_BACKENDS){
+		char *name = strtok(line, " \t\r\n"), *mark;
+
+		if (name == NULL || name[0] == '#') continue;
+
+		mark = strtok(NULL, " \t\r\n");
+
+		if ((names[count] = strdup(name)) == NULL){
+			fprintf(stderr, "Out of memory reading %s, keeping the backends from before\n", backendsFile);
+			for (int i = 0; i < count; i++) free(names[i]);
+			fclose(fp);
+			return ERROR;
+		}
+
+		marks[count] = mark && strcmp(mark, "drain") == 0;
+		count++;
+	}
+
+	fclose(fp);
+
+	status = loadBackends(names, count, marks);
+
+	for (int i = 0; i < count; i++) free(names[i]);
+
+	if (status == ERROR) fprintf(stderr, "Keeping the backends from before\n");
+
+	return status;
+}
+
+static int comparePoints(const void *a, const void *b){
+	unsigned int x = ((const struct RingPoint *) a)->hash, y = ((const struct RingPoint *) b)->hash;
+	return x == y ? 0 : (x < y ? -1 : 1);
+}
+
+// Place PROXY_VNODES points on the ring for every backend that
+// hasn't been removed. Called with the write lock held.
+void buildRing(){
+	int count = 0;
+
+	for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+		if (backends[i].used && !backends[i].removed) count++;
+	}
+
+	free(ring);
+	ring = malloc((count ? count : 1) * PROXY_VNODES * sizeof(struct RingPoint));
+	ringSize = 0;
+
+	if (ring == NULL) return;
+
+	for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+		if (!backends[i].used || backends[i].removed) continue;
+
+		for (int v = 0; v < PROXY_VNODES; v++){
+			char key[300];
+
+			snprintf(key, sizeof key, "%s#%d", backends[i].name, v);
+			ring[ringSize].hash = hashKey(key);
+			ring[ringSize].backend = i;
+			ringSize++;
+		}
+	}
+
+	qsort(ring, ringSize, sizeof(struct RingPoint), comparePoints);
+}
+
+// Listen for clients, and start the workers. Every worker
+// shares the listening socket, as the server's reactors do.
+void startProxy(){
+	struct sockaddr_in addr;
+	int yes = 1;
+
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+		perror("socket");
+		exit(1);
+	}
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(sockfd, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(sockfd, backlog) == -1){
+		perror("bind");
+		exit(1);
+	}
+
+	setNonBlocking(sockfd);
+
+	workers = calloc(workerCount, sizeof(struct Worker));
+
+	for (int i = 0; i < workerCount; i++){
+		struct epoll_event ev;
+
+		workers[i].id = i;
+
+		if ((workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+			perror("epoll_create1");
+			exit(1);
+		}
+
+		// A NULL pointer marks the listening socket
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+
+		if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1){
+			perror("epoll_ctl");
+			exit(1);
+		}
+
+		workers[i].listening = 1;
+		pthread_create(&workers[i].thread, NULL, workerLoop, &workers[i]);
+	}
+
+	printf("Proxy started on port %d with %d workers\n", port, workerCount);
+}
+
+/* ---------------------------------------------------------------- */
+// Backends
+/* ---------------------------------------------------------------- */
+
+// The backend for a user: the first healthy one, not draining and
+// not yet tried, clockwise from the username on the ring. Counts
+// the client against it, and copies out its address while the
+// lock still stops a reload rewriting it. Returns NULL if there
+// is none.
+struct Backend *pickBackend(const char *username, unsigned long long tried, struct sockaddr_storage *addr, socklen_t *addrLen){
+	struct Backend *backend = NULL;
+	unsigned int hash = hashKey(username);
+	int low = 0, high;
+
+	pthread_rwlock_rdlock(&backends_lock);
+
+	high = ringSize;
+
+	// First point at or after the hash, wrapping to the start
+	while (low < high){
+		int mid = (low + high) / 2;
+
+		if (ring[mid].hash < hash){
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	for (int step = 0; step < ringSize; step++){
+		int i = ring[(low + step) % ringSize].backend;
+		struct Backend *candidate = &backends[i];
+
+		if ((tried >> i) & 1 || !candidate->healthy || candidate->draining) continue;
+
+		backend = candidate;
+		*addr = backend->addr;
+		*addrLen = backend->addrLen;
+		__atomic_fetch_add(&backend->sessions, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&backend->total, 1, __ATOMIC_RELAXED);
+		break;
+	}
+
+	pthread_rwlock_unlock(&backends_lock);
+
+	return backend;
+}
+
+// Stop counting a client against its backend
+void releaseBackend(struct Backend *backend){
+	__atomic_fetch_sub(&backend->sessions, 1, __ATOMIC_RELEASE);
+}
+
+// Mark a backend down at once when a client couldn't reach it,
+// rather than wait for the health check to notice
+static void backendFailed(struct Backend *backend){
+	pthread_rwlock_wrlock(&backends_lock);
+
+	if (backend->healthy) printf("Proxy: backend %s is down\n", backend->name);
+
+	backend->healthy = 0;
+	backend->rise = 0;
+
+	pthread_rwlock_unlock(&backends_lock);
+}
+
+// Check on every backend each PROXY_HEALTH_MS
+void *healthLoop(void *data){
+	struct timespec tick = { PROXY_HEALTH_MS / 1000, (PROXY_HEALTH_MS % 1000) * 1000000L };
+
+	while (1){
+		for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+			struct Backend *backend = &backends[i];
+			struct sockaddr_storage addr;
+			socklen_t addrLen;
+			unsigned long generation;
+			int used, ok;
+
+			pthread_rwlock_rdlock(&backends_lock);
+			used = backend->used;
+			generation = backend->generation;
+			addr = backend->addr;
+			addrLen = backend->addrLen;
+			pthread_rwlock_unlock(&backends_lock);
+
+			if (!used) continue;
+
+			ok = probeBackend(&addr, addrLen) != ERROR;
+
+			pthread_rwlock_wrlock(&backends_lock);
+
+			// The slot may have been given to another backend
+			if (backend->used && backend->generation == generation){
+				if (ok){
+					backend->fall = 0;
+
+					if (!backend->healthy && ++backend->rise >= PROXY_RISE){
+						backend->healthy = 1;
+						printf("Proxy: backend %s is up\n", backend->name);
+					}
+				} else {
+					backend->rise = 0;
+
+					if (backend->healthy && ++backend->fall >= PROXY_FALL){
+						backend->healthy = 0;
+						printf("Proxy: backend %s is down\n", backend->name);
+					}
+				}
+			}
+
+			pthread_rwlock_unlock(&backends_lock);
+		}
+
+		nanosleep(&tick, NULL);
+	}
+
+	return NULL;
+}
+
+// Dial a backend and wait for the first frame a client would
+// get. A server that is full still answers, so OP_QUEUED and
+// OP_BUSY count as alive.
+int probeBackend(struct sockaddr_storage *addr, socklen_t addrLen){
+	unsigned char header[FRAME_HEADER_SIZE];
+	struct pollfd pfd;
+	int fd, error = 0;
+	socklen_t size = sizeof error;
+	size_t got = 0;
+
+	if ((fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) return ERROR;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+
+	if (connect(fd, (struct sockaddr *) addr, addrLen) == -1 && errno != EINPROGRESS) goto failed;
+	if (poll(&pfd, 1, PROXY_HEALTH_TIMEOUT_MS) != 1) goto failed;
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0) goto failed;
+
+	pfd.events = POLLIN;
+
+	while (got < sizeof header){
+		ssize_t n;
+
+		if (poll(&pfd, 1, PROXY_HEALTH_TIMEOUT_MS) != 1) goto failed;
+		if ((n = recv(fd, header + got, sizeof header - got, 0)) <= 0) goto failed;
+
+		got += n;
+	}
+
+	close(fd);
+
+	if (header[0] != PROTOCOL_VERSION) return ERROR;
+
+	return header[1] == OP_CONNECTED || header[1] == OP_QUEUED || header[1] == OP_BUSY ? 1 : ERROR;
+
+failed:
+	close(fd);
+	return ERROR;
+}
+
+// Start a non-blocking connect to a backend. Returns the socket,
+// or ERROR.
+int dialBackend(struct sockaddr_storage *addr, socklen_t addrLen){
+	int fd;
+
+	if ((fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) return ERROR;
+
+	if (connect(fd, (struct sockaddr *) addr, addrLen) == -1 && errno != EINPROGRESS){
+		close(fd);
+		return ERROR;
+	}
+
+	return fd;
+}
+
+/* ---------------------------------------------------------------- */
+// Workers
+/* ---------------------------------------------------------------- */
+
+// Wait for socket events and dispatch them. While draining, stop
+// taking clients, and leave once every client has gone.
+void *workerLoop(void *data){
+	struct Worker *worker = data;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (1){
+		int n = epoll_wait(worker->epfd, events, MAX_EVENTS, 1000);
+
+		if (n == -1){
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			return NULL;
+		}
+
+		for (int i = 0; i < n; i++){
+			if (events[i].data.ptr == NULL){
+				acceptClients(worker);
+			} else {
+				handleEvent(events[i].data.ptr, events[i].events);
+			}
+		}
+
+		// A link may have had events for both its sockets, so it
+		// is only freed after the whole batch
+		while (worker->closed){
+			struct Link *link = worker->closed;
+
+			worker->closed = link->nextClosed;
+			free(link);
+		}
+
+		if (draining && worker->listening){
+			epoll_ctl(worker->epfd, EPOLL_CTL_DEL, sockfd, NULL);
+			worker->listening = 0;
+		}
+
+		if (draining && worker->links == 0) return NULL;
+	}
+}
+
+// Accept pending clients, up to a batch, and answer each with
+// OP_CONNECTED so it sends its first frame
+void acceptClients(struct Worker *worker){
+	unsigned char connected[FRAME_HEADER_SIZE];
+
+	frameEncode(connected, OP_CONNECTED, NULL, 0);
+
+	for (int i = 0; i < ACCEPT_BATCH; i++){
+		struct Link *link;
+		struct epoll_event ev;
+		int fd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1){
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+			return;
+		}
+
+		if ((link = calloc(1, sizeof *link)) == NULL){
+			close(fd);
+			continue;
+		}
+
+		link->worker = worker;
+		link->state = LINK_AWAIT_CLIENT;
+		link->client = fd;
+		link->server = -1;
+		link->up.pipe[0] = link->up.pipe[1] = -1;
+		link->down.pipe[0] = link->down.pipe[1] = -1;
+		link->ends[0].link = link->ends[1].link = link;
+		link->ends[1].backend = 1;
+		link->clientEvents = EPOLLIN;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &link->ends[0];
+
+		if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 || send(fd, connected, sizeof connected, MSG_NOSIGNAL) != sizeof connected){
+			close(fd);
+			free(link);
+			continue;
+		}
+
+		worker->links++;
+		__atomic_fetch_add(&proxyStats.accepted, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&proxyStats.active, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Move a link on from whatever it was waiting for
+void handleEvent(struct End *end, unsigned int events){
+	struct Link *link = end->link;
+	int status;
+
+	if (link->state == LINK_CLOSED) return;
+
+	// A client with an error, or gone both ways, leaves nothing to
+	// forward. A backend's error before splicing means trying the
+	// next backend, which the handlers below find for themselves.
+	if (!end->backend ? events & (EPOLLERR | EPOLLHUP) : events & EPOLLERR && link->state == LINK_SPLICING){
+		closeLink(link);
+		return;
+	}
+
+	switch (link->state){
+		case LINK_AWAIT_CLIENT:
+			status = readClientFirst(link);
+		break;
+		case LINK_CONNECTING:
+			status = finishConnect(link);
+		break;
+		case LINK_AWAIT_BACKEND:
+			status = readBackendFirst(link);
+		break;
+		default:
+			status = pumpLink(link);
+
+			// A backend gone both ways can't be written to, so
+			// stop once its last bytes reach the client
+			if (status != ERROR && events & EPOLLHUP && link->down.eof && link->down.pending == 0) status = ERROR;
+	}
+
+	if (status == ERROR) closeLink(link);
+}
+
+// Read the client's first frame, find its username and dial the
+// user's backend
+int readClientFirst(struct Link *link){
+	size_t length, nameLength = 0;
+	const char *name = "";
+	unsigned char *payload = link->first + FRAME_HEADER_SIZE;
+	ssize_t n = recv(link->client, link->first + link->firstLen, sizeof link->first - link->firstLen, 0);
+
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) return ERROR;
+	if (n > 0) link->firstLen += n;
+
+	if (link->firstLen < FRAME_HEADER_SIZE) return 1;
+	if (link->first[0] != PROTOCOL_VERSION) return ERROR;
+
+	length = (link->first[2] << 8) | link->first[3];
+
+	if (FRAME_HEADER_SIZE + length > sizeof link->first) return ERROR;
+	if (link->firstLen < FRAME_HEADER_SIZE + length) return 1;
+
+	link->trusted = isLoopback(link->client);
+
+	if (isAdminFrame(link->first[1]) && !link->trusted){
+		__atomic_fetch_add(&proxyStats.refused, 1, __ATOMIC_RELAXED);
+		return ERROR;
+	}
+
+	switch (link->first[1]){
+		case OP_AUTH:
+			name = (const char *) payload;
+			while (nameLength < length && payload[nameLength] != '\0') nameLength++;
+		break;
+		case OP_RESUME:
+			if (length > RESUME_TICKET_SIZE){
+				name = (const char *) payload + RESUME_TICKET_SIZE;
+				nameLength = length - RESUME_TICKET_SIZE;
+			}
+		break;
+	}
+
+	if (nameLength >= sizeof link->username) nameLength = sizeof link->username - 1;
+
+	memcpy(link->username, name, nameLength);
+	link->username[nameLength] = '\0';
+
+	return connectNext(link);
+}
+
+// Dial the next backend for the link's user, or turn the client
+// away if every one has been tried
+int connectNext(struct Link *link){
+	struct epoll_event ev;
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+
+	while (1){
+		if (link->backend){
+			link->tried |= 1ULL << (link->backend - backends);
+			releaseBackend(link->backend);
+			__atomic_fetch_add(&proxyStats.failovers, 1, __ATOMIC_RELAXED);
+		}
+
+		if (link->server != -1){
+			close(link->server);
+			link->server = -1;
+		}
+
+		if ((link->backend = pickBackend(link->username, link->tried, &addr, &addrLen)) == NULL){
+			rejectClient(link);
+			return ERROR;
+		}
+
+		if ((link->server = dialBackend(&addr, addrLen)) == ERROR){
+			link->server = -1;
+			backendFailed(link->backend);
+			continue;
+		}
+
+		link->state = LINK_CONNECTING;
+		link->replyLen = 0;
+		link->serverEvents = EPOLLOUT;
+
+		ev.events = EPOLLOUT;
+		ev.data.ptr = &link->ends[1];
+
+		if (epoll_ctl(link->worker->epfd, EPOLL_CTL_ADD, link->server, &ev) == -1) return ERROR;
+
+		// The client says nothing more until it has an answer
+		return watch(link, link->client, &link->clientEvents, 0);
+	}
+}
+
+// Check how the dial went, and wait for the backend's greeting
+int finishConnect(struct Link *link){
+	int error = 0;
+	socklen_t size = sizeof error;
+
+	if (getsockopt(link->server, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0){
+		backendFailed(link->backend);
+		return connectNext(link);
+	}
+
+	link->state = LINK_AWAIT_BACKEND;
+
+	return watch(link, link->server, &link->serverEvents, EPOLLIN);
+}
+
+// Read the backend's frames up to its OP_CONNECTED, then replay
+// the client's first frame and start splicing. A backend that
+// turns the client away is skipped for the next.
+int readBackendFirst(struct Link *link){
+	ssize_t n = recv(link->server, link->reply + link->replyLen, sizeof link->reply - link->replyLen, 0);
+
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+
+	if (n <= 0){
+		backendFailed(link->backend);
+		return connectNext(link);
+	}
+
+	link->replyLen += n;
+
+	while (link->replyLen >= FRAME_HEADER_SIZE){
+		size_t size = FRAME_HEADER_SIZE + ((link->reply[2] << 8) | link->reply[3]);
+		int opcode = link->reply[1];
+
+		if (link->reply[0] != PROTOCOL_VERSION || size > sizeof link->reply) return ERROR;
+		if (link->replyLen < size) return 1;
+
+		if (opcode == OP_BUSY){
+			// Another backend may have room. If none has, the
+			// client is told to wait by rejectClient.
+			return connectNext(link);
+		}
+
+		memmove(link->reply, link->reply + size, link->replyLen - size);
+		link->replyLen -= size;
+
+		if (opcode == OP_CONNECTED) return startSplicing(link);
+		if (opcode != OP_QUEUED) return ERROR;
+	}
+
+	return 1;
+}
+
+// Hand the backend the client's first frame, and anything the
+// backend sent after its greeting to the client, then move the
+// rest. Any client bytes read past the first frame go through
+// the filter like the rest.
+int startSplicing(struct Link *link){
+	size_t size = FRAME_HEADER_SIZE + ((link->first[2] << 8) | link->first[3]);
+
+	if (send(link->server, link->first, size, MSG_NOSIGNAL) != (ssize_t) size) return ERROR;
+	if (link->replyLen > 0 && send(link->client, link->reply, link->replyLen, MSG_NOSIGNAL) != (ssize_t) link->replyLen) return ERROR;
+
+	memcpy(link->filter.buf, link->first + size, link->firstLen - size);
+	link->filter.length = link->firstLen - size;
+
+	if (pipe2(link->down.pipe, O_NONBLOCK | O_CLOEXEC) == -1) return ERROR;
+
+	link->up.from = link->down.to = link->client;
+	link->up.to = link->down.from = link->server;
+	link->state = LINK_SPLICING;
+
+	__atomic_fetch_add(&proxyStats.proxied, 1, __ATOMIC_RELAXED);
+
+	return pumpLink(link);
+}
+
+// Move what can be moved both ways, then watch each socket for
+// whatever its flows are now waiting on. The link is done once
+// both sides have closed and every byte has been passed on.
+int pumpLink(struct Link *link){
+	int up = pumpFilter(link);
+	int down = pumpFlow(&link->down, &proxyStats.bytesDown);
+	unsigned int clientWants = 0, serverWants = 0;
+
+	if (up == ERROR || down == ERROR) return ERROR;
+	if (up == 0 && down == 0) return ERROR;
+
+	if (up & WANT_READ) clientWants |= EPOLLIN;
+	if (up & WANT_WRITE) serverWants |= EPOLLOUT;
+	if (down & WANT_READ) serverWants |= EPOLLIN;
+	if (down & WANT_WRITE) clientWants |= EPOLLOUT;
+
+	if (watch(link, link->client, &link->clientEvents, clientWants) == ERROR) return ERROR;
+
+	return watch(link, link->server, &link->serverEvents, serverWants);
+}
+
+// Splice from a flow's source into its pipe and on out of it
+// until one side would block. Returns what the flow now waits
+// for, 0 once its source has closed and the pipe is empty, or
+// ERROR.
+int pumpFlow(struct Flow *flow, unsigned long long *bytes){
+	while (1){
+		ssize_t n;
+
+		if (flow->pending > 0){
+			n = splice(flow->pipe[0], NULL, flow->to, NULL, flow->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+			if (n > 0){
+				flow->pending -= n;
+				__atomic_fetch_add(bytes, n, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return WANT_WRITE;
+
+			return ERROR;
+		}
+
+		if (flow->eof){
+			// Pass the close on, once
+			if (!flow->shut){
+				shutdown(flow->to, SHUT_WR);
+				flow->shut = 1;
+			}
+
+			return 0;
+		}
+
+		n = splice(flow->from, NULL, flow->pipe[1], NULL, PROXY_SPLICE_BYTES, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (n > 0){
+			flow->pending += n;
+		} else if (n == 0){
+			flow->eof = 1;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK){
+			return WANT_READ;
+		} else {
+			return ERROR;
+		}
+	}
+}
+
+// Check the client's frames and send them on to the backend until
+// one side would block. Returns as pumpFlow does.
+int pumpFilter(struct Link *link){
+	struct Filter *filter = &link->filter;
+	struct Flow *flow = &link->up;
+
+	while (1){
+		ssize_t n;
+
+		if (checkFrames(link) == ERROR) return ERROR;
+
+		if (filter->checked > 0){
+			n = send(flow->to, filter->buf + filter->start, filter->checked, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+			if (n > 0){
+				filter->start += n;
+				filter->length -= n;
+				filter->checked -= n;
+				__atomic_fetch_add(&proxyStats.bytesUp, n, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return WANT_WRITE;
+
+			return ERROR;
+		}
+
+		if (flow->eof){
+			if (!flow->shut){
+				shutdown(flow->to, SHUT_WR);
+				flow->shut = 1;
+			}
+
+			return 0;
+		}
+
+		// Only part of a header can be left, so there is always
+		// room once it is moved to the front
+		memmove(filter->buf, filter->buf + filter->start, filter->length);
+		filter->start = 0;
+
+		n = recv(flow->from, filter->buf + filter->length, sizeof filter->buf - filter->length, MSG_DONTWAIT);
+
+		if (n > 0){
+			filter->length += n;
+		} else if (n == 0){
+			flow->eof = 1;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK){
+			return WANT_READ;
+		} else {
+			return ERROR;
+		}
+	}
+}
+
+// Check the client bytes held, up to the last whole header.
+// Returns ERROR for an admin frame from another machine, or bytes
+// that aren't frames at all.
+int checkFrames(struct Link *link){
+	struct Filter *filter = &link->filter;
+	size_t at = filter->start + filter->checked, end = filter->start + filter->length;
+
+	while (at < end){
+		unsigned char *header = filter->buf + at;
+
+		if (filter->body > 0){
+			size_t take = filter->body < end - at ? filter->body : end - at;
+
+			filter->body -= take;
+			at += take;
+			continue;
+		}
+
+		if (end - at < FRAME_HEADER_SIZE) break;
+		if (header[0] != PROTOCOL_VERSION) return ERROR;
+
+		if (isAdminFrame(header[1]) && !link->trusted){
+			__atomic_fetch_add(&proxyStats.refused, 1, __ATOMIC_RELAXED);
+			return ERROR;
+		}
+
+		filter->body = (header[2] << 8) | header[3];
+		at += FRAME_HEADER_SIZE;
+	}
+
+	filter->checked = at - filter->start;
+
+	return 1;
+}
+
+// Change the events watched on one of a link's sockets, if
+// they differ from what is watched now
+int watch(struct Link *link, int fd, unsigned int *current, unsigned int events){
+	struct epoll_event ev;
+
+	if (*current == events) return 1;
+
+	ev.events = events;
+	ev.data.ptr = fd == link->client ? &link->ends[0] : &link->ends[1];
+
+	if (epoll_ctl(link->worker->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) return ERROR;
+
+	*current = events;
+
+	return 1;
+}
+
+// Tell a client no backend can take it now
+void rejectClient(struct Link *link){
+	unsigned char out[FRAME_HEADER_SIZE + 4], payload[4];
+
+	put32(payload, BUSY_RETRY_MS);
+	send(link->client, out, frameEncode(out, OP_BUSY, payload, sizeof payload), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	__atomic_fetch_add(&proxyStats.rejected, 1, __ATOMIC_RELAXED);
+}
+
+// Close both sides of a link. Closing the sockets also takes
+// them out of epoll.
+void closeLink(struct Link *link){
+	close(link->client);
+	if (link->server != -1) close(link->server);
+
+	for (int i = 0; i < 2; i++){
+		if (link->up.pipe[i] != -1) close(link->up.pipe[i]);
+		if (link->down.pipe[i] != -1) close(link->down.pipe[i]);
+	}
+
+	if (link->backend) releaseBackend(link->backend);
+
+	link->worker->links--;
+	__atomic_fetch_sub(&proxyStats.active, 1, __ATOMIC_RELAXED);
+
+	link->state = LINK_CLOSED;
+	link->nextClosed = link->worker->closed;
+	link->worker->closed = link;
+}
+
+/* ---------------------------------------------------------------- */
+// Util
+/* ---------------------------------------------------------------- */
+
+// FNV-1a, then mixed so that nearby keys land far apart
+unsigned int hashKey(const char *key){
+	unsigned int hash = 2166136261u;
+
+	for (; *key; key++){
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+// Whether a socket's peer is on this machine
+int isLoopback(int fd){
+	struct sockaddr_in addr;
+	socklen_t size = sizeof addr;
+
+	if (getpeername(fd, (struct sockaddr *) &addr, &size) == -1 || addr.sin_family != AF_INET) return 0;
+
+	return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+// Whether a frame asks for something only an administrator may
+int isAdminFrame(int opcode){
+	return opcode == OP_STATS || opcode == OP_RELOAD;
+}
+
+int setNonBlocking(int fd){
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Handle SIGINT or SIGTERM by draining, or a second one by
+// leaving at once
+void handleStop(){
+	if (draining) _exit(1);
+
+	draining = 1;
+}
+
+// Handle a SIGHUP by reading the backends file again
+void handleHangup(){
+	reloadWanted = 1;
+}
+
+void printProxyStats(FILE *fp){
+	fprintf(fp, "Proxy: %lu clients accepted, %lu handed to a backend, %lu turned away, %lu failovers, %lu cut off for admin frames\n",
+		proxyStats.accepted, proxyStats.proxied, proxyStats.rejected, proxyStats.failovers, proxyStats.refused);
+	fprintf(fp, "Proxy: %llu bytes passed to backends, %llu spliced to clients\n",
+		proxyStats.bytesUp, proxyStats.bytesDown);
+
+	for (int i = 0; i < PROXY_MAX_BACKENDS; i++){
+		if (!backends[i].used) continue;
+
+		fprintf(fp, "Proxy: backend %s, %s%s, %lu clients now, %lu in all\n",
+			backends[i].name, backends[i].healthy ? "up" : "down",
+			backends[i].draining ? ", draining" : "", backends[i].sessions, backends[i].total);
+	}
+}
@@ -0,0 +1,96 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Bounded lock-free request queue
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#include <stdlib.h>
+
+#include "queue.h"
+
+#define ERROR -1
+
+// Set up an empty queue. The capacity is rounded up to a power
+// of two so positions can be masked instead of divided.
+int queueInit(struct RequestQueue *queue, unsigned long capacity){
+	unsigned long size = 1;
+
+	while (size < capacity) size <<= 1;
+
+	queue->slots = malloc(size * sizeof(struct QueueSlot));
+	if (queue->slots == NULL) return ERROR;
+
+	for (unsigned long i = 0; i < size; i++){
+		queue->slots[i].sequence = i;
+	}
+
+	queue->mask = size - 1;
+	queue->enqueuePos = queue->dequeuePos = 0;
+
+	return 1;
+}
+
+void queueFree(struct RequestQueue *queue){
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+// Add a request without blocking. Returns 0 if the queue is full.
+int queueTryPush(struct RequestQueue *queue, struct Request *request){
+	unsigned long pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+	struct QueueSlot *slot;
+
+	while (1){
+		slot = &queue->slots[pos & queue->mask];
+		long diff = (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) pos;
+
+		if (diff == 0){
+			// The slot is free for this position, try to claim it
+			if (__atomic_compare_exchange_n(&queue->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if (diff < 0){
+			// The consumer a lap behind has not emptied it yet
+			return 0;
+		} else {
+			pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->request = *request;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+// Take a request without blocking. Returns 0 if the queue is empty.
+int queueTryPop(struct RequestQueue *queue, struct Request *request){
+	unsigned long pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+	struct QueueSlot *slot;
+
+	while (1){
+		slot = &queue->slots[pos & queue->mask];
+		long diff = (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) (pos + 1);
+
+		if (diff == 0){
+			if (__atomic_compare_exchange_n(&queue->dequeuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if (diff < 0){
+			// Nothing has been published at this position yet
+			return 0;
+		} else {
+			pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+		}
+	}
+
+	*request = slot->request;
+	__atomic_store_n(&slot->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+// Number of requests currently waiting. Only a snapshot while
+// other threads are pushing and popping.
+unsigned long queueDepth(struct RequestQueue *queue){
+	unsigned long enqueued = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+	unsigned long dequeued = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+
+	return enqueued > dequeued ? enqueued - dequeued : 0;
+}
@@ -0,0 +1,50 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Bounded lock-free request queue
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// A multi-producer, multi-consumer ring of fixed capacity. Each
+// slot carries a sequence number that tells producers and
+// consumers whose turn it is, so pushing and popping only ever
+// claim a position with a single compare-and-swap. The ring never
+// blocks: a full or empty ring is reported to the caller, and the
+// pool parks idle threads on its own shards.
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#define CACHE_LINE 64
+
+struct LobbyEntry;
+
+struct Request {
+	int number;
+	int sockfd;
+	unsigned long long enqueued;	// monotonic nanoseconds
+	struct LobbyEntry *lobby;	// the client's place in the lobby, if any
+};
+
+struct QueueSlot {
+	unsigned long sequence;
+	struct Request request;
+};
+
+struct RequestQueue {
+	struct QueueSlot *slots;
+	unsigned long mask;
+
+	// Producers and consumers each get their own cache line
+	unsigned long enqueuePos __attribute__((aligned(CACHE_LINE)));
+	unsigned long dequeuePos __attribute__((aligned(CACHE_LINE)));
+};
+
+int queueInit(struct RequestQueue *queue, unsigned long capacity);
+void queueFree(struct RequestQueue *queue);
+
+int queueTryPush(struct RequestQueue *queue, struct Request *request);
+int queueTryPop(struct RequestQueue *queue, struct Request *request);
+
+unsigned long queueDepth(struct RequestQueue *queue);
+
+#endif
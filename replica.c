@@ -0,0 +1,568 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard replication
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "replica.h"
+#include "leaderboard.h"
+#include "protocol.h"
+#include "tables.h"
+
+#define ERROR -1
+
+// Room a record can take: name, counter count and counters
+#define RECORD_MAX (1 + 255 + 1 + REPLICA_MAX_NODES * 9)
+
+// The counters other nodes recorded for one user
+struct ReplicaSlot {
+	unsigned long long counts[REPLICA_MAX_NODES];
+	unsigned int dirty;		// a bit for each link yet to be sent them
+};
+
+// A peer this node dials and gossips to
+struct PeerLink {
+	int bit;
+	char host[256];
+	char port[16];
+	int fd;
+	unsigned char *batch;
+	pthread_t thread;
+};
+
+// A peer that dialled this node
+struct Inbound {
+	int fd;
+	int used, done;
+	pthread_t thread;
+};
+
+struct ReplicaStats replicaStats;
+
+static struct ReplicaSlot *slots[LEADERBOARD_MAX_CHUNKS];
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct PeerLink links[REPLICA_MAX_PEERS];
+static int linkCount = 0;
+static unsigned int allLinks = 0;
+
+static struct Inbound inbound[REPLICA_MAX_INBOUND];
+static pthread_mutex_t inbound_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int selfNode = -1;
+static int listenFd = -1;
+static pthread_t acceptor;
+
+static void (*nextListener)(struct LeaderBoard *entry, unsigned long long results) = NULL;
+
+/* ---------------------------------------------------------------- */
+// Counters
+/* ---------------------------------------------------------------- */
+
+// A user's slot, made along with the rest of its chunk on
+// first use. Returns NULL if there is no memory.
+static struct ReplicaSlot *slotFor(unsigned long user){
+	struct ReplicaSlot **chunk = &slots[user >> LEADERBOARD_CHUNK_BITS];
+	struct ReplicaSlot *slot = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+
+	if (slot == NULL){
+		pthread_mutex_lock(&slot_mutex);
+
+		if ((slot = *chunk) == NULL){
+			slot = calloc(LEADERBOARD_CHUNK, sizeof(struct ReplicaSlot));
+			__atomic_store_n(chunk, slot, __ATOMIC_RELEASE);
+		}
+
+		pthread_mutex_unlock(&slot_mutex);
+
+		if (slot == NULL) return NULL;
+	}
+
+	return &slot[user & (LEADERBOARD_CHUNK - 1)];
+}
+
+// Mark a user to be sent on every link. The counters are
+// written first, so a link that sees the mark sees them too.
+static void markDirty(struct LeaderBoard *entry){
+	struct ReplicaSlot *slot;
+
+	if (allLinks == 0 || (slot = slotFor(entry->number)) == NULL) return;
+
+	__atomic_fetch_or(&slot->dirty, allLinks, __ATOMIC_RELEASE);
+}
+
+// Mark every user to be sent on a link that has just come up
+static void markAll(struct PeerLink *link){
+	unsigned long count = leaderboardCount();
+
+	for (unsigned long user = 0; user < count; user++){
+		struct ReplicaSlot *slot = slotFor(user);
+
+		if (slot) __atomic_fetch_or(&slot->dirty, 1u << link->bit, __ATOMIC_RELEASE);
+	}
+}
+
+// Listens for results recorded here, after the journal
+static void onResult(struct LeaderBoard *entry, unsigned long long results){
+	if (nextListener) nextListener(entry, results);
+
+	markDirty(entry);
+}
+
+// Take in a peer's copy of the counter node keeps for a user.
+// If it is ahead of ours the difference goes on the leaderboard,
+// and the user is passed on to our own peers.
+static void mergeCounter(struct LeaderBoard *entry, int node, unsigned long long value){
+	struct ReplicaSlot *slot;
+	unsigned long long current;
+
+	if (node == selfNode || node >= REPLICA_MAX_NODES || (slot = slotFor(entry->number)) == NULL) return;
+
+	current = __atomic_load_n(&slot->counts[node], __ATOMIC_RELAXED);
+
+	while (current < value){
+		if (__atomic_compare_exchange_n(&slot->counts[node], &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			mergeResults(entry, value - current);
+			markDirty(entry);
+			__atomic_fetch_add(&replicaStats.merged, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+/* ---------------------------------------------------------------- */
+// Sending
+/* ---------------------------------------------------------------- */
+
+// Encode a user's counters at p. Returns the record's size, or
+// 0 if there is nothing to send.
+static size_t encodeRecord(unsigned char *p, struct LeaderBoard *entry, struct ReplicaSlot *slot){
+	size_t nameLength = strlen(entry->username), len;
+	int counters = 0;
+
+	if (nameLength > 255) return 0;
+
+	p[0] = nameLength;
+	memcpy(p + 1, entry->username, nameLength);
+	len = 2 + nameLength;
+
+	for (int node = 0; node < REPLICA_MAX_NODES; node++){
+		unsigned long long value = node == selfNode
+			? __atomic_load_n(&entry->local, __ATOMIC_RELAXED)
+			: __atomic_load_n(&slot->counts[node], __ATOMIC_RELAXED);
+
+		if (value == 0) continue;
+
+		p[len] = node;
+		put32(p + len + 1, value >> 32);
+		put32(p + len + 5, value & 0xffffffff);
+		len += 9;
+		counters++;
+	}
+
+	p[1 + nameLength] = counters;
+
+	return counters ? len : 0;
+}
+
+// Send the link every user marked for it since the last time,
+// in frames of up to REPLICA_FRAME_PAYLOAD and writes of up to
+// REPLICA_BATCH_BYTES. A user's mark is cleared before its
+// counters are read, so a change made meanwhile marks it again
+// for the next round.
+static int sendDeltas(struct PeerLink *link){
+	unsigned int bit = 1u << link->bit;
+	unsigned long count = leaderboardCount();
+	size_t len = FRAME_HEADER_SIZE, frameStart = 0, frames = 0;
+	unsigned long records = 0;
+
+	for (unsigned long user = 0; user < count; user++){
+		struct ReplicaSlot *chunk = __atomic_load_n(&slots[user >> LEADERBOARD_CHUNK_BITS], __ATOMIC_ACQUIRE);
+		struct ReplicaSlot *slot;
+		size_t size;
+
+		if (chunk == NULL){
+			user |= LEADERBOARD_CHUNK - 1;
+			continue;
+		}
+
+		slot = &chunk[user & (LEADERBOARD_CHUNK - 1)];
+
+		if ((__atomic_load_n(&slot->dirty, __ATOMIC_RELAXED) & bit) == 0) continue;
+
+		__atomic_fetch_and(&slot->dirty, ~bit, __ATOMIC_ACQUIRE);
+
+		// Close the frame if this record may not fit, and
+		// write out the batch if another frame may not
+		if (len - frameStart - FRAME_HEADER_SIZE + RECORD_MAX > REPLICA_FRAME_PAYLOAD){
+			frameEncode(link->batch + frameStart, OP_GOSSIP_DELTA, NULL, len - frameStart - FRAME_HEADER_SIZE);
+			frames++;
+
+			if (len + FRAME_HEADER_SIZE + RECORD_MAX > REPLICA_BATCH_BYTES){
+				if (sendEncoded(link->fd, link->batch, len, frames) == ERROR) return ERROR;
+
+				__atomic_fetch_add(&replicaStats.batches, 1, __ATOMIC_RELAXED);
+				len = frames = 0;
+			}
+
+			frameStart = len;
+			len += FRAME_HEADER_SIZE;
+		}
+
+		if ((size = encodeRecord(link->batch + len, leaderboardAt(user), slot)) > 0){
+			len += size;
+			records++;
+		}
+	}
+
+	if (len > frameStart + FRAME_HEADER_SIZE){
+		frameEncode(link->batch + frameStart, OP_GOSSIP_DELTA, NULL, len - frameStart - FRAME_HEADER_SIZE);
+		frames++;
+	} else {
+		len = frameStart;
+	}
+
+	if (frames > 0){
+		if (sendEncoded(link->fd, link->batch, len, frames) == ERROR) return ERROR;
+
+		__atomic_fetch_add(&replicaStats.batches, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_add(&replicaStats.recordsSent, records, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+// Connect to a peer and introduce this node
+static int dial(struct PeerLink *link){
+	struct addrinfo hints, *found, *p;
+	unsigned char hello = selfNode;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(link->host, link->port, &hints, &found) != 0) return ERROR;
+
+	for (p = found; p != NULL; p = p->ai_next){
+		if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) == -1) continue;
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(found);
+
+	if (fd == -1) return ERROR;
+
+	if (frameSend(fd, OP_GOSSIP_HELLO, &hello, 1) == ERROR){
+		close(fd);
+		return ERROR;
+	}
+
+	link->fd = fd;
+
+	return 1;
+}
+
+// Keep a link to one peer up, and gossip to it every tick
+static void *linkLoop(void *data){
+	struct PeerLink *link = data;
+	struct timespec tick = { 0, REPLICA_GOSSIP_MS * 1000000L };
+	struct timespec retry = { REPLICA_RETRY_MS / 1000, (REPLICA_RETRY_MS % 1000) * 1000000L };
+	int failing = 0;
+
+	while (1){
+		if (link->fd == -1){
+			if (dial(link) == ERROR){
+				if (!failing) printf("Replica: cannot reach %s:%s, retrying\n", link->host, link->port);
+				failing = 1;
+				nanosleep(&retry, NULL);
+				continue;
+			}
+
+			printf("Replica: linked to %s:%s\n", link->host, link->port);
+			failing = 0;
+			__atomic_fetch_add(&replicaStats.linksUp, 1, __ATOMIC_RELAXED);
+
+			// The peer may have missed anything, so start with
+			// the whole table
+			markAll(link);
+		}
+
+		if (sendDeltas(link) == ERROR){
+			printf("Replica: lost link to %s:%s\n", link->host, link->port);
+			close(link->fd);
+			link->fd = -1;
+			__atomic_fetch_sub(&replicaStats.linksUp, 1, __ATOMIC_RELAXED);
+		}
+
+		nanosleep(&tick, NULL);
+	}
+
+	return NULL;
+}
+
+/* ---------------------------------------------------------------- */
+// Receiving
+/* ---------------------------------------------------------------- */
+
+// Whether the name belongs to an account in the current tables
+static int knownUser(const char *name){
+	struct Tables *tables = tablesAcquire();
+	long user = credentialsFind(&tables->credentials, name);
+
+	tablesRelease(tables);
+	return user >= 0;
+}
+
+// Merge every record in a delta frame. Returns ERROR if the
+// frame is malformed.
+static int applyDelta(const unsigned char *p, size_t len){
+	char name[256];
+
+	while (len > 0){
+		size_t nameLength = p[0], size;
+		struct LeaderBoard *entry;
+		int counters;
+
+		if (len < 2 + nameLength || nameLength == 0) return ERROR;
+
+		counters = p[1 + nameLength];
+		size = 2 + nameLength + counters * 9;
+
+		if (len < size) return ERROR;
+
+		memcpy(name, p + 1, nameLength);
+		name[nameLength] = '\0';
+
+		// A peer may only add users who have an account here,
+		// so a stray connection can't fill the table
+		if ((entry = findLeaderboardEntry(name)) == NULL){
+			if (knownUser(name) && addLeaderboardEntry(name) != ERROR){
+				entry = findLeaderboardEntry(name);
+			} else {
+				__atomic_fetch_add(&replicaStats.refused, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		for (int i = 0; entry && i < counters; i++){
+			const unsigned char *counter = p + 2 + nameLength + i * 9;
+
+			mergeCounter(entry, counter[0], ((unsigned long long) get32(counter + 1) << 32) | get32(counter + 5));
+		}
+
+		p += size;
+		len -= size;
+	}
+
+	return 1;
+}
+
+// Read a peer's hello and then its deltas until it hangs up
+static void *inboundLoop(void *data){
+	struct Inbound *peer = data;
+	unsigned char buf[2 * (FRAME_HEADER_SIZE + REPLICA_FRAME_PAYLOAD)];
+	struct FrameReader reader;
+	struct Frame frame;
+	int node = -1;
+
+	frameReaderInit(&reader, buf, sizeof buf);
+
+	if (frameRecv(peer->fd, &reader, &frame) == 1 && frame.opcode == OP_GOSSIP_HELLO && frame.length == 1){
+		node = frame.payload[0];
+		printf("Replica: node %d dialled in\n", node);
+		__atomic_fetch_add(&replicaStats.inbound, 1, __ATOMIC_RELAXED);
+
+		while (frameRecv(peer->fd, &reader, &frame) == 1){
+			if (frame.opcode != OP_GOSSIP_DELTA || applyDelta(frame.payload, frame.length) == ERROR) break;
+		}
+
+		printf("Replica: node %d hung up\n", node);
+		__atomic_fetch_sub(&replicaStats.inbound, 1, __ATOMIC_RELAXED);
+	}
+
+	close(peer->fd);
+	__atomic_store_n(&peer->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+// Take in peers as they dial, a thread each, reaping the
+// threads of peers that have gone
+static void *acceptLoop(void *data){
+	while (1){
+		struct Inbound *peer = NULL;
+		int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd == -1){
+			if (errno != EINTR) perror("replica accept");
+			continue;
+		}
+
+		pthread_mutex_lock(&inbound_mutex);
+
+		for (int i = 0; i < REPLICA_MAX_INBOUND; i++){
+			if (inbound[i].used && __atomic_load_n(&inbound[i].done, __ATOMIC_ACQUIRE)){
+				pthread_join(inbound[i].thread, NULL);
+				inbound[i].used = 0;
+			}
+
+			if (!inbound[i].used && peer == NULL) peer = &inbound[i];
+		}
+
+		if (peer){
+			peer->fd = fd;
+			peer->used = 1;
+			peer->done = 0;
+
+			if (pthread_create(&peer->thread, NULL, inboundLoop, peer) != 0){
+				peer->used = 0;
+				peer = NULL;
+			}
+		}
+
+		pthread_mutex_unlock(&inbound_mutex);
+
+		if (peer == NULL) close(fd);
+	}
+
+	return NULL;
+}
+
+/* ---------------------------------------------------------------- */
+// Setup
+/* ---------------------------------------------------------------- */
+
+// Listen for peers on port, if it is not 0
+static int listenForPeers(int port){
+	struct sockaddr_in addr;
+	int yes = 1;
+
+	if ((listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) return ERROR;
+
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(listenFd, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(listenFd, REPLICA_MAX_INBOUND) == -1){
+		close(listenFd);
+		listenFd = -1;
+		return ERROR;
+	}
+
+	return pthread_create(&acceptor, NULL, acceptLoop, NULL) == 0 ? 1 : ERROR;
+}
+
+// Join the cluster as node: take gossip on port (if not 0), and
+// dial every peer, each given as host:port. Results recorded
+// from now on are gossiped after the journal has them.
+int replicaStart(int node, int port, char **peers, int peerCount){
+	if (node < 0 || node >= REPLICA_MAX_NODES || peerCount > REPLICA_MAX_PEERS){
+		fprintf(stderr, "Replication needs a node number from 0 to %d and at most %d peers\n", REPLICA_MAX_NODES - 1, REPLICA_MAX_PEERS);
+		return ERROR;
+	}
+
+	selfNode = node;
+
+	for (int i = 0; i < peerCount; i++){
+		struct PeerLink *link = &links[i];
+		char *colon = strrchr(peers[i], ':');
+
+		if (colon == NULL || colon == peers[i] || (size_t) (colon - peers[i]) >= sizeof link->host){
+			fprintf(stderr, "Peer '%s' should be host:port\n", peers[i]);
+			return ERROR;
+		}
+
+		link->bit = i;
+		link->fd = -1;
+		snprintf(link->host, sizeof link->host, "%.*s", (int) (colon - peers[i]), peers[i]);
+		snprintf(link->port, sizeof link->port, "%s", colon + 1);
+
+		if ((link->batch = malloc(REPLICA_BATCH_BYTES)) == NULL) return ERROR;
+
+		allLinks |= 1u << i;
+	}
+
+	linkCount = peerCount;
+
+	nextListener = resultListener;
+	resultListener = onResult;
+
+	if (port && listenForPeers(port) == ERROR){
+		perror("gossip port");
+		return ERROR;
+	}
+
+	for (int i = 0; i < linkCount; i++){
+		if (pthread_create(&links[i].thread, NULL, linkLoop, &links[i]) != 0) return ERROR;
+	}
+
+	printf("Replicating as node %d", selfNode);
+	if (port) printf(", taking gossip on port %d", port);
+	printf(", %d peers\n", linkCount);
+
+	return 1;
+}
+
+// Stop every replication thread and free the counters. Only
+// used on the way out.
+void replicaStop(){
+	if (selfNode == -1) return;
+
+	if (listenFd != -1){
+		pthread_cancel(acceptor);
+		pthread_join(acceptor, NULL);
+		close(listenFd);
+		listenFd = -1;
+	}
+
+	for (int i = 0; i < REPLICA_MAX_INBOUND; i++){
+		if (!inbound[i].used) continue;
+
+		pthread_cancel(inbound[i].thread);
+		pthread_join(inbound[i].thread, NULL);
+		inbound[i].used = 0;
+	}
+
+	for (int i = 0; i < linkCount; i++){
+		pthread_cancel(links[i].thread);
+		pthread_join(links[i].thread, NULL);
+		if (links[i].fd != -1) close(links[i].fd);
+		free(links[i].batch);
+	}
+
+	for (int i = 0; i < LEADERBOARD_MAX_CHUNKS; i++){
+		free(slots[i]);
+		slots[i] = NULL;
+	}
+
+	linkCount = 0;
+	allLinks = 0;
+	selfNode = -1;
+}
+
+void printReplicaStats(FILE *fp){
+	if (selfNode == -1) return;
+
+	fprintf(fp, "Replica: node %d, %lu of %d links up, %lu dialled in, %lu users sent in %lu writes, %lu counters merged, %lu records refused\n",
+		selfNode, replicaStats.linksUp, linkCount, replicaStats.inbound,
+		replicaStats.recordsSent, replicaStats.batches, replicaStats.merged, replicaStats.refused);
+}
@@ -0,0 +1,76 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Leaderboard replication
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Lets several servers share one leaderboard. Each server is a
+// node with its own number, and a user's results are kept as a
+// grow-only counter per node: the results that node recorded.
+// The node's own counter is the user's local results on the
+// leaderboard, and the counters of other nodes are kept here.
+// A node's results only ever grow, so two copies of its counter
+// are merged by taking the larger, and the leaderboard shows the
+// sum over every node. Merging in any order, any number of
+// times, gives the same answer, so every copy converges without
+// a central store.
+//
+// A node dials every peer it was given and keeps the link open.
+// Every REPLICA_GOSSIP_MS it sends each link the counters of the
+// users that changed since its last send there, many users to a
+// frame and many frames to a write. Counters learnt from other
+// nodes are passed on too, so a node hears about the whole
+// cluster as long as the links connect it. A link that drops is
+// dialled again and starts with the full table. A restarted node
+// recovers its own counters from the journal and learns everyone
+// else's again from its peers.
+//
+// Links use the game's framing:
+//	OP_GOSSIP_HELLO	node (u8), sent once by the dialling node
+//	OP_GOSSIP_DELTA	records of username length (u8), username,
+//			counter count (u8), then per counter node (u8),
+//			games played (u32), games won (u32)
+//
+// Links are not authenticated, so the gossip port must only be
+// reachable from the other nodes. Even so, a delta only creates a
+// leaderboard entry for a name the credentials table knows.
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdio.h>
+
+#define REPLICA_MAX_NODES 16
+#define REPLICA_MAX_PEERS (REPLICA_MAX_NODES - 1)
+
+// Most links that may be dialled in at once
+#define REPLICA_MAX_INBOUND 32
+
+#ifndef REPLICA_GOSSIP_MS
+#define REPLICA_GOSSIP_MS 200
+#endif
+
+#ifndef REPLICA_RETRY_MS
+#define REPLICA_RETRY_MS 1000
+#endif
+
+// Largest delta frame payload, and how much is sent per write
+#define REPLICA_FRAME_PAYLOAD 16384
+#define REPLICA_BATCH_BYTES (4 * (REPLICA_FRAME_PAYLOAD + 4))
+
+struct ReplicaStats {
+	unsigned long linksUp;		// peers currently dialled
+	unsigned long inbound;		// peers currently dialled in
+	unsigned long batches;		// writes of delta frames
+	unsigned long recordsSent;	// users sent
+	unsigned long merged;		// counters raised by a peer's copy
+	unsigned long refused;		// records for unknown or unplaceable users
+};
+
+extern struct ReplicaStats replicaStats;
+
+int replicaStart(int node, int port, char **peers, int peerCount);
+void replicaStop();
+void printReplicaStats(FILE *fp);
+
+#endif
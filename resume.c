@@ -0,0 +1,235 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Session resumption
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "resume.h"
+
+#define ERROR -1
+
+unsigned long ticketsIssued = 0, ticketsResumed = 0, ticketsExpired = 0, ticketsLive = 0;
+struct Slab ticketSlab;
+
+static struct Ticket *buckets[RESUME_BUCKETS];
+static pthread_mutex_t ticket_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Nanoseconds on the monotonic clock
+static unsigned long long now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Ticket ids are random, so their first bytes hash them well
+static struct Ticket **bucketOf(const unsigned char *id){
+	unsigned long h;
+
+	memcpy(&h, id, sizeof h);
+	return &buckets[h % RESUME_BUCKETS];
+}
+
+// Fill an id with bytes a client cannot guess
+static int newId(unsigned char *id){
+	size_t got = 0;
+
+	while (got < RESUME_TICKET_SIZE){
+		ssize_t n = getrandom(id + got, RESUME_TICKET_SIZE - got, 0);
+
+		if (n <= 0) return ERROR;
+		got += n;
+	}
+
+	return 1;
+}
+
+// Unlink a ticket and free it and any game it kept
+static void removeTicket(struct Ticket **link){
+	struct Ticket *ticket = *link;
+
+	*link = ticket->next;
+
+	if (ticket->game.words) endGame(&ticket->game);
+	slabFree(&ticketSlab, ticket);
+	ticketsLive--;
+}
+
+// Throw away the expired tickets in a bucket
+static void sweep(struct Ticket **link, unsigned long long time){
+	while (*link){
+		if ((*link)->expires && (*link)->expires <= time){
+			removeTicket(link);
+			ticketsExpired++;
+		} else {
+			link = &(*link)->next;
+		}
+	}
+}
+
+// Find the link pointing at a ticket, or NULL
+static struct Ticket **findTicket(const unsigned char *id){
+	struct Ticket **link = bucketOf(id);
+
+	sweep(link, now());
+
+	while (*link && memcmp((*link)->id, id, RESUME_TICKET_SIZE) != 0){
+		link = &(*link)->next;
+	}
+
+	return *link ? link : NULL;
+}
+
+// Set up the slab tickets are taken from
+int resumeInit(){
+	return slabInit(&ticketSlab, "ticket", sizeof(struct Ticket));
+}
+
+// Give a logged in connection a ticket it holds. When the table
+// is full even after clearing out expired tickets, the login
+// goes without one.
+void resumeIssue(const char *username, struct TicketHold *hold){
+	struct Ticket *ticket;
+	struct Ticket **bucket;
+
+	hold->held = 0;
+
+	if (strlen(username) >= sizeof ticket->username || newId(hold->id) == ERROR) return;
+
+	pthread_mutex_lock(&ticket_mutex);
+
+	if (ticketsLive >= RESUME_MAX_TICKETS){
+		unsigned long long time = now();
+
+		for (int i = 0; i < RESUME_BUCKETS; i++) sweep(&buckets[i], time);
+	}
+
+	if (ticketsLive < RESUME_MAX_TICKETS && (ticket = slabAlloc(&ticketSlab))){
+		memset(ticket, 0, sizeof *ticket);
+		memcpy(ticket->id, hold->id, RESUME_TICKET_SIZE);
+		strcpy(ticket->username, username);
+
+		bucket = bucketOf(ticket->id);
+		sweep(bucket, now());
+		ticket->next = *bucket;
+		*bucket = ticket;
+
+		ticketsLive++;
+		ticketsIssued++;
+		hold->held = 1;
+	}
+
+	pthread_mutex_unlock(&ticket_mutex);
+}
+
+// Take up a ticket on a new connection. It must belong to the
+// user and must not be held by a connection that is still open.
+// On success the ticket is moved to a fresh id in hold, and any
+// suspended game is handed over. Returns 1 if a game was handed
+// over, 0 if not, or ERROR if the ticket can't be claimed.
+int resumeClaim(const unsigned char *id, const char *username, struct TicketHold *hold, struct Game *game){
+	struct Ticket **link, *ticket;
+	struct Ticket **bucket;
+	int resumed = 0;
+
+	hold->held = 0;
+
+	if (newId(hold->id) == ERROR) return ERROR;
+
+	pthread_mutex_lock(&ticket_mutex);
+
+	link = findTicket(id);
+
+	if (link == NULL || (*link)->expires == 0 || strcmp((*link)->username, username) != 0){
+		pthread_mutex_unlock(&ticket_mutex);
+		return ERROR;
+	}
+
+	ticket = *link;
+	*link = ticket->next;
+
+	if (ticket->game.words){
+		*game = ticket->game;
+		ticket->game.words = NULL;
+		resumed = 1;
+	}
+
+	memcpy(ticket->id, hold->id, RESUME_TICKET_SIZE);
+	ticket->expires = 0;
+
+	bucket = bucketOf(ticket->id);
+	ticket->next = *bucket;
+	*bucket = ticket;
+
+	ticketsResumed++;
+	hold->held = 1;
+
+	pthread_mutex_unlock(&ticket_mutex);
+
+	return resumed;
+}
+
+// The connection holding a ticket has dropped. Keep the ticket,
+// with the game if one was in progress, until it expires. The
+// game is taken over either way, so without a ticket it is ended.
+void resumeSuspend(struct TicketHold *hold, struct Game *game){
+	struct Ticket **link;
+
+	if (!hold->held){
+		if (game && game->words) endGame(game);
+		return;
+	}
+
+	pthread_mutex_lock(&ticket_mutex);
+
+	if ((link = findTicket(hold->id))){
+		(*link)->expires = now() + RESUME_TTL_SECONDS * 1000000000ULL;
+
+		if (game && game->words){
+			(*link)->game = *game;
+			game->words = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&ticket_mutex);
+
+	if (game && game->words) endGame(game);
+
+	hold->held = 0;
+}
+
+// The user quit, so the ticket is no longer any use
+void resumeDrop(struct TicketHold *hold){
+	struct Ticket **link;
+
+	if (!hold->held) return;
+
+	pthread_mutex_lock(&ticket_mutex);
+
+	if ((link = findTicket(hold->id))) removeTicket(link);
+
+	pthread_mutex_unlock(&ticket_mutex);
+
+	hold->held = 0;
+}
+
+// Free every ticket and suspended game
+void resumeFree(){
+	pthread_mutex_lock(&ticket_mutex);
+
+	for (int i = 0; i < RESUME_BUCKETS; i++){
+		while (buckets[i]) removeTicket(&buckets[i]);
+	}
+
+	slabDestroy(&ticketSlab);
+
+	pthread_mutex_unlock(&ticket_mutex);
+}
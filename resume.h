@@ -0,0 +1,59 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Session resumption
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Every login is given a ticket: 16 random bytes the client can
+// present on a new connection to pick up where it left off, as
+// the same user and in the same game, without logging in again.
+//
+// A ticket is held by its connection while that is open. When
+// the connection drops, the ticket is kept for RESUME_TTL_SECONDS
+// along with the game that was in progress. Claiming it on a new
+// connection attaches it there under a fresh id, so each id works
+// only once. A clean quit throws the ticket away.
+//
+// Tickets are kept in a chained hash table behind one lock, which
+// is only taken at login, resume and disconnect. Expired tickets
+// are cleared out of a bucket whenever it is touched. Tickets come
+// from a slab, so each costs sizeof(struct Ticket) rounded up to
+// 16 bytes, plus its game's arena block if a game is kept.
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "game.h"
+#include "protocol.h"
+#include "slab.h"
+
+#define RESUME_TTL_SECONDS 60
+#define RESUME_MAX_TICKETS 131072
+#define RESUME_BUCKETS 32768
+
+struct Ticket {
+	unsigned char id[RESUME_TICKET_SIZE];
+	char username[64];
+	unsigned long long expires;	// monotonic nanoseconds, 0 while held
+	struct Game game;		// the suspended game, if words is set
+	struct Ticket *next;
+};
+
+// A connection's claim on its ticket
+struct TicketHold {
+	int held;
+	unsigned char id[RESUME_TICKET_SIZE];
+};
+
+extern unsigned long ticketsIssued, ticketsResumed, ticketsExpired, ticketsLive;
+extern struct Slab ticketSlab;
+
+int resumeInit();
+
+void resumeIssue(const char *username, struct TicketHold *hold);
+int resumeClaim(const unsigned char *id, const char *username, struct TicketHold *hold, struct Game *game);
+void resumeSuspend(struct TicketHold *hold, struct Game *game);
+void resumeDrop(struct TicketHold *hold);
+void resumeFree();
+
+#endif
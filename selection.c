@@ -0,0 +1,159 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Word selection
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "selection.h"
+
+static uint64_t baseSeed = 0;
+static unsigned long threadsSeeded = 0;
+
+// Each thread's generator, seeded on first use
+static __thread uint64_t state[4];
+static __thread int seeded = 0;
+
+// splitmix64, used to spread one seed over the state words
+static uint64_t splitMix(uint64_t *x){
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k){
+	return (x << k) | (x >> (64 - k));
+}
+
+// Set the seed threads derive their generators from. Without
+// one, it is taken from /dev/urandom or the clock.
+void selectionSeed(uint64_t seed){
+	baseSeed = seed;
+}
+
+// Give this thread a generator of its own
+static void seedThread(){
+	uint64_t x, unset = 0;
+
+	if (baseSeed == 0){
+		FILE *fp = fopen("/dev/urandom", "rb");
+		uint64_t seed = 0;
+
+		if (fp == NULL || fread(&seed, sizeof seed, 1, fp) != 1) seed = time(NULL) ^ ((uint64_t) getpid() << 32);
+		if (fp) fclose(fp);
+
+		__atomic_compare_exchange_n(&baseSeed, &unset, seed | 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	x = __atomic_load_n(&baseSeed, __ATOMIC_RELAXED) + __atomic_fetch_add(&threadsSeeded, 1, __ATOMIC_RELAXED) * 0x632be59bd9b4e019ULL;
+
+	for (int i = 0; i < 4; i++) state[i] = splitMix(&x);
+
+	seeded = 1;
+}
+
+// Next 64 random bits from this thread's xoshiro256**
+uint64_t randomNext(){
+	uint64_t result, t;
+
+	if (!seeded) seedThread();
+
+	result = rotl(state[1] * 5, 7) * 9;
+	t = state[1] << 17;
+
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= t;
+	state[3] = rotl(state[3], 45);
+
+	return result;
+}
+
+// A uniform number below bound (at most 2^32), without modulo
+// bias: Lemire's multiply and reject, which rarely draws twice
+uint64_t randomBelow(uint64_t bound){
+	uint64_t x = randomNext() >> 32;
+	uint64_t m = x * (bound & 0xffffffffULL);
+	uint32_t low = m;
+
+	if (low < (uint32_t) bound){
+		uint32_t threshold = (uint32_t) -bound % (uint32_t) bound;
+
+		while (low < threshold){
+			x = randomNext() >> 32;
+			m = x * (bound & 0xffffffffULL);
+			low = m;
+		}
+	}
+
+	return m >> 32;
+}
+
+// Draw one entry from a bucket's alias table
+static size_t drawFrom(const struct Dictionary *dictionary, const struct DictBucket *bucket){
+	uint64_t cell = randomBelow(bucket->count);
+	const struct DictAlias *alias = &dictionary->alias[bucket->first + cell];
+
+	if ((uint32_t) randomNext() < alias->threshold) return bucket->first + cell;
+	return bucket->first + alias->alias;
+}
+
+// Pick a bucket for an "any difficulty" game, weighted by how
+// many categories each holds
+static const struct DictBucket *anyBucket(const struct Dictionary *dictionary){
+	const struct DictBucket *buckets = dictionary->header->buckets;
+	uint64_t total = 0, draw;
+
+	for (int b = 0; b < DICT_BUCKETS; b++) total += buckets[b].weight;
+
+	draw = randomBelow(total);
+
+	for (int b = 0; b < DICT_BUCKETS; b++){
+		if (draw < buckets[b].weight) return &buckets[b];
+		draw -= buckets[b].weight;
+	}
+
+	return &buckets[DICT_BUCKETS - 1];
+}
+
+// Whether the user played this entry in one of their last games
+static int playedRecently(struct LeaderBoard *user, size_t entry){
+	for (int i = 0; i < LEADERBOARD_RECENT; i++){
+		if (__atomic_load_n(&user->recent[i], __ATOMIC_RELAXED) == entry + 1) return 1;
+	}
+
+	return 0;
+}
+
+// Pick the dictionary entry for a user's next game. A bucket
+// with no entries falls back to any difficulty. user may be
+// NULL, in which case repeats aren't avoided.
+size_t selectEntry(const struct Dictionary *dictionary, int difficulty, struct LeaderBoard *user){
+	const struct DictBucket *bucket = NULL;
+	size_t entry;
+
+	if (difficulty >= DIFFICULTY_EASY && difficulty <= DIFFICULTY_HARD){
+		bucket = &dictionary->header->buckets[difficulty - 1];
+		if (bucket->count == 0) bucket = NULL;
+	}
+
+	for (int attempt = 0; ; attempt++){
+		entry = drawFrom(dictionary, bucket ? bucket : anyBucket(dictionary));
+
+		if (user == NULL || attempt + 1 >= SELECTION_ATTEMPTS || !playedRecently(user, entry)) break;
+	}
+
+	if (user){
+		unsigned int slot = __atomic_fetch_add(&user->recentNext, 1, __ATOMIC_RELAXED) % LEADERBOARD_RECENT;
+		__atomic_store_n(&user->recent[slot], entry + 1, __ATOMIC_RELAXED);
+	}
+
+	return entry;
+}
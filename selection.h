@@ -0,0 +1,31 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Word selection
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Picks the phrase for a new game. Every thread draws from its
+// own xoshiro256** generator, so game starts share no state and
+// take no locks. A pick is an alias table lookup in the chosen
+// difficulty bucket (see dictionary.h), and is drawn again a few
+// times if it is one of the user's last few phrases.
+
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dictionary.h"
+#include "leaderboard.h"
+
+// Draws made before settling for a recently played phrase
+#define SELECTION_ATTEMPTS 8
+
+void selectionSeed(uint64_t seed);
+uint64_t randomNext();
+uint64_t randomBelow(uint64_t bound);
+
+size_t selectEntry(const struct Dictionary *dictionary, int difficulty, struct LeaderBoard *user);
+
+#endif
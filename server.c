@@ -13,140 +13,278 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "queue.h"
+#include "pool.h"
+#include "leaderboard.h"
+#include "journal.h"
+#include "dictionary.h"
+#include "game.h"
+#include "credentials.h"
+#include "selection.h"
+#include "metrics.h"
+#include "resume.h"
+#include "tables.h"
+#include "lobby.h"
+#include "lbcache.h"
+#include "replica.h"
+#include "slab.h"
 
 #define HANGMAN_FILE "hangman_text.txt"
 #define AUTH_FILE "Authentication.txt"
 
+#define DEFAULT_DATA_DIR "."
+
 #define DEFAULT_PORT 12345
-#define BACKLOG 4
+#define DEFAULT_BACKLOG 128
+
+// Connections taken off the listening socket per wakeup, so a
+// flood of connects can't starve the sessions already in play
+#define ACCEPT_BATCH 64
+
+// Sessions connected at once, waiting or being served, beyond
+// which new connections are turned away with OP_BUSY
+#define DEFAULT_MAX_SESSIONS 4096
+
+// How long a turned away client is told to wait when there is
+// no better estimate
+#define BUSY_RETRY_MS 1000
 
 #define MAXDATASIZE 512
 
-#define LEADERBOARD 1
+// Clients only ever send short frames, so a session buffers
+// far less than a whole maximum sized frame.
+#define CLIENT_FRAME_MAX (FRAME_HEADER_SIZE + 256)
 
-#define LOCK 1
-#define UNLOCK 0
+// Replies a session can queue inside its own record. A bigger
+// one, such as the full leaderboard, goes in a heap buffer that
+// is given back as soon as it has been sent.
+#define SESSION_OUT_INLINE 256
 
-#define NUM_HANDLER_THREADS 10
+// Unsent bytes past which a session's frames are left unread
+// until the client catches up, so a client that pipelines
+// requests and never reads cannot grow the server without
+// bound. One reply can still overshoot it, by at most the
+// size of the full leaderboard.
+#define SESSION_OUT_HIGH (64 * 1024)
 
-#define ERROR -1
+#define NUM_HANDLER_THREADS 10
+#define MAX_HANDLER_THREADS 128
+#define DEFAULT_QUEUE_SIZE 1024
 
-struct Entry {
-	char *object;
-	char *objectType;
-} *entries;
+#define MAX_EVENTS 64
 
-struct User {
-	char *username;
-	char *password;
-} *users;
+#define MODE_EPOLL 0
+#define MODE_POOL 1
 
-struct LeaderBoard {
-	char *username;
-	int gamesWon;
-	int gamesPlayed;
-} *leaderBoard = NULL;
+#define ERROR -1
 
-int num_requests = 0;
 int totalRequests = 0;
 
-struct Request {
-	int number;
-	int sockfd;
-	struct Request *next;
-};	
-
-struct Request *requests = NULL;
-struct Request *last_request = NULL;
+unsigned long queueSize = DEFAULT_QUEUE_SIZE;
+struct WorkerPool pool;
+int poolShards = 0;
+int pinWorkers = 0;
+struct Lobby lobby;
+int minThreads = NUM_HANDLER_THREADS;
+int maxThreads = MAX_HANDLER_THREADS;
+
+// The states a non-blocking session moves through. Each
+// state maps onto a point where the blocking handler would
+// be sitting in recv.
+enum SessionState {
+	SESSION_AWAIT_AUTH,
+	SESSION_MENU,
+	SESSION_IN_GAME
+};
+
+// Everything a connected epoll session keeps, in one fixed size
+// record from the session slab. Only a game in play (an arena
+// block) and a big reply waiting to be sent live elsewhere.
+struct Session {
+	int fd;
+	enum SessionState state;
+	unsigned int events;
+	char closeAfterFlush;
+	char username[64];
+	struct TicketHold ticket;
+	struct Game game;
+	struct FrameReader reader;
+	unsigned char *out;		// outInline, unless a reply outgrew it
+	size_t outLen, outSent, outCap;
+	unsigned char in[CLIENT_FRAME_MAX];
+	unsigned char outInline[SESSION_OUT_INLINE];
+};
+
+struct Reactor {
+	int id;
+	int epfd;
+	pthread_t thread;
+};
 
 typedef struct thread_socket {
 	int sockfd;
 	pthread_t *thread;
 } thdata;
 
-int userCount = 0, entryCount = 0, authCount = 0;
 int port = DEFAULT_PORT;
+int serverMode = MODE_EPOLL;
+char *dataDir = DEFAULT_DATA_DIR;
+char *dictionaryFile = NULL;
+char *credentialsFile = NULL;
+int adminPort = 0;
+int backlog = DEFAULT_BACKLOG;
+unsigned long maxSessions = DEFAULT_MAX_SESSIONS;
+int replicaNode = -1;
+int gossipPort = 0;
+char *peers[REPLICA_MAX_PEERS];
+int peerCount = 0;
+
+// Where time goes, per stage of a session
+struct Histogram queueWaitTime, authTime, guessTime, sendTime, leaderboardTime;
+unsigned long sessionsActive = 0;
+unsigned long connectionsRejected = 0;
+int reactorCount = 0;
 
 int sockfd, numbytes;
 struct sockaddr_in my_addr; 
 struct sockaddr_in their_addr;
 socklen_t sin_size;
 
-char buf[MAXDATASIZE];
-struct User currentUser;
 
 
-pthread_t threads[NUM_HANDLER_THREADS];
-int thread_id[NUM_HANDLER_THREADS];
-int leaderboard_rc = 0;
 
-pthread_mutex_t leaderboard_write_mutex, leaderboard_rc_mutex, leaderboard_read_mutex;
-pthread_mutex_t request_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+struct Reactor *reactors = NULL;
+
+struct Slab sessionSlab;
 
-pthread_cond_t got_request = PTHREAD_COND_INITIALIZER;
+// Posted by the SIGINT handler for the thread that shuts down
+sem_t interrupted;
+pthread_t stopper;
+
+// Set once the server is stopping. The eventfd is made readable
+// at the same time, which wakes every reactor and the listener.
+int stopping = 0;
+int wakeFd = -1;
+
+// The client socket each pool worker is serving, or -1, so a
+// stop can wake workers blocked on their clients
+int *workerFds = NULL;
 
 /* ---------------------------------------------------------------- */
 // Function Declarations
 /* ---------------------------------------------------------------- */
 
 // SETUP //
-void loadEntries();
-void loadAuthData();
+int loadEntries(struct Dictionary *dictionary);
+int loadAuthData(struct Credentials *credentials);
+int loadTables(struct Tables *tables);
 void init();
 
 // SOCKET //
 void startServer();
 void listenForConnection();
+void parseArguments(int argc, char *argv[]);
+
+// REACTOR //
+void startReactors();
+void *reactorLoop(void *data);
+void acceptConnections(struct Reactor *reactor);
+void rejectConnection(int fd, unsigned long retryMs);
+void handleSessionEvent(struct Reactor *reactor, struct Session *session, unsigned int events);
+int handleSessionMessage(struct Session *session, struct Frame *frame);
+int sessionBacklogged(struct Session *session);
+int sessionQueue(struct Session *session, int opcode, const void *payload, size_t len);
+int sessionQueueEncoded(struct Session *session, const void *frames, size_t len, size_t count);
+int sessionReserve(struct Session *session, size_t size);
+int sessionFlush(struct Session *session);
+void sessionClose(struct Session *session);
 
 // GAME PLAY //
-int authenticateUser(char *_buf, int new_fd, char *uname, char *pwd );
-int recvAuthDataAndAuthenticate(char *_buf, int new_fd );
-int gameLoop(int new_fd, char *username );
-
-// LEADER BOARD //
-int addLeaderboardEntry(char *name);
-int addLossFor(char *name);
-int addWinFor(char *name);
+int pickGame(struct Game *game, char *username, int difficulty);
+int requestedDifficulty(struct Frame *frame);
+long lookupUser(char *uname, char *pwd);
+int parseCredentials(struct Frame *frame, char *uname, char *pwd);
+size_t encodeGameState(unsigned char *out, struct Game *game);
+size_t encodePhrase(unsigned char *out, struct Game *game);
+int playGuesses(struct Game *game, struct Frame *frame, int *opcode, unsigned char *out, size_t *len);
+int givesUpGame(struct Game *game, struct Frame *frame);
+size_t encodeRankedRow(unsigned char *out, struct RankedRow *row);
+long rankedQuery(struct Frame *frame, char *username, struct RankedRow *rows, unsigned long *total);
+int authenticateUser(char *_buf, int new_fd, char *pwd, char *uname, struct TicketHold *ticket);
+int claimTicket(struct Frame *frame, char *uname, struct TicketHold *ticket, struct Game *game);
+int resumeUser(char *_buf, int new_fd, struct Frame *frame, struct TicketHold *ticket, struct Game *game);
+int recvAuthDataAndAuthenticate(char *_buf, int new_fd, struct FrameReader *reader, struct TicketHold *ticket, struct Game *game);
+int gameLoop(int new_fd, char *username, struct FrameReader *reader, struct TicketHold *ticket, struct Game *game);
+
+// METRICS //
+void initMetrics();
+void observeSend(unsigned long long nanos);
+unsigned long requestQueueDepth();
+int isLocalPeer(int fd);
+int sendStats(int new_fd);
+int sendReload(int new_fd);
 
 // UTIL // 
 int min(int a, int b);
 int max(int a, int b);
 void handleInterrupt();
+void *shutdownLoop(void *data);
+void shutdownServer();
+void handleHangup();
 void freeResources();
 
 // CLIENT SERVICES //
-int hangmanLoop(int new_fd, char *username);
-int leaderboardLoop(int new_fd);
+int hangmanLoop(int new_fd, char *username, struct FrameReader *reader, struct Game *game, struct Frame *frame);
+int leaderboardLoop(int new_fd, struct Frame *frame);
+int rankedLeaderboardLoop(int new_fd, char *username, struct Frame *frame);
 
 // PTHREAD RUNNER //
 void handleConnection(void *ptr);
 
-// MUTEX LOCK UTIL //
-void mutexInit();
-void mutexRead(char a);
-void mutexWrite(char a);
-
 // THREADPOOL UTIL //
-void addRequest(int sockfd, int request_num, pthread_mutex_t *p_mutex, pthread_cond_t *p_cond_var);
+void createThreads();
+void addRequest(int sockfd, int request_num);
+int incomingCpu(int fd);
 
 /* ---------------------------------------------------------------- */
 // Main Loop
 /* ---------------------------------------------------------------- */
 int main(int argc, char *argv[]){
 
+	// Shutting down takes locks and joins threads, none of which
+	// is safe in a signal handler, so a thread does it instead
+	if (sem_init(&interrupted, 0, 0) == -1 || (wakeFd = eventfd(0, EFD_CLOEXEC)) == -1 || pthread_create(&stopper, NULL, shutdownLoop, NULL) != 0){
+		perror("shutdown thread");
+		exit(1);
+	}
+
 	signal(SIGINT, handleInterrupt);
+	signal(SIGHUP, handleHangup);
+	signal(SIGPIPE, SIG_IGN);
 
-	if (argc >= 2) {
-		port = atoi(argv[1]);
-	}
+	parseArguments(argc, argv);
 
 	init();
 	startServer();
 
-	listenForConnection();
+	if (serverMode == MODE_EPOLL){
+		startReactors();
+	} else {
+		createThreads();
+		listenForConnection();
+	}
 
-	close(sockfd);
-    freeResources();
+	shutdownServer();
 	return 1;
 }
 
@@ -154,56 +292,52 @@ int main(int argc, char *argv[]){
 // Function Definitions
 /* ---------------------------------------------------------------- */
 
-// Add a request to the queue
-void addRequest(int sockfd, int request_num, pthread_mutex_t *p_mutex, pthread_cond_t *p_cond_var){
-
-	struct Request *request;
+// Add a request to the queue and the lobby, on the shard of the
+// CPU the connection came in on. When the queue is full, or too
+// many sessions are already connected, the client is turned away
+// at once rather than left waiting.
+void addRequest(int sockfd, int request_num){
 
-	request = malloc(sizeof(struct Request));
-	request->number = request_num;
-	request->sockfd = sockfd;
-	request->next = NULL;
+	struct Request request;
+	unsigned long waiting = poolDepth(&pool);
 
-	pthread_mutex_lock(p_mutex);
-
-	if (num_requests == 0){
-		requests = request;
-		last_request = request;
-	} else {
-		last_request->next = request;
-		last_request = request;
+	if (waiting >= queueSize || __atomic_load_n(&sessionsActive, __ATOMIC_RELAXED) + waiting >= maxSessions){
+		rejectConnection(sockfd, lobbyEstimate(&lobby, waiting));
+		return;
 	}
 
-	num_requests++;
+	request.number = request_num;
+	request.sockfd = sockfd;
+	request.enqueued = poolNow();
+	request.lobby = lobbyJoin(&lobby, sockfd);
 
-	pthread_mutex_unlock(p_mutex);
-	pthread_cond_signal(p_cond_var);
+	if (poolSubmit(&pool, &request, incomingCpu(sockfd)) == ERROR){
+		if (request.lobby) lobbyDrop(&lobby, request.lobby);
+		rejectConnection(sockfd, lobbyEstimate(&lobby, waiting));
+	}
 }
 
-// Get a request from the queue
-struct Request *getRequest(pthread_mutex_t *p_mutex){
-
-	struct Request *request;
+// The CPU that took in a connection's packets, or -1 if the
+// kernel doesn't say
+int incomingCpu(int fd){
+	int cpu;
+	socklen_t size = sizeof cpu;
 
-	pthread_mutex_lock(p_mutex);
+	return getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size) == 0 ? cpu : -1;
+}
 
-	if (num_requests > 0){
-		request = requests;
-		requests = request->next;
+// Turn a connection away, telling the client when to try again
+void rejectConnection(int fd, unsigned long retryMs){
+	unsigned char out[FRAME_HEADER_SIZE + 4], payload[4];
+	size_t len;
 
-		if (requests == NULL){
-			last_request = NULL;
-		}
+	put32(payload, retryMs ? retryMs : BUSY_RETRY_MS);
+	len = frameEncode(out, OP_BUSY, payload, sizeof payload);
 
-		num_requests--;
+	if (send(fd, out, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) len) countSent(1, len);
 
-	} else {
-		request = NULL;
-	}
-
-	pthread_mutex_unlock(p_mutex);
-
-	return request;
+	close(fd);
+	__atomic_fetch_add(&connectionsRejected, 1, __ATOMIC_RELAXED);
 }
 
 // Function passed to threads in the threadpool
@@ -212,242 +346,758 @@ struct Request *getRequest(pthread_mutex_t *p_mutex){
 void handleRequest(struct Request *request, int thread_id){
 	char username[64];
 	int sockfd = request->sockfd;
-
-	if (send(sockfd, "connected", sizeof("conected"), 0) == -1 ){
+	unsigned char in[CLIENT_FRAME_MAX];
+	struct FrameReader reader;
+	struct TicketHold ticket;
+	struct Game game;
+
+	// The socket is this thread's now, so the lobby must stop
+	// writing to it
+	if (request->lobby) lobbyLeave(&lobby, request->lobby);
+
+	// Publish the socket before looking at stopping, so either
+	// this thread sees the stop or the stop sees the socket
+	__atomic_store_n(&workerFds[thread_id], sockfd, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+		__atomic_store_n(&workerFds[thread_id], -1, __ATOMIC_SEQ_CST);
+		close(sockfd);
 		return;
 	}
 
-	if (recvAuthDataAndAuthenticate(username, sockfd) == ERROR) return;
+	frameReaderInit(&reader, in, sizeof in);
+	ticket.held = 0;
+	game.words = NULL;
 
-	if(!(strcmp(username, "_failed_") == 0)){
-		if (gameLoop(sockfd, username) == ERROR) return;
-	} else {
+	__atomic_fetch_add(&sessionsActive, 1, __ATOMIC_RELAXED);
 
+	if (frameSend(sockfd, OP_CONNECTED, NULL, 0) != ERROR && recvAuthDataAndAuthenticate(username, sockfd, &reader, &ticket, &game) != ERROR){
+		gameLoop(sockfd, username, &reader, &ticket, &game);
 	}
+
+	__atomic_store_n(&workerFds[thread_id], -1, __ATOMIC_SEQ_CST);
+
+	// Keep the ticket, and any game in progress, for a reconnect
+	resumeSuspend(&ticket, &game);
+
+	__atomic_fetch_sub(&sessionsActive, 1, __ATOMIC_RELAXED);
 }
 
-// Loop that handles threadpool requests.
-void *handleRequestLoop(void *data){
-	struct Request *request;
-	int thread_id = *((int *)data);
+// Start the thread pool, which grows and shrinks between
+// minThreads and maxThreads with the queue
+void createThreads(){
+
+	if (poolStart(&pool, queueSize, poolShards, pinWorkers, minThreads, maxThreads, handleRequest) == ERROR){
+		perror("poolStart");
+		exit(1);
+	}
+
+	pool.waits = &queueWaitTime;
 
-	pthread_mutex_lock(&request_mutex);
+	if ((workerFds = malloc(pool.max * sizeof(int))) == NULL){
+		perror("malloc");
+		exit(1);
+	}
 
-	while(1){
-		if (num_requests > 0){
-			request = getRequest(&request_mutex);
-			if (request) {
-				pthread_mutex_unlock(&request_mutex);
-				handleRequest(request, thread_id);
-				free(request);
-				pthread_mutex_lock(&request_mutex);
-			}
-		} else {
-			pthread_cond_wait(&got_request, &request_mutex);
-		}
+	for (int i = 0; i < pool.max; i++) workerFds[i] = -1;
+
+	if (lobbyStart(&lobby) == ERROR){
+		perror("lobbyStart");
+		exit(1);
 	}
+
+	printf("Serving with %d-%d pool threads, %d queue shards over %d CPUs%s\n",
+		pool.min, pool.max, pool.shardCount, pool.cpuCount, pool.pinned ? ", pinned" : "");
 }
 
-// Add a win in the leaderboard 
-// depending on the username.
-// This is a critical section so mutex
-// locks are used.
-int addWinFor(char *name){
+// Initialise the application.
+void init(){
+	struct Tables *tables;
+
+	if (tablesInit(loadTables) == ERROR || tablesStartReloader() == ERROR){
+		exit(1);
+	}
 
-	mutexWrite(LOCK);
+	tables = tablesAcquire();
+	if (leaderboardInit(tables->credentials.userCount) == ERROR){
+		perror("leaderboardInit");
+		exit(1);
+	}
+	tablesRelease(tables);
 
-	for (int i = 0; i < userCount; i++){
-		if(strcmp(leaderBoard[i].username, name) == 0){
-			leaderBoard[i].gamesWon++;
-			leaderBoard[i].gamesPlayed++;
+	if (gameInit() == ERROR || resumeInit() == ERROR || slabInit(&sessionSlab, "session", sizeof(struct Session)) == ERROR){
+		perror("slabInit");
+		exit(1);
+	}
 
-			mutexWrite(UNLOCK);
-			return 1;
-		}
+	printf("Memory per session: %zu byte record, %d-%d byte game block, %zu byte ticket while suspended\n",
+		sessionSlab.size, 2 * GAME_SMALLEST_HALF, 2 * PHRASE_CAPACITY, ticketSlab.size);
+
+	initMetrics();
+
+	if (journalOpen(dataDir) == ERROR){
+		exit(1);
+	}
+
+	if ((gossipPort || peerCount) && replicaStart(replicaNode, gossipPort, peers, peerCount) == ERROR){
+		exit(1);
 	}
-	mutexWrite(UNLOCK);
-	return 0;
 }
 
-// Add a loss in the leaderboard 
-// depending on the username.
-// This is a critical section so mutex
-// locks are used.
-int addLossFor(char *name){
+// Listen for connections from clients, and add a request to
+// the threadpool for each one accepted. Each wakeup takes up to
+// ACCEPT_BATCH connections off the listening socket.
+void listenForConnection(){
+	struct pollfd listener[2] = { { sockfd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
 
-	mutexWrite(LOCK);
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
 
-	for (int i = 0; i < userCount; i++){
-		if(strcmp(leaderBoard[i].username, name) == 0){
-			leaderBoard[i].gamesPlayed++;
+	while(1){
+		if (poll(listener, 2, -1) == -1){
+			if (errno != EINTR) perror("poll");
+			continue;
+		}
 
-			mutexWrite(UNLOCK);
+		if (listener[1].revents) return;
 
-			return 1;
+		for (int i = 0; i < ACCEPT_BATCH; i++){
+			int fd;
+
+			sin_size = sizeof(struct sockaddr_in);
+
+			if ((fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size, SOCK_CLOEXEC)) == -1) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+				break;
+			}
+
+			printf("Server: got connection from %s\n", inet_ntoa(their_addr.sin_addr));
+			addRequest(fd, totalRequests++);
 		}
 	}
+}
 
-	mutexWrite(UNLOCK);
+// Parse the command line. The port may still be passed as
+// the only argument, as it was before the options existed.
+void parseArguments(int argc, char *argv[]){
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:w:q:t:T:S:AD:d:a:P:b:c:N:G:R:")) != -1){
+		switch (opt){
+			case 'm':
+				if (strcmp(optarg, "epoll") == 0){
+					serverMode = MODE_EPOLL;
+				} else if (strcmp(optarg, "pool") == 0){
+					serverMode = MODE_POOL;
+				} else {
+					fprintf(stderr, "Unknown mode '%s', expected epoll or pool\n", optarg);
+					exit(1);
+				}
+			break;
+			case 'w':
+				reactorCount = atoi(optarg);
+			break;
+			case 'q':
+				queueSize = strtoul(optarg, NULL, 10);
+			break;
+			case 't':
+				minThreads = atoi(optarg);
+			break;
+			case 'T':
+				maxThreads = atoi(optarg);
+			break;
+			case 'S':
+				poolShards = atoi(optarg);
+			break;
+			case 'A':
+				pinWorkers = 1;
+			break;
+			case 'D':
+				dataDir = optarg;
+			break;
+			case 'd':
+				dictionaryFile = optarg;
+			break;
+			case 'a':
+				credentialsFile = optarg;
+			break;
+			case 'P':
+				adminPort = atoi(optarg);
+			break;
+			case 'b':
+				backlog = atoi(optarg);
+			break;
+			case 'c':
+				maxSessions = strtoul(optarg, NULL, 10);
+			break;
+			case 'N':
+				replicaNode = atoi(optarg);
+			break;
+			case 'G':
+				gossipPort = atoi(optarg);
+			break;
+			case 'R':
+				if (peerCount == REPLICA_MAX_PEERS){
+					fprintf(stderr, "At most %d peers\n", REPLICA_MAX_PEERS);
+					exit(1);
+				}
 
-	return 0;
+				peers[peerCount++] = optarg;
+			break;
+			default:
+				fprintf(stderr, "usage: server [-m epoll|pool] [-w workers] [-q queue size] [-t min threads] [-T max threads] [-S queue shards] [-A] [-D data dir] [-d dictionary] [-a credentials] [-P admin port] [-b listen backlog] [-c max sessions] [-N node -G gossip port -R peer host:port ...] [port]\n");
+				exit(1);
+		}
+	}
+
+	if (optind < argc) {
+		port = atoi(argv[optind]);
+	}
 }
 
-// Add a leaderboard entry for a username
-// This is a critical section so mutex
-// locks are used.
-int addLeaderboardEntry(char *name){
+// Start the event loops. Every reactor shares the listening
+// socket and accepts into its own epoll set, so a session
+// stays on the thread that accepted it. The main thread
+// runs the first reactor itself.
+void startReactors(){
+
+	if (reactorCount <= 0) reactorCount = max((int) sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
 
-	mutexWrite(LOCK);
+	reactors = calloc(reactorCount, sizeof(struct Reactor));
 
-	// Check to see if the user already exists in the data store
-	for (int i = 0; i < userCount; i++){
-		if(strcmp(leaderBoard[i].username, name) == 0){
-		// they're the same
+	for (int i = 0; i < reactorCount; i++){
+		struct epoll_event ev;
 
-			mutexWrite(UNLOCK);
+		reactors[i].id = i;
 
-		return -1;
+		if ((reactors[i].epfd = epoll_create1(0)) == -1) {
+			perror("epoll_create1");
+			exit(1);
 		}
-	}
 
-	userCount++;
-	leaderBoard = realloc(leaderBoard, userCount * sizeof(struct LeaderBoard));
-	leaderBoard[userCount - 1].username = malloc(strlen(name) + 1);
-	strcpy(leaderBoard[userCount - 1].username, name);
-	leaderBoard[userCount - 1].gamesWon = 0;
-	leaderBoard[userCount - 1].gamesPlayed = 0;
+		// A NULL pointer marks the listening socket
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
 
-	mutexWrite(UNLOCK);
+		if (epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
 
-	return 1; // return success
-}	
+		// The wake eventfd is never read, so it stays ready and
+		// every reactor sees the stop
+		ev.events = EPOLLIN;
+		ev.data.ptr = &wakeFd;
 
-// Create the POSIX threads that will serve
-// the threadpool
-void createThreads(){
+		if (epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, wakeFd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
 
-	for (int i = 0; i < NUM_HANDLER_THREADS; i++){
-		thread_id[i] = i;
-		pthread_create(&threads[i], NULL, handleRequestLoop, (void *)&thread_id[i]);
+		if (i > 0) pthread_create(&reactors[i].thread, NULL, reactorLoop, &reactors[i]);
+	}
+
+	printf("Serving with %d epoll workers\n", reactorCount);
+
+	reactors[0].thread = pthread_self();
+	reactorLoop(&reactors[0]);
+
+	for (int i = 1; i < reactorCount; i++){
+		pthread_join(reactors[i].thread, NULL);
 	}
 }
 
-// Initialise the application.
-void init(){
-	srand(clock());
-	loadEntries();
-	loadAuthData();
-	mutexInit();
-	createThreads();
-}
-
-// Initialise the mutex locks
-void mutexInit(){	
-	leaderboard_rc = 0;
-	pthread_mutex_init(&leaderboard_rc_mutex, NULL);
-	pthread_mutex_init(&leaderboard_write_mutex, NULL);
-	pthread_mutex_init(&leaderboard_read_mutex, NULL);
-}
-
-// Lock write while reading and unlock write if
-// there are no more readers
-void mutexRead(char a){
-	if (a){
-		pthread_mutex_lock(&leaderboard_read_mutex);
-		pthread_mutex_lock(&leaderboard_rc_mutex);
-		leaderboard_rc++;
-		if (leaderboard_rc == 1) pthread_mutex_lock(&leaderboard_write_mutex);
-		pthread_mutex_unlock(&leaderboard_rc_mutex);
-		pthread_mutex_unlock(&leaderboard_read_mutex);
-	} else {
-		pthread_mutex_lock(&leaderboard_rc_mutex);
-		leaderboard_rc--;
-		if (leaderboard_rc == 0) pthread_mutex_unlock(&leaderboard_write_mutex);
-		pthread_mutex_unlock(&leaderboard_rc_mutex);
+// Wait for socket events and dispatch them
+void *reactorLoop(void *data){
+	struct Reactor *reactor = data;
+	struct epoll_event events[MAX_EVENTS];
+
+	while(1){
+		int n = epoll_wait(reactor->epfd, events, MAX_EVENTS, -1);
+
+		if (n == -1){
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			return NULL;
+		}
+
+		for (int i = 0; i < n; i++){
+			if (events[i].data.ptr == &wakeFd){
+				return NULL;
+			} else if (events[i].data.ptr == NULL){
+				acceptConnections(reactor);
+			} else {
+				handleSessionEvent(reactor, events[i].data.ptr, events[i].events);
+			}
+		}
 	}
 }
 
-// Lock and unlock write and read mutexs
-void mutexWrite(char a){
-	if (a) {
-		pthread_mutex_lock(&leaderboard_read_mutex);
-		pthread_mutex_lock(&leaderboard_write_mutex);
-	} else {
-		pthread_mutex_unlock(&leaderboard_write_mutex);	
-		pthread_mutex_unlock(&leaderboard_read_mutex);
+// Accept pending connections, up to a batch, and register a
+// session for each of them with this reactor. The listening
+// socket stays readable while more are pending.
+void acceptConnections(struct Reactor *reactor){
+	for (int i = 0; i < ACCEPT_BATCH; i++){
+		struct sockaddr_in addr;
+		socklen_t addrSize = sizeof addr;
+		char address[INET_ADDRSTRLEN];
+		struct epoll_event ev;
+		struct Session *session;
+		int fd;
+
+		if ((fd = accept4(sockfd, (struct sockaddr *)&addr, &addrSize, SOCK_NONBLOCK)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+			return;
+		}
+
+		inet_ntop(AF_INET, &addr.sin_addr, address, sizeof address);
+		printf("Server: got connection from %s\n", address);
+
+		if (__atomic_load_n(&sessionsActive, __ATOMIC_RELAXED) >= maxSessions){
+			rejectConnection(fd, 0);
+			continue;
+		}
+
+		if ((session = slabAlloc(&sessionSlab)) == NULL){
+			rejectConnection(fd, 0);
+			continue;
+		}
+
+		memset(session, 0, sizeof *session);
+		__atomic_fetch_add(&sessionsActive, 1, __ATOMIC_RELAXED);
+		session->fd = fd;
+		session->out = session->outInline;
+		session->outCap = SESSION_OUT_INLINE;
+		session->state = SESSION_AWAIT_AUTH;
+		frameReaderInit(&session->reader, session->in, sizeof session->in);
+		session->events = EPOLLIN;
+
+		ev.events = session->events;
+		ev.data.ptr = session;
+
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			__atomic_fetch_sub(&sessionsActive, 1, __ATOMIC_RELAXED);
+			close(fd);
+			slabFree(&sessionSlab, session);
+			continue;
+		}
+
+		// Mirror the blocking server, which greets a client once
+		// a thread picks it up.
+		if (sessionQueue(session, OP_CONNECTED, NULL, 0) == ERROR){
+			sessionClose(session);
+			continue;
+		}
+
+		handleSessionEvent(reactor, session, EPOLLOUT);
 	}
 }
 
-// Listen for a connection from the client, and 
-// add a request to the threadpool after accepting
-void listenForConnection(){
-	while(1){
-		sin_size = sizeof(struct sockaddr_in);
+// Read or write whatever the socket is ready for, then
+// update the events the session is waiting on.
+void handleSessionEvent(struct Reactor *reactor, struct Session *session, unsigned int events){
+	struct Frame frame;
+	int status = 1;
 
-		int fd;
+	if (events & (EPOLLERR | EPOLLHUP)){
+		sessionClose(session);
+		return;
+	}
 
-		if ((fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
-			perror("accept");
-		} else {
+	if ((events & EPOLLIN) && !sessionBacklogged(session)){
+		status = frameReaderFill(&session->reader, session->fd);
 
-			printf("Server: got connection from %s\n", inet_ntoa(their_addr.sin_addr));
-			addRequest(fd, totalRequests++, &request_mutex, &got_request);
+		if (status == 0 || (status == ERROR && errno != EAGAIN && errno != EWOULDBLOCK)){
+			sessionClose(session);
+			return;
+		}
+
+		status = 1;
+	}
 
+	for (;;){
+		// A single read may carry several frames. Those behind a
+		// backlog stay in the reader until it has been sent.
+		while (!session->closeAfterFlush && !sessionBacklogged(session) && (status = frameNext(&session->reader, &frame)) == 1){
+			if (handleSessionMessage(session, &frame) == ERROR){
+				sessionClose(session);
+				return;
+			}
+		}
+
+		if (status == ERROR || sessionFlush(session) == ERROR){
+			sessionClose(session);
+			return;
 		}
 
+		// Frames held back are picked up here once the socket has
+		// taken the backlog, as no more input may arrive for them
+		if (status != 1 || session->closeAfterFlush || sessionBacklogged(session)) break;
+	}
+
+	if (session->outSent == session->outLen && session->closeAfterFlush){
+		sessionClose(session);
+		return;
+	}
+
+	// Stop reading while the client is behind on its replies
+	unsigned int wanted = (sessionBacklogged(session) ? 0 : EPOLLIN) | (session->outSent < session->outLen ? EPOLLOUT : 0);
+
+	if (wanted != session->events){
+		struct epoll_event ev;
 
+		ev.events = wanted;
+		ev.data.ptr = session;
+		session->events = wanted;
 
-	}	
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, session->fd, &ev) == -1){
+			sessionClose(session);
+		}
+	}
 }
 
-// Cleanly deallocate resources. 
-void freeResources(){
-	for(int i = 0; i < max(max(authCount, max(userCount, entryCount)), NUM_HANDLER_THREADS); i++ ){
+// Advance the session state machine by one client message.
+// Every reply is queued, never sent directly, so the handler
+// can never block on a slow client. Returns ERROR when a reply
+// could not be queued and the session should be closed.
+int handleSessionMessage(struct Session *session, struct Frame *frame){
+	unsigned char payload[MAXDATASIZE];
+	unsigned long long start = metricsNow();
+	size_t len;
+
+	// Admin requests are answered in any state, to local peers
+	if (frame->opcode == OP_STATS){
+		char text[FRAME_MAX_PAYLOAD];
+
+		if (isLocalPeer(session->fd)){
+			return sessionQueue(session, OP_STATS_TEXT, text, metricsSummary(text, sizeof text));
+		}
+		return 1;
+	}
+
+	if (frame->opcode == OP_RELOAD){
+		char text[128];
 
-		if(i < entryCount){
-			free(entries[i].object);
-			free(entries[i].objectType);
+		if (isLocalPeer(session->fd)){
+			tablesRequestReload();
+			return sessionQueue(session, OP_STATS_TEXT, text, snprintf(text, sizeof text, "Reload requested, serving generation %lu\n", tablesGeneration));
 		}
+		return 1;
+	}
+
+	switch (session->state){
+		case SESSION_AWAIT_AUTH: {
+			char uname[64], pwd[64];
+			long user = ERROR;
+
+			if (frame->opcode == OP_RESUME){
+				int resumed = claimTicket(frame, uname, &session->ticket, &session->game);
+
+				if (resumed == ERROR){
+					return sessionQueue(session, OP_RESUME_FAILED, NULL, 0);
+				}
 
-		if (i < userCount){
-			free(leaderBoard[i].username);
+				strcpy(session->username, uname);
+				memcpy(payload, session->ticket.id, RESUME_TICKET_SIZE);
+				payload[RESUME_TICKET_SIZE] = resumed;
+				session->state = SESSION_MENU;
+
+				if (sessionQueue(session, OP_AUTH_OK, payload, RESUME_TICKET_SIZE + 1) == ERROR) return ERROR;
+
+				if (resumed){
+					session->state = SESSION_IN_GAME;
+					return sessionQueue(session, OP_GAME_STATE, payload, encodeGameState(payload, &session->game));
+				}
+				return 1;
+			}
+
+			if (frame->opcode == OP_AUTH && parseCredentials(frame, uname, pwd) != ERROR){
+				user = lookupUser(uname, pwd);
+			}
+
+			histogramRecord(&authTime, metricsNow() - start);
+
+			if (user == ERROR){
+				session->closeAfterFlush = 1;
+				return sessionQueue(session, OP_AUTH_FAILED, NULL, 0);
+			}
+
+			// A user the leaderboard can't hold could play but
+			// never be recorded, so they are turned away instead
+			if (addLeaderboardEntry(uname) == ERROR){
+				put32(payload, BUSY_RETRY_MS);
+				session->closeAfterFlush = 1;
+				return sessionQueue(session, OP_BUSY, payload, 4);
+			}
+
+			strcpy(session->username, uname);
+			resumeIssue(uname, &session->ticket);
+			session->state = SESSION_MENU;
+
+			return sessionQueue(session, OP_AUTH_OK, session->ticket.id, session->ticket.held ? RESUME_TICKET_SIZE : 0);
 		}
 
-		if (i < authCount){
-			free(users[i].username);
-			free(users[i].password);
+		case SESSION_MENU:
+			if (frame->opcode == OP_LEADERBOARD){
+				struct LeaderboardReply *reply;
+				int queued;
+
+				if (lbcacheUnchanged(frame->payload, frame->length)){
+					queued = sessionQueue(session, OP_LB_NOT_MODIFIED, frame->payload, 4);
+				} else if ((reply = lbcacheGet())){
+					queued = sessionQueueEncoded(session, reply->data, reply->length, reply->frames);
+					lbcacheRelease(reply);
+				} else {
+					queued = sessionQueue(session, OP_LB_END, NULL, 0);
+				}
+
+				histogramRecord(&leaderboardTime, metricsNow() - start);
+				return queued;
+			} else if (frame->opcode == OP_LB_TOP || frame->opcode == OP_LB_AROUND || frame->opcode == OP_LB_PAGE){
+				struct RankedRow rows[LB_MAX_ROWS];
+				unsigned long total;
+				long count = rankedQuery(frame, session->username, rows, &total);
+
+				for (long i = 0; i < count; i++){
+					len = encodeRankedRow(payload, &rows[i]);
+					if (sessionQueue(session, OP_LB_RANK_ROW, payload, len) == ERROR) return ERROR;
+				}
+
+				put32(payload, total);
+				histogramRecord(&leaderboardTime, metricsNow() - start);
+				return sessionQueue(session, OP_LB_END, payload, count == ERROR ? 0 : 4);
+			} else if (frame->opcode == OP_GAME_START){
+				// With no memory for the game the user is asked to
+				// try again, and stays at the menu
+				if (pickGame(&session->game, session->username, requestedDifficulty(frame)) == ERROR){
+					put32(payload, BUSY_RETRY_MS);
+					return sessionQueue(session, OP_BUSY, payload, 4);
+				}
+
+				len = encodeGameState(payload, &session->game);
+				session->state = SESSION_IN_GAME;
+
+				return sessionQueue(session, OP_GAME_STATE, payload, len);
+			} else if (frame->opcode == OP_QUIT){
+				resumeDrop(&session->ticket);
+				session->closeAfterFlush = 1;
+			}
+		break;
+
+		case SESSION_IN_GAME: {
+			int opcode, result;
+
+			// A game no guess has been spent on yet is given up by
+			// any other request, which is then handled at the menu
+			if (givesUpGame(&session->game, frame)){
+				endGame(&session->game);
+				session->state = SESSION_MENU;
+				return handleSessionMessage(session, frame);
+			}
+
+			result = playGuesses(&session->game, frame, &opcode, payload, &len);
+
+			if (result == ERROR) break;
+
+			// The result is recorded before any reply is queued, so a
+			// session closed for want of memory still counts its game
+			if (result == GAME_WIN){
+				addWinFor(session->username);
+			} else if (result == GAME_LOSS){
+				addLossFor(session->username);
+			}
+
+			int queued = opcode ? sessionQueue(session, opcode, payload, len) : 1;
+
+			if (queued != ERROR && result == GAME_WIN){
+				queued = sessionQueue(session, OP_GAME_WIN, payload, encodePhrase(payload, &session->game));
+			} else if (queued != ERROR && result == GAME_LOSS){
+				queued = sessionQueue(session, OP_GAME_LOSS, NULL, 0);
+			}
+
+			if (result != GAME_CONTINUE){
+				endGame(&session->game);
+				session->state = SESSION_MENU;
+			}
+
+			histogramRecord(&guessTime, metricsNow() - start);
+			return queued;
 		}
+	}
+
+	return 1;
+}
+
+// Append a frame to the session's outgoing buffer
+int sessionQueue(struct Session *session, int opcode, const void *payload, size_t len){
+	size_t size = FRAME_HEADER_SIZE + len;
+
+	if (sessionReserve(session, size) == ERROR) return ERROR;
+
+	session->outLen += frameEncode(session->out + session->outLen, opcode, payload, len);
+	countSent(1, size);
+
+	return 1;
+}
+
+// Queue frames that were encoded ahead of time
+int sessionQueueEncoded(struct Session *session, const void *frames, size_t len, size_t count){
+	if (sessionReserve(session, len) == ERROR) return ERROR;
+
+	memcpy(session->out + session->outLen, frames, len);
+	session->outLen += len;
+	countSent(count, len);
+
+	return 1;
+}
+
+// Whether the client has fallen far enough behind on its
+// replies that no more of its requests should be read
+int sessionBacklogged(struct Session *session){
+	return session->outLen - session->outSent > SESSION_OUT_HIGH;
+}
+
+// Make room for size more bytes in the outgoing buffer
+int sessionReserve(struct Session *session, size_t size){
+	if (session->outSent == session->outLen){
+		session->outSent = session->outLen = 0;
+	}
+
+	if (session->outLen + size > session->outCap){
+		size_t cap = max(session->outCap * 2, MAXDATASIZE);
+		unsigned char *out;
+
+		while (cap < session->outLen + size) cap *= 2;
 
-		if (i < NUM_HANDLER_THREADS){
-			pthread_cancel(threads[i]);
+		if (session->out == session->outInline){
+			if ((out = malloc(cap)) == NULL) return ERROR;
+			memcpy(out, session->outInline, session->outLen);
+		} else if ((out = realloc(session->out, cap)) == NULL){
+			return ERROR;
 		}
 
-	};
+		session->out = out;
+		session->outCap = cap;
+	}
 
-	free(users);
-	free(entries);
-	free(leaderBoard);
+	return 1;
+}
+
+// Send as much of the outgoing buffer as the socket accepts
+int sessionFlush(struct Session *session){
+	unsigned long long start = metricsNow();
+
+	if (session->outSent == session->outLen) return 1;
+
+	while (session->outSent < session->outLen){
+		ssize_t n = send(session->fd, session->out + session->outSent, session->outLen - session->outSent, MSG_NOSIGNAL);
+
+		__atomic_fetch_add(&protocolStats.sendCalls, 1, __ATOMIC_RELAXED);
+
+		if (n == -1){
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			return ERROR;
+		}
+
+		session->outSent += n;
+	}
+
+	// Go back to the inline buffer once a big reply is out
+	if (session->outSent == session->outLen && session->out != session->outInline){
+		free(session->out);
+		session->out = session->outInline;
+		session->outCap = SESSION_OUT_INLINE;
+		session->outSent = session->outLen = 0;
+	}
+
+	histogramRecord(&sendTime, metricsNow() - start);
+
+	return 1;
+}
+
+// Close the connection and release the session.
+// Closing the descriptor also removes it from epoll.
+// A ticket the session holds is kept for a reconnect.
+void sessionClose(struct Session *session){
+	resumeSuspend(&session->ticket, &session->game);
+	__atomic_fetch_sub(&sessionsActive, 1, __ATOMIC_RELAXED);
+	close(session->fd);
+	if (session->out != session->outInline) free(session->out);
+	slabFree(&sessionSlab, session);
+}
+
+// Cleanly deallocate resources. 
+void freeResources(){
+	poolStop(&pool);
+	lobbyStop(&lobby);
+
+	free(reactors);
+	free(workerFds);
+	resumeFree();
+	lbcacheFree();
+	replicaStop();
+	tablesFree();
+	gameFree();
+	slabDestroy(&sessionSlab);
+	leaderboardFree();
 }
 
 // Main loop of the service. 
 // Play the game, show the leaderboard
 // or quit.
-int gameLoop(int new_fd, char *username ) {
+int gameLoop(int new_fd, char *username, struct FrameReader *reader, struct TicketHold *ticket, struct Game *game) {
+	struct Frame frame;
+	unsigned char payload[MAXDATASIZE];
+	int waiting = 0;
+
+	// A resumed game carries on where it was left
+	if (game->words && (waiting = hangmanLoop(new_fd, username, reader, game, &frame)) == ERROR) return ERROR;
+
 	while (1) {
 
-		// Recieve instruction from the client
-		if (recv(new_fd, buf, MAXDATASIZE, 0) <= 0){
+		// Recieve instruction from the client, unless one that
+		// gave up a game is still waiting
+		if (waiting){
+			waiting = 0;
+		} else if (frameRecv(new_fd, reader, &frame) <= 0){
 			close(new_fd);
 			return ERROR;
 		}
 
 		// Based on the instruction, play game, show leaderboard
 		// or quit
-		if (strcmp(buf, "lb-start") == 0){
-			if (leaderboardLoop(new_fd) == ERROR) return ERROR;
-		} else if (strcmp(buf, "hm-start") == 0){
-			if (hangmanLoop(new_fd, username) == ERROR ) return ERROR;
-		} else if (strcmp(buf, "") == 0){
+		if (frame.opcode == OP_STATS){
+			if (sendStats(new_fd) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_RELOAD){
+			if (sendReload(new_fd) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_LEADERBOARD){
+			if (leaderboardLoop(new_fd, &frame) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_LB_TOP || frame.opcode == OP_LB_AROUND || frame.opcode == OP_LB_PAGE){
+			if (rankedLeaderboardLoop(new_fd, username, &frame) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_GAME_START){
+			// With no memory for the game the user is asked to
+			// try again, and stays at the menu
+			if (pickGame(game, username, requestedDifficulty(&frame)) == ERROR){
+				put32(payload, BUSY_RETRY_MS);
+				if (frameSend(new_fd, OP_BUSY, payload, 4) == ERROR){
+					close(new_fd);
+					return ERROR;
+				}
+				continue;
+			}
+
+			// Send the game screen to the client
+			if (frameSend(new_fd, OP_GAME_STATE, payload, encodeGameState(payload, game)) == ERROR) { 
+				close(new_fd); 
+				return ERROR;
+			}
+
+			if ((waiting = hangmanLoop(new_fd, username, reader, game, &frame)) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_QUIT){
+			resumeDrop(ticket);
 			close(new_fd);
 			return 1;
 		}
@@ -457,130 +1107,254 @@ int gameLoop(int new_fd, char *username ) {
 	//{ close(new_fd); }
 }
 
-// Play the hangman game with the client
-int hangmanLoop(int new_fd, char *username ) {
-
-	struct Entry pair = entries[rand() % entryCount];
-	int guesses = min((int) strlen(pair.object) + (int) strlen(pair.objectType) + 10, 26);
-	int lettersLeft = strlen(pair.object) + strlen(pair.objectType);
-	char *words = malloc(strlen(pair.object) + strlen(pair.objectType) + 1);
-	char _buf[MAXDATASIZE];
-	char guessedLetters[26] = "\0";
-
-	// Generate the ____ _____ string
-	memset(words, '_', strlen(pair.objectType));
-	memset(words + strlen(pair.objectType), ' ', 1);
-	memset(words + strlen(pair.objectType) + 1, '_', strlen(pair.object));
-	memset(words + strlen(pair.objectType) + 1 + strlen(pair.object), '\0', 1);
+// Start a game of a phrase the user hasn't seen lately. The
+// game holds on to the dictionary it was dealt from until it ends.
+// Returns ERROR if there was no memory for the game.
+int pickGame(struct Game *game, char *username, int difficulty){
+	struct Tables *tables = tablesAcquire();
+	size_t entry = selectEntry(&tables->dictionary, difficulty, findLeaderboardEntry(username));
 
-	// Send the game screen to the client
-	sprintf(_buf, "%d&%s", guesses, words);
-	if (send(new_fd, _buf, sizeof _buf, 0) == -1) { 
-		close(new_fd); 
-		free(words); 
+	if (startGame(game, &tables->dictionary, entry) == ERROR){
+		tablesRelease(tables);
 		return ERROR;
 	}
 
+	game->tables = tables;
+	return 1;
+}
+
+// The difficulty a game start asks for. The byte is optional,
+// and older clients send none.
+int requestedDifficulty(struct Frame *frame){
+	return frame->length >= 1 ? frame->payload[0] : DIFFICULTY_ANY;
+}
+
+// Play the hangman game with the client. If the connection
+// drops, the game is left for the caller to suspend. Returns 0
+// once the game is over, or 1 if a request gave it up, leaving
+// the request in frame.
+int hangmanLoop(int new_fd, char *username, struct FrameReader *reader, struct Game *game, struct Frame *frame) {
+
+	unsigned char payload[MAXDATASIZE];
+	unsigned char out[2 * (FRAME_HEADER_SIZE + MAXDATASIZE)];
+	int result = GAME_CONTINUE, opcode;
+	unsigned long long start;
+	size_t length, outLength, frames;
+
 	// Play the game
-	while(guesses > 0){
-		if(recv(new_fd, _buf, MAXDATASIZE, 0) <= 0) { 
+	while(result == GAME_CONTINUE){
+		if(frameRecv(new_fd, reader, frame) <= 0) { 
 			close(new_fd); 
-			free(words);
 			return ERROR;
 		}
 
-		_buf[1] = '\0';
-		
-		if (!strchr(guessedLetters, _buf[0])){
-
-			strcat(guessedLetters, &_buf[0]);
+		start = metricsNow();
+		result = playGuesses(game, frame, &opcode, payload, &length);
 
-			for (int i = 0; i < strlen(pair.objectType); i++){
-				if (_buf[0] == pair.objectType[i]){
-					memset(words + i, _buf[0], 1);
-					lettersLeft--;
-				}
-			}
+		// A game no guess has been spent on yet is given up by
+		// any other request, which is left for the caller
+		if (result == ERROR && givesUpGame(game, frame)){
+			endGame(game);
+			return 1;
+		}
 
-			for (int i = 0; i < strlen(pair.object); i++) {
-				if (_buf[0] == pair.object[i]){
-					memset(words + i + 1 + strlen(pair.objectType), _buf[0], 1);
-					lettersLeft--;
-				}
-			}
+		// Anything else but a guess is ignored
+		if (result == ERROR){
+			result = GAME_CONTINUE;
+			continue;
 		}
 
-		guesses--;
+		histogramRecord(&guessTime, metricsNow() - start);
 
-		// If any of the 'finished' criteria are met, send either a loss or a win
-		// else send the word to the client and keep playing
-		if (lettersLeft <= 0){
-			if (send(new_fd, "hm-win", sizeof("hm-win"), 0) == -1) { 
-				close(new_fd); 
-				free(words);
-				return ERROR;
-			}
+		// Send the state or the batch results, then either a loss
+		// or a win if any of the 'finished' criteria are met,
+		// all in one write
+		outLength = frames = 0;
 
-			if(recv(new_fd, _buf, MAXDATASIZE, 0) <= 0) { 
-				close(new_fd); 
-				free(words);
-				return ERROR;
-			}
-
-			sprintf(_buf, "%s %s", pair.objectType, pair.object);
-
-			if (send(new_fd, _buf, sizeof(_buf), 0) == -1) {
-				close(new_fd); 
-				free(words);
-				return ERROR;
-			}
+		if (opcode){
+			outLength += frameEncode(out, opcode, payload, length);
+			frames++;
+		}
 
+		if (result == GAME_WIN){
+			outLength += frameEncode(out + outLength, OP_GAME_WIN, payload, encodePhrase(payload, game));
+			frames++;
 			addWinFor(username);
-			break;
-		} else if (guesses > 0){
-			sprintf(_buf, "%d&%s", guesses, words);
-			if (send(new_fd, _buf, sizeof _buf, 0) == -1) { 
-				close(new_fd); 
-				free(words);
-				return ERROR;
-			}
-		} else if (guesses <= 0) {
-			if (send(new_fd, "hm-loss", sizeof("hm-loss"), 0) == -1) { 
-				close(new_fd); 
-				free(words);
-				return ERROR;
-			}
+		} else if (result == GAME_LOSS){
+			outLength += frameEncode(out + outLength, OP_GAME_LOSS, NULL, 0);
+			frames++;
 			addLossFor(username);
-			break;
-		} 
+		}
+
+		if (sendEncoded(new_fd, out, outLength, frames) == ERROR) { 
+			close(new_fd); 
+			return ERROR;
+		}
 	}
 
 	// Free the dynamically allocated data
-	free(words);
-	return 1;
+	endGame(game);
+	return 0;
 
 }
 
-// Send the leaderboard to the client.
-int leaderboardLoop(int new_fd){
+// Send the leaderboard to the client, in one write of the
+// cached reply, or tell it the copy it has is still current.
+int leaderboardLoop(int new_fd, struct Frame *frame){
+	struct LeaderboardReply *reply;
+	unsigned long long start = metricsNow();
+	int status;
+
+	if (lbcacheUnchanged(frame->payload, frame->length)){
+		status = frameSend(new_fd, OP_LB_NOT_MODIFIED, frame->payload, 4);
+	} else if ((reply = lbcacheGet())){
+		status = sendEncoded(new_fd, reply->data, reply->length, reply->frames);
+		lbcacheRelease(reply);
+	} else {
+		status = frameSend(new_fd, OP_LB_END, NULL, 0);
+	}
 
-	for (int i = 0; i < userCount; i++){
-		sprintf(buf, "%s&%d&%d", leaderBoard[i].username, leaderBoard[i].gamesPlayed, leaderBoard[i].gamesWon);
+	if (status == ERROR) { 
+		close(new_fd); 
+		return ERROR;
+	}
 
-		if (send(new_fd, buf, sizeof buf, 0) == -1) { 
-			close(new_fd); 
-			return ERROR;
-		}
+	histogramRecord(&leaderboardTime, metricsNow() - start);
+	return 1;
+}
+
+// Send the rows a ranked leaderboard query asked for,
+// followed by the number of ranked users, in one write.
+int rankedLeaderboardLoop(int new_fd, char *username, struct Frame *frame){
+	unsigned char payload[MAXDATASIZE];
+	unsigned char out[(LB_MAX_ROWS + 1) * (FRAME_HEADER_SIZE + 12 + 64)];
+	struct RankedRow rows[LB_MAX_ROWS];
+	unsigned long total;
+	unsigned long long start = metricsNow();
+	long count = rankedQuery(frame, username, rows, &total);
+	size_t length = 0;
+
+	for (long i = 0; i < count; i++){
+		length += frameEncode(out + length, OP_LB_RANK_ROW, payload, encodeRankedRow(payload, &rows[i]));
 	}
 
-	if (send(new_fd, "lb-end", sizeof("lb-end"), 0) == -1) { 
+	put32(payload, total);
+	length += frameEncode(out + length, OP_LB_END, payload, count == ERROR ? 0 : 4);
+
+	if (sendEncoded(new_fd, out, length, count == ERROR ? 1 : count + 1) == ERROR) { 
 		close(new_fd); 
 		return ERROR;
 	}
 
+	histogramRecord(&leaderboardTime, metricsNow() - start);
 	return 1;
 }
 
+// Run a top N, around me or page query against the
+// rankings. Returns the number of rows, or ERROR if the
+// query is malformed.
+long rankedQuery(struct Frame *frame, char *username, struct RankedRow *rows, unsigned long *total){
+	struct LeaderBoard *me;
+	unsigned long count, page;
+
+	*total = 0;
+
+	switch (frame->opcode){
+		case OP_LB_TOP:
+			if (frame->length != 2) return ERROR;
+			count = min((frame->payload[0] << 8) | frame->payload[1], LB_MAX_ROWS);
+			return rankedRange(0, count, rows, total);
+
+		case OP_LB_AROUND:
+			if (frame->length != 2 || (me = findLeaderboardEntry(username)) == NULL) return ERROR;
+			count = min((frame->payload[0] << 8) | frame->payload[1], LB_MAX_ROWS / 2 - 1);
+			return rankedAround(me, count, rows, total);
+
+		case OP_LB_PAGE:
+			if (frame->length != 6) return ERROR;
+			page = get32(frame->payload);
+			count = min((frame->payload[4] << 8) | frame->payload[5], LB_MAX_ROWS);
+			if (count == 0) return ERROR;
+			return rankedRange(page * count, count, rows, total);
+	}
+
+	return ERROR;
+}
+
+// Ranked row payload: rank, plays, wins, then the username
+size_t encodeRankedRow(unsigned char *out, struct RankedRow *row){
+	size_t len = strlen(row->entry->username);
+
+	put32(out, row->rank);
+	put32(out + 4, row->results >> 32);
+	put32(out + 8, row->results & 0xffffffff);
+	memcpy(out + 12, row->entry->username, len);
+
+	return len + 12;
+}
+
+// Game state payload: guesses left, then the masked phrase
+size_t encodeGameState(unsigned char *out, struct Game *game){
+	out[0] = game->guesses;
+	memcpy(out + 1, game->words, game->length);
+
+	return game->length + 1;
+}
+
+// Phrase payload: the full "type object" phrase
+size_t encodePhrase(unsigned char *out, struct Game *game){
+	memcpy(out, game->phrase, game->length);
+
+	return game->length;
+}
+
+// Play a guess or a batch of guesses. A single guess is answered
+// with the new game state, unless it ended the game; a batch with
+// the outcome of each guess it got through and the state it left.
+// The reply goes in out, with its opcode, or 0 if there is none.
+// Returns the game result, or ERROR if the frame isn't a guess.
+int playGuesses(struct Game *game, struct Frame *frame, int *opcode, unsigned char *out, size_t *len){
+	int result = GAME_CONTINUE, count = 0;
+
+	if (frame->opcode == OP_GUESS && frame->length == 1){
+		result = guessLetter(game, frame->payload[0]);
+		*opcode = result == GAME_CONTINUE ? OP_GAME_STATE : 0;
+		*len = encodeGameState(out, game);
+		return result;
+	}
+
+	if (frame->opcode != OP_GUESS_BATCH || frame->length == 0) return ERROR;
+
+	while (result == GAME_CONTINUE && count < (int) frame->length && count < GUESS_BATCH_MAX){
+		char letter = frame->payload[count];
+		unsigned int bit = letter >= 'a' && letter <= 'z' ? 1u << (letter - 'a') : 0;
+
+		out[3 + count++] = game->guessed & bit ? OUTCOME_REPEAT : game->letters & bit ? OUTCOME_HIT : OUTCOME_MISS;
+		result = guessLetter(game, letter);
+	}
+
+	out[0] = result == GAME_WIN ? BATCH_WON : result == GAME_LOSS ? BATCH_LOST : BATCH_PLAYING;
+	out[1] = game->guesses;
+	out[2] = count;
+	memcpy(out + 3 + count, game->words, game->length);
+
+	*opcode = OP_GUESS_RESULTS;
+	*len = 3 + count + game->length;
+
+	return result;
+}
+
+// Whether a request gives up the game in progress: only one
+// no guess has been spent on yet, so a client can deal the next
+// game ahead of time and still go elsewhere from the menu. A
+// guess of anything but a-z sets no bit in the guessed mask, so
+// the guesses left are compared with the game's allowance.
+int givesUpGame(struct Game *game, struct Frame *frame){
+	int allowance = dictGuesses(game->pair.objectLength + game->pair.typeLength);
+
+	return game->guesses == allowance && frame->opcode != OP_GUESS && frame->opcode != OP_GUESS_BATCH;
+}
+
 void startServer() {
 
 	// Create the socket
@@ -603,7 +1377,7 @@ void startServer() {
 	}
 
 	/* start listening */
-	if (listen(sockfd, BACKLOG) == -1) {
+	if (listen(sockfd, backlog) == -1) {
 		perror("listen");
 		exit(1);
 	}
@@ -611,124 +1385,322 @@ void startServer() {
 	printf("Server started on port %d\n", port);
 }
 
-// Load the hangman file and correctly tokenise the entries
-void loadEntries(){
-	FILE *fp;
-	char buff[128];
-	fp = fopen(HANGMAN_FILE, "r");
+// Load the hangman phrases, either by mapping a dictionary
+// compiled with dictc or by compiling the text file
+int loadEntries(struct Dictionary *dictionary){
+	struct timespec start, end;
+	int status;
 
-	entryCount = 1;
-	int ch = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	while((ch = fgetc(fp)) != EOF){
-		if (ch == '\n') entryCount++;
+	if (dictionaryFile){
+		status = dictionaryMap(dictionary, dictionaryFile);
+	} else {
+		status = dictionaryLoadText(dictionary, HANGMAN_FILE);
 	}
 
-	rewind(fp);
+	if (status == ERROR){
+		fprintf(stderr, "Could not load dictionary %s\n", dictionaryFile ? dictionaryFile : HANGMAN_FILE);
+		return ERROR;
+	}
 
-	entries = malloc(entryCount * sizeof(struct Entry));
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	for (int i = 0; i < entryCount; i++){
+	printf("Loaded %zu phrases from %s in %.2f ms\n", dictionary->entryCount,
+		dictionaryFile ? dictionaryFile : HANGMAN_FILE,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
 
-		char object[64];
-		char objectType[64];
+	return 1;
+}
 
-		fscanf(fp, "%s", buff);
-		strcpy(object, strtok(buff, ","));
-		strcpy(objectType, strtok(NULL, ","));
+// Load the credential store, mapping a compiled one if given
+// or hashing the authentication file otherwise
+int loadAuthData(struct Credentials *credentials){
+	struct timespec start, end;
+	int status;
 
-		entries[i].object = malloc(strlen(object) + 1);
-		entries[i].objectType = malloc(strlen(objectType) + 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-		strcpy(entries[i].object, object);
-		strcpy(entries[i].objectType, objectType);
+	if (credentialsFile){
+		status = credentialsMap(credentials, credentialsFile);
+	} else {
+		status = credentialsLoadText(credentials, AUTH_FILE);
+	}
 
+	if (status == ERROR){
+		fprintf(stderr, "Could not load credentials %s\n", credentialsFile ? credentialsFile : AUTH_FILE);
+		return ERROR;
 	}
 
-	fclose(fp);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("Loaded %zu accounts from %s in %.2f ms\n", credentials->userCount,
+		credentialsFile ? credentialsFile : AUTH_FILE,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+	return 1;
 }
 
-// Load the authentication file for authenticating users
-void loadAuthData(){
-	FILE *fp;
+// Load one generation of the dictionary and accounts, at
+// startup and again on every reload
+int loadTables(struct Tables *tables){
+	if (loadEntries(&tables->dictionary) == ERROR) return ERROR;
 
-	// Open a stream to the file
-	fp = fopen(AUTH_FILE, "r");
+	if (loadAuthData(&tables->credentials) == ERROR){
+		dictionaryFree(&tables->dictionary);
+		return ERROR;
+	}
+
+	return 1;
+}
+
+// Recv auth data from the client and try to authenticate,
+// or resume a session the client has a ticket for
+int recvAuthDataAndAuthenticate(char *_buf, int new_fd, struct FrameReader *reader, struct TicketHold *ticket, struct Game *game) {
+	
+	struct Frame frame;
+	char uname[64], pwd[64];
+	int status;
 
-	authCount = 1;
-	int ch = 0;
+	while (1) {
+		if (frameRecv(new_fd, reader, &frame) <= 0) { 
+			close(new_fd); 
+			return -1;
+		}
 
-	while((ch = fgetc(fp)) != EOF){
-		if (ch == '\n') authCount++;
+		if (frame.opcode == OP_STATS){
+			if (sendStats(new_fd) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_RELOAD){
+			if (sendReload(new_fd) == ERROR) return ERROR;
+		} else if (frame.opcode == OP_RESUME){
+			// A refused ticket leaves the client free to log in
+			if ((status = resumeUser(_buf, new_fd, &frame, ticket, game)) != 0) return status;
+		} else {
+			break;
+		}
 	}
 
-	rewind(fp);
+	if (frame.opcode != OP_AUTH || parseCredentials(&frame, uname, pwd) == ERROR){
+		uname[0] = pwd[0] = '\0';
+	}
 
-	users = malloc(authCount * sizeof(struct User));
+	return authenticateUser(_buf, new_fd, pwd, uname, ticket);
+}
+
+// Claim the ticket in a resume payload for the user it names.
+// Returns 1 if a suspended game was handed over, 0 if not, or
+// ERROR if the ticket can't be used.
+int claimTicket(struct Frame *frame, char *uname, struct TicketHold *ticket, struct Game *game){
+	size_t length = frame->length - RESUME_TICKET_SIZE;
 
-	for (int i = 0; i < authCount; i++){
+	if (frame->length <= RESUME_TICKET_SIZE || length >= 64) return ERROR;
 
-		char username[64], password[64];
+	memcpy(uname, frame->payload + RESUME_TICKET_SIZE, length);
+	uname[length] = '\0';
+
+	return resumeClaim(frame->payload, uname, ticket, game);
+}
+
+// Resume a session on the blocking path. The new ticket and any
+// game in progress go out together in one write. Returns 1 once
+// resumed, 0 if the ticket was refused, or ERROR.
+int resumeUser(char *_buf, int new_fd, struct Frame *frame, struct TicketHold *ticket, struct Game *game){
+	unsigned char payload[MAXDATASIZE];
+	unsigned char out[2 * (FRAME_HEADER_SIZE + MAXDATASIZE)];
+	char uname[64];
+	size_t outLength;
+	int resumed = claimTicket(frame, uname, ticket, game);
+
+	if (resumed == ERROR){
+		if (frameSend(new_fd, OP_RESUME_FAILED, NULL, 0) == ERROR){
+			close(new_fd);
+			return ERROR;
+		}
+		return 0;
+	}
 
-		fscanf(fp, "%s", username);
-		fscanf(fp, "%s", password);
+	strcpy(_buf, uname);
 
-		users[i].username = malloc(strlen(username) + 1);
-		users[i].password = malloc(strlen(password) + 1);
+	memcpy(payload, ticket->id, RESUME_TICKET_SIZE);
+	payload[RESUME_TICKET_SIZE] = resumed;
+	outLength = frameEncode(out, OP_AUTH_OK, payload, RESUME_TICKET_SIZE + 1);
 
-		strcpy(users[i].username, username);
-		strcpy(users[i].password, password);
+	if (resumed) outLength += frameEncode(out + outLength, OP_GAME_STATE, payload, encodeGameState(payload, game));
 
+	if (sendEncoded(new_fd, out, outLength, 1 + resumed) == ERROR){
+		close(new_fd);
+		return ERROR;
 	}
 
-	fclose(fp);
+	return 1;
 }
 
-// Recv auth data from the client and try to authenticate
-int recvAuthDataAndAuthenticate(char *_buf, int new_fd) {
-	
-	char buf[MAXDATASIZE];
+// Split an auth payload into its username and password.
+// Both are copied out so they are NUL terminated.
+int parseCredentials(struct Frame *frame, char *uname, char *pwd){
+	unsigned char *split = memchr(frame->payload, '\0', frame->length);
+	size_t unameLength, pwdLength;
 
-	if (recv(new_fd, buf, MAXDATASIZE, 0) <= 0) { 
-		close(new_fd); 
-		return -1;
+	if (split == NULL) return ERROR;
+
+	unameLength = split - frame->payload;
+	pwdLength = frame->length - unameLength - 1;
+
+	if (unameLength == 0 || unameLength >= 64 || pwdLength >= 64) return ERROR;
+
+	memcpy(uname, frame->payload, unameLength);
+	uname[unameLength] = '\0';
+	memcpy(pwd, split + 1, pwdLength);
+	pwd[pwdLength] = '\0';
+
+	return 1;
+}
+
+// Find the user matching the credentials. Returns their
+// slot in the credential store, or ERROR if there is no match.
+long lookupUser(char *uname, char *pwd){
+	struct Tables *tables = tablesAcquire();
+	long user = credentialsCheck(&tables->credentials, uname, pwd);
+
+	tablesRelease(tables);
+	return user;
+}
+
+// Authenticate the user, answering with exactly one message
+int authenticateUser(char *_buf, int new_fd, char *pwd, char *uname, struct TicketHold *ticket){
+	unsigned long long start = metricsNow();
+	long user = lookupUser(uname, pwd);
+
+	histogramRecord(&authTime, metricsNow() - start);
+
+	if (user == ERROR){
+		frameSend(new_fd, OP_AUTH_FAILED, NULL, 0);
+		close(new_fd);
+		strcpy(_buf, "_failed_");
+		return ERROR;
 	}
 
-	return authenticateUser(_buf, new_fd, strtok(NULL, ""), strtok(buf, "&"));
+	if (addLeaderboardEntry(uname) == ERROR){
+		unsigned char retry[4];
+
+		put32(retry, BUSY_RETRY_MS);
+		frameSend(new_fd, OP_BUSY, retry, sizeof retry);
+		close(new_fd);
+		strcpy(_buf, "_failed_");
+		return ERROR;
+	}
+
+	resumeIssue(uname, ticket);
+
+	if (frameSend(new_fd, OP_AUTH_OK, ticket->id, ticket->held ? RESUME_TICKET_SIZE : 0) == ERROR) { 
+		close(new_fd);
+		return ERROR; 
+	}
+
+	strcpy(_buf, uname);
+	return 1;
+}
+
+// Register every metric, and serve them on the admin port
+// if one was given
+void initMetrics(){
+	metricsHistogram(&queueWaitTime, "queue_wait", "Time from accept until a pool thread takes the connection");
+	metricsHistogram(&authTime, "auth", "Time to check a login");
+	metricsHistogram(&guessTime, "guess", "Server time to apply a guess and build the reply");
+	metricsHistogram(&sendTime, "send", "Time spent in send calls per reply");
+	metricsHistogram(&leaderboardTime, "leaderboard", "Time to build and hand over a leaderboard");
+
+	metricsGauge("sessions_active", "Connected sessions", &sessionsActive, NULL);
+	metricsGauge("queue_depth", "Connections waiting for a pool thread", NULL, requestQueueDepth);
+	metricsCounter("leaderboard_builds", "Times the leaderboard reply was encoded", &lbcacheBuilds);
+	metricsCounter("leaderboard_cache_hits", "Leaderboard replies served as they were cached", &lbcacheHits);
+	metricsCounter("leaderboard_not_modified", "Leaderboard requests answered not modified", &lbcacheNotModified);
+	metricsCounter("connections_rejected", "Connections turned away with OP_BUSY", &connectionsRejected);
+	metricsCounter("queue_notices", "Queue position notices sent to waiting clients", &lobby.notices);
+	metricsGauge("pool_threads", "Live pool threads", &pool.stats.threads, NULL);
+	metricsCounter("pool_steals", "Connections a pool thread took from another CPU's queue", &pool.stats.steals);
+	metricsCounter("games_started", "Games started", &gamesStarted);
+	metricsCounter("games_won", "Games won", &gamesWon);
+	metricsCounter("games_lost", "Games lost", &gamesLost);
+	metricsCounter("guesses", "Guesses made", &guessesMade);
+	metricsCounter("pool_grows", "Times the pool grew", &pool.stats.grows);
+	metricsCounter("pool_shrinks", "Times the pool shrank", &pool.stats.shrinks);
+	metricsCounter("tickets_issued", "Resumption tickets issued at login", &ticketsIssued);
+	metricsCounter("tickets_resumed", "Sessions resumed from a ticket", &ticketsResumed);
+	metricsCounter("tickets_expired", "Tickets that expired unused", &ticketsExpired);
+	metricsGauge("tickets_live", "Tickets held or waiting for a reconnect", &ticketsLive, NULL);
+	metricsGauge("memory_session_bytes", "Bytes of session records carved from the system", &sessionSlab.bytes, NULL);
+	metricsGauge("memory_game_bytes", "Bytes of game arena carved from the system", NULL, gameArenaBytes);
+	metricsGauge("memory_ticket_bytes", "Bytes of tickets carved from the system", &ticketSlab.bytes, NULL);
+	metricsGauge("tables_generation", "Dictionary and accounts generation being dealt from", &tablesGeneration, NULL);
+	metricsGauge("tables_retired", "Replaced generations still held by games", &tablesRetired, NULL);
+	metricsGauge("replica_links", "Peers this server is gossiping to", &replicaStats.linksUp, NULL);
+	metricsCounter("replica_users_sent", "Users' counters sent to peers", &replicaStats.recordsSent);
+	metricsCounter("replica_merged", "Counters raised by a peer's copy", &replicaStats.merged);
+	metricsCounter("replica_refused", "Peer records for users without an account here", &replicaStats.refused);
+	metricsCounter("reloads", "Dictionary and account reloads", &tablesReloads);
+	metricsCounter("reload_failures", "Reloads that kept the old tables", &tablesReloadFailures);
+
+	sendObserver = observeSend;
+
+	if (adminPort && metricsServe(adminPort) == ERROR){
+		perror("admin port");
+		exit(1);
+	}
+
+	if (adminPort) printf("Serving metrics on 127.0.0.1:%d\n", adminPort);
 }
 
-// Authenticate the user
-int authenticateUser(char *_buf, int new_fd, char *pwd, char *uname){
+// Record the time a blocking send took
+void observeSend(unsigned long long nanos){
+	histogramRecord(&sendTime, nanos);
+}
 
+// Connections waiting in the pool's queue, 0 in epoll mode
+unsigned long requestQueueDepth(){
+	return serverMode == MODE_POOL && pool.shards ? poolDepth(&pool) : 0;
+}
 
-	for (int i = 1; i < authCount; i++){
+// Whether a socket's peer is on this machine
+int isLocalPeer(int fd){
+	struct sockaddr_in addr;
+	socklen_t size = sizeof addr;
 
-		if (strcmp(users[i].username, uname) == 0){
-			if (strcmp(users[i].password, pwd) == 0){
-				addLeaderboardEntry(users[i].username);
-				if (send(new_fd, "success", sizeof("success"), 0) == -1) { 
-					close(new_fd);
-					return ERROR; 
-				}
+	if (getpeername(fd, (struct sockaddr *) &addr, &size) == -1 || addr.sin_family != AF_INET) return 0;
 
-				strcpy(_buf, users[i].username);
-				return 1; 
+	return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
 
-			} else {
-				if (send(new_fd, "failed", sizeof("failed"), 0) == -1) { 
-					close(new_fd);
-					return ERROR; 
-				}
-				strcpy(_buf, "_failed_");
-			}
-		}
+// Answer an admin request on the blocking path. Requests from
+// other machines are ignored.
+int sendStats(int new_fd){
+	char text[FRAME_MAX_PAYLOAD];
+
+	if (!isLocalPeer(new_fd)) return 1;
+
+	if (frameSend(new_fd, OP_STATS_TEXT, text, metricsSummary(text, sizeof text)) == ERROR){
+		close(new_fd);
+		return ERROR;
 	}
-	if (send(new_fd, "failed", sizeof("failed"), 0) == -1) { 
+
+	return 1;
+}
+
+// Ask for a reload on behalf of an admin on the blocking path.
+// Requests from other machines are ignored.
+int sendReload(int new_fd){
+	char text[128];
+
+	if (!isLocalPeer(new_fd)) return 1;
+
+	tablesRequestReload();
+
+	if (frameSend(new_fd, OP_STATS_TEXT, text, snprintf(text, sizeof text, "Reload requested, serving generation %lu\n", tablesGeneration)) == ERROR){
 		close(new_fd);
-		return -1; 
+		return ERROR;
 	}
-	strcpy(_buf, "_failed_");
-	return -1;
+
+	return 1;
 }
 
 // Find the smaller of two numbers
@@ -741,12 +1713,66 @@ int max(int a, int b){
 	return (a > b ? a : b);
 }
 
-// Handle a SIGINT (Ctrl - C) interrupt. Free memory and close
-// connections so the port isn't bound.
+// Handle a SIGINT (Ctrl - C) interrupt by waking the shutdown
+// thread. Safe to call from a signal handler.
 void handleInterrupt(){
+	sem_post(&interrupted);
+}
+
+// Wait for an interrupt, then stop the reactors or the listener
+// and wake any pool worker blocked on its client. The main
+// thread finishes the shutdown once they have all returned.
+void *shutdownLoop(void *data){
+	unsigned long long one = 1;
+
+	while (sem_wait(&interrupted) == -1){
+		if (errno != EINTR) return NULL;
+	}
+
 	printf("\n\nInterrupt recieved. Closing connection.\n\n");
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+
+	if (write(wakeFd, &one, sizeof one) == -1) perror("write");
+
+	for (int i = 0; workerFds && i < pool.max; i++){
+		int fd = __atomic_load_n(&workerFds[i], __ATOMIC_SEQ_CST);
+
+		if (fd != -1) shutdown(fd, SHUT_RDWR);
+	}
+
+	return NULL;
+}
+
+// Wait for every thread that records results, then commit the
+// journal, print stats and free memory so the port isn't bound.
+void shutdownServer(){
+	if (serverMode == MODE_POOL) poolJoin(&pool);
+
+	// Stopping replication forgets the node, so its stats go first
+	printReplicaStats(stdout);
+	replicaStop();
+	journalClose();
+
+	printJournalStats(stdout);
+	printProtocolStats(stdout);
+	if (serverMode == MODE_POOL){
+		printf("Request queue: %lu waiting\n", poolDepth(&pool));
+		printPoolStats(&pool, stdout);
+	}
+	if (guessesMade > 0){
+		printf("%lu games, %lu guesses: %.1f bytes and %.2f send calls per guess\n",
+			gamesStarted, guessesMade,
+			(double) (protocolStats.bytesSent + protocolStats.bytesRecv) / guessesMade,
+			(double) protocolStats.sendCalls / guessesMade);
+	}
 	freeResources();
 	close(sockfd);
 	printf("Memory successfully free'd and socket closed... Exiting.\n");
-	exit(1);
+}
+
+// Handle a SIGHUP by reloading the dictionary and accounts
+// on the reload thread
+void handleHangup(){
+	tablesRequestReload();
 }
@@ -0,0 +1,183 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Slab allocator
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define ERROR -1
+
+// Room at the start of a chunk for its link, keeping objects aligned
+#define CHUNK_HEADER ((sizeof(struct SlabChunk) + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1))
+
+// A thread's free objects for one slab, linked through their
+// first word
+struct Magazine {
+	struct Slab *slab;
+	void *head;
+	unsigned int count;
+};
+
+static inline void *nextOf(void *object){
+	return *(void **) object;
+}
+
+static inline void setNext(void *object, void *next){
+	*(void **) object = next;
+}
+
+// Give a thread's objects back when it exits
+static void returnMagazine(void *data){
+	struct Magazine *magazine = data;
+	struct Slab *slab = magazine->slab;
+
+	if (magazine->head){
+		void *tail = magazine->head;
+
+		while (nextOf(tail)) tail = nextOf(tail);
+
+		pthread_mutex_lock(&slab->mutex);
+		setNext(tail, slab->free);
+		slab->free = magazine->head;
+		pthread_mutex_unlock(&slab->mutex);
+	}
+
+	free(magazine);
+}
+
+// The calling thread's magazine, made on first use
+static struct Magazine *magazineFor(struct Slab *slab){
+	struct Magazine *magazine = pthread_getspecific(slab->key);
+
+	if (magazine == NULL && (magazine = calloc(1, sizeof *magazine))){
+		magazine->slab = slab;
+		pthread_setspecific(slab->key, magazine);
+	}
+
+	return magazine;
+}
+
+// Carve a new chunk onto the shared free list. Called with the
+// lock held.
+static int carve(struct Slab *slab){
+	struct SlabChunk *chunk = malloc(SLAB_CHUNK_BYTES);
+	unsigned char *object;
+
+	if (chunk == NULL) return ERROR;
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->bytes += SLAB_CHUNK_BYTES;
+
+	object = (unsigned char *) chunk + CHUNK_HEADER;
+
+	for (size_t i = 0; i < slab->perChunk; i++, object += slab->size){
+		setNext(object, slab->free);
+		slab->free = object;
+	}
+
+	return 1;
+}
+
+// Set up an empty slab of objects of the given size
+int slabInit(struct Slab *slab, const char *name, size_t size){
+	memset(slab, 0, sizeof *slab);
+
+	if (size < sizeof(void *)) size = sizeof(void *);
+
+	slab->name = name;
+	slab->size = (size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+	slab->perChunk = (SLAB_CHUNK_BYTES - CHUNK_HEADER) / slab->size;
+
+	if (slab->perChunk == 0 || pthread_key_create(&slab->key, returnMagazine) != 0) return ERROR;
+
+	pthread_mutex_init(&slab->mutex, NULL);
+
+	return 1;
+}
+
+// Take an object, or NULL if there is no memory. Its contents
+// are whatever was left in it.
+void *slabAlloc(struct Slab *slab){
+	struct Magazine *magazine = magazineFor(slab);
+	void *object;
+
+	if (magazine == NULL) return NULL;
+
+	if (magazine->head == NULL){
+		pthread_mutex_lock(&slab->mutex);
+
+		if (slab->free == NULL) carve(slab);
+
+		while (slab->free && magazine->count < SLAB_MAGAZINE){
+			object = slab->free;
+			slab->free = nextOf(object);
+			setNext(object, magazine->head);
+			magazine->head = object;
+			magazine->count++;
+		}
+
+		pthread_mutex_unlock(&slab->mutex);
+
+		if (magazine->head == NULL) return NULL;
+	}
+
+	object = magazine->head;
+	magazine->head = nextOf(object);
+	magazine->count--;
+
+	return object;
+}
+
+// Return an object to the calling thread's magazine, passing a
+// batch on to the shared list once it holds two batches
+void slabFree(struct Slab *slab, void *object){
+	struct Magazine *magazine = magazineFor(slab);
+
+	if (magazine == NULL){
+		pthread_mutex_lock(&slab->mutex);
+		setNext(object, slab->free);
+		slab->free = object;
+		pthread_mutex_unlock(&slab->mutex);
+		return;
+	}
+
+	setNext(object, magazine->head);
+	magazine->head = object;
+
+	if (++magazine->count < 2 * SLAB_MAGAZINE) return;
+
+	pthread_mutex_lock(&slab->mutex);
+
+	while (magazine->count > SLAB_MAGAZINE){
+		object = magazine->head;
+		magazine->head = nextOf(object);
+		setNext(object, slab->free);
+		slab->free = object;
+		magazine->count--;
+	}
+
+	pthread_mutex_unlock(&slab->mutex);
+}
+
+// Free every chunk. Objects still in use, and the magazines of
+// threads still running, must not be touched afterwards.
+void slabDestroy(struct Slab *slab){
+	pthread_mutex_lock(&slab->mutex);
+
+	while (slab->chunks){
+		struct SlabChunk *chunk = slab->chunks;
+
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+
+	slab->free = NULL;
+	slab->bytes = 0;
+
+	pthread_mutex_unlock(&slab->mutex);
+}
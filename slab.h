@@ -0,0 +1,53 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Slab allocator
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// Pools of fixed size objects, carved out of SLAB_CHUNK_BYTES
+// chunks. Each thread keeps a magazine of free objects per slab,
+// so allocating and freeing are a few pointer moves with no lock
+// and no sharing. A thread whose magazine runs dry takes a batch
+// from the slab's shared free list, carving a new chunk if that is
+// empty too, and a thread with too many gives a batch back. An
+// object may be freed by a different thread than allocated it.
+// A thread's magazine is given back when the thread exits.
+//
+// Chunks are never returned to the system, so a slab's size is
+// the high water mark of its objects, and every object costs its
+// size rounded up to SLAB_ALIGN and nothing more.
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SLAB_CHUNK_BYTES (64 * 1024)
+#define SLAB_ALIGN 16
+
+// Objects a thread moves to or from the shared list at a time
+#define SLAB_MAGAZINE 32
+
+struct SlabChunk {
+	struct SlabChunk *next;
+};
+
+struct Slab {
+	const char *name;
+	size_t size;		// object size, rounded up to SLAB_ALIGN
+	size_t perChunk;
+	pthread_key_t key;	// the calling thread's magazine
+
+	pthread_mutex_t mutex;
+	void *free;		// shared free list
+	struct SlabChunk *chunks;
+	unsigned long bytes;	// carved so far
+};
+
+int slabInit(struct Slab *slab, const char *name, size_t size);
+void *slabAlloc(struct Slab *slab);
+void slabFree(struct Slab *slab, void *object);
+void slabDestroy(struct Slab *slab);
+
+#endif
@@ -0,0 +1,165 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Reloadable tables
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "tables.h"
+
+#define ERROR -1
+
+// How often a reload checks whether old readers have finished
+#define GRACE_POLL_NANOS 100000
+
+unsigned long tablesGeneration = 0, tablesReloads = 0, tablesReloadFailures = 0, tablesRetired = 0;
+
+static struct Tables *current = NULL;
+static TablesLoader load = NULL;
+
+// Readers between loading current and counting their reference,
+// split by the parity of the epoch they started in
+static unsigned long readers[2];
+static unsigned long epoch = 0;
+
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t reloader;
+static sem_t pending;
+
+// Build a generation with the loader, or NULL if it failed
+static struct Tables *build(){
+	struct Tables *tables = calloc(1, sizeof *tables);
+
+	if (tables == NULL) return NULL;
+
+	if (load(tables) == ERROR){
+		free(tables);
+		return NULL;
+	}
+
+	tables->generation = ++tablesGeneration;
+	tables->refs = 1;
+	return tables;
+}
+
+// Wait until every reader that could still be about to count a
+// reference to the old generation has done so
+static void synchronise(){
+	unsigned long old = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	struct timespec poll = { 0, GRACE_POLL_NANOS };
+
+	while (__atomic_load_n(&readers[old], __ATOMIC_SEQ_CST) != 0){
+		nanosleep(&poll, NULL);
+	}
+}
+
+// Load the first generation
+int tablesInit(TablesLoader loader){
+	load = loader;
+
+	if (sem_init(&pending, 0, 0) == -1 || (current = build()) == NULL) return ERROR;
+
+	return 1;
+}
+
+// Take a reference to the current generation. Never blocks.
+struct Tables *tablesAcquire(){
+	unsigned long parity = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST) & 1;
+	struct Tables *tables;
+
+	__atomic_fetch_add(&readers[parity], 1, __ATOMIC_SEQ_CST);
+	tables = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&tables->refs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&readers[parity], 1, __ATOMIC_RELEASE);
+
+	return tables;
+}
+
+// Drop a reference, freeing the generation with the last one
+void tablesRelease(struct Tables *tables){
+	if (__atomic_sub_fetch(&tables->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+	if (tables != __atomic_load_n(&current, __ATOMIC_ACQUIRE)) __atomic_fetch_sub(&tablesRetired, 1, __ATOMIC_RELAXED);
+
+	dictionaryFree(&tables->dictionary);
+	credentialsFree(&tables->credentials);
+	free(tables);
+}
+
+// Load the tables again and publish them. On failure the current
+// generation stays in place. Returns the new generation or ERROR.
+int tablesReload(){
+	struct Tables *next, *old;
+	int generation = ERROR;
+
+	pthread_mutex_lock(&reload_mutex);
+
+	if ((next = build())){
+		old = __atomic_exchange_n(&current, next, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&tablesRetired, 1, __ATOMIC_RELAXED);
+		synchronise();
+		tablesRelease(old);
+
+		__atomic_fetch_add(&tablesReloads, 1, __ATOMIC_RELAXED);
+		generation = next->generation;
+	} else {
+		__atomic_fetch_add(&tablesReloadFailures, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&reload_mutex);
+
+	return generation;
+}
+
+// Reload whenever asked. Requests that arrive during a reload
+// are served by the next one.
+static void *reloadLoop(void *data){
+	while (1){
+		int generation;
+
+		if (sem_wait(&pending) == -1){
+			if (errno == EINTR) continue;
+			return NULL;
+		}
+
+		while (sem_trywait(&pending) == 0);
+
+		if ((generation = tablesReload()) == ERROR){
+			fprintf(stderr, "Reload failed, keeping generation %lu\n", current->generation);
+		} else {
+			printf("Reloaded %zu phrases and %zu accounts as generation %d\n",
+				current->dictionary.entryCount, current->credentials.userCount, generation);
+		}
+	}
+
+	return NULL;
+}
+
+// Start the thread that serves reload requests
+int tablesStartReloader(){
+	if (pthread_create(&reloader, NULL, reloadLoop, NULL) != 0) return ERROR;
+
+	pthread_detach(reloader);
+	return 1;
+}
+
+// Ask for a reload. Safe to call from a signal handler.
+void tablesRequestReload(){
+	sem_post(&pending);
+}
+
+// Drop the published generation. Games still holding it free it
+// when they end.
+void tablesFree(){
+	if (current){
+		tablesRelease(current);
+		current = NULL;
+	}
+}
@@ -0,0 +1,52 @@
+/* ---------------------------------------------------------------- */
+// CAB403: Reloadable tables
+/* ---------------------------------------------------------------- */
+//	Work of Bennett Hardwick and Caleb Plum
+/* ---------------------------------------------------------------- */
+//
+// The dictionary and the credential store are loaded together as
+// one generation. A reload builds the next generation off to the
+// side and publishes it with a single pointer swap, so sessions
+// never see a half loaded table and never stop for a reload.
+//
+// A generation is reference counted. tablesAcquire takes a
+// reference to the current one with a few atomic adds and no
+// locks; a login holds it for the check, and a game holds it
+// from its start until endGame, so the entry it was dealt stays
+// valid however many reloads happen meanwhile. The publisher
+// holds one more, dropped when the generation is replaced. The
+// last release frees it.
+//
+// A reader that has loaded the pointer but not yet counted its
+// reference is covered by an epoch: readers announce themselves
+// in one of two counters, and a reload flips the epoch and waits
+// for the old counter to drain before dropping its reference.
+
+#ifndef TABLES_H
+#define TABLES_H
+
+#include "dictionary.h"
+#include "credentials.h"
+
+struct Tables {
+	struct Dictionary dictionary;
+	struct Credentials credentials;
+	unsigned long generation;
+	unsigned long refs;
+};
+
+// Fill in a new generation's tables. Returns ERROR and leaves
+// nothing allocated if either can't be loaded.
+typedef int (*TablesLoader)(struct Tables *tables);
+
+extern unsigned long tablesGeneration, tablesReloads, tablesReloadFailures, tablesRetired;
+
+int tablesInit(TablesLoader loader);
+struct Tables *tablesAcquire();
+void tablesRelease(struct Tables *tables);
+int tablesReload();
+int tablesStartReloader();
+void tablesRequestReload();
+void tablesFree();
+
+#endif